@@ -2,31 +2,36 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
 
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
+// Everything one emission writes into. Sessions share no state, so each
+// thread can build its own module alongside the others.
+struct EmitSession {
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  std::unique_ptr<llvm::IRBuilder<>> Builder;
+};
 
-static void initializeModule() {
+static void initializeModule(EmitSession &session) {
   // Open a new context and moduel
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("ir_builder", *TheContext);
+  session.TheContext = std::make_unique<llvm::LLVMContext>();
+  session.TheModule = std::make_unique<llvm::Module>("ir_builder", *session.TheContext);
   
   // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+  session.Builder = std::make_unique<llvm::IRBuilder<>>(*session.TheContext);
 }
 
-static void saveModuleIRToFile(const std::string& filename) {
+static void saveModuleIRToFile(EmitSession &session, const std::string& filename) {
   std::error_code errorCode;
   llvm::raw_fd_ostream out(filename, errorCode);
-  TheModule->print(out, nullptr);
+  session.TheModule->print(out, nullptr);
 }
 
 int main(int argc, char *argv[]) {
-  initializeModule();
+  EmitSession session;
+  initializeModule(session);
 
-  TheModule->print(llvm::outs(), nullptr);
+  session.TheModule->print(llvm::outs(), nullptr);
 
-  saveModuleIRToFile("out.ll");
+  saveModuleIRToFile(session, "out.ll");
   return 0;
 }
 
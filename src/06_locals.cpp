@@ -7,144 +7,148 @@
 #include <map>
 #include <string>
 
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
+typedef struct FunProto {
+  llvm::Type *returnType;
+  std::vector<llvm::Type *> params;
+  bool isVarArg;
+} FunProto;
+
+// Everything one emission writes into. Sessions share no state, so each
+// thread can build its own module alongside the others.
+struct EmitSession {
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  std::unique_ptr<llvm::IRBuilder<>> Builder;
+  std::map<std::string, FunProto> funProtoMap;
+};
 
-static void initializeModule() {
+static void initializeModule(EmitSession &session) {
   // Open a new context and moduel
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("ir_builder", *TheContext);
+  session.TheContext = std::make_unique<llvm::LLVMContext>();
+  session.TheModule = std::make_unique<llvm::Module>("ir_builder", *session.TheContext);
   // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+  session.Builder = std::make_unique<llvm::IRBuilder<>>(*session.TheContext);
 }
 
-static void saveModuleIRToFile(const std::string& filename) {
+static void saveModuleIRToFile(EmitSession &session, const std::string& filename) {
   std::error_code errorCode;
   llvm::raw_fd_ostream out(filename, errorCode);
-  TheModule->print(out, nullptr);
+  session.TheModule->print(out, nullptr);
 }
 
-typedef struct FunProto {
-  llvm::Type *returnType;
-  std::vector<llvm::Type *> params;
-  bool isVarArg;
-} FunProto;
-
-static std::map<std::string, FunProto> funProtoMap;
-
-void registerFunctionProto() {
-  auto int32Ty = Builder->getInt32Ty();
-  funProtoMap["main"] = {
+void registerFunctionProto(EmitSession &session) {
+  auto int32Ty = session.Builder->getInt32Ty();
+  session.funProtoMap["main"] = {
     int32Ty,
     {},
     false,
   };
 }
 
-llvm::Function *declareFunction(std::string name) {
-  auto* func = TheModule->getFunction(name);
+llvm::Function *declareFunction(EmitSession &session, std::string name) {
+  auto* func = session.TheModule->getFunction(name);
   if (func == nullptr) {
-    FunProto funProto = funProtoMap[name];
+    FunProto funProto = session.funProtoMap[name];
     auto* funcType = llvm::FunctionType::get(funProto.returnType, funProto.params, funProto.isVarArg);
-    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, TheModule.get());
+    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, session.TheModule.get());
     func->setDSOLocal(true);
   }
   return func;
 }
 
-void emitReturn(llvm::Type *ty, llvm::Value *value) {
+void emitReturn(EmitSession &session, llvm::Type *ty, llvm::Value *value) {
   if (ty->isVoidTy()) {
-    Builder->CreateRetVoid();
+    session.Builder->CreateRetVoid();
   } else {
-    Builder->CreateRet(value);
+    session.Builder->CreateRet(value);
   }
 }
 
-llvm::Value* emitMainFunctionStatementList();
+llvm::Value* emitMainFunctionStatementList(EmitSession &session);
 
-void emitFunctionBody(llvm::Function *fn) {
+void emitFunctionBody(EmitSession &session, llvm::Function *fn) {
   // Create entry basic block
-  auto *entry = llvm::BasicBlock::Create(*TheContext, "entry", fn);
-  Builder->SetInsertPoint(entry);
+  auto *entry = llvm::BasicBlock::Create(*session.TheContext, "entry", fn);
+  session.Builder->SetInsertPoint(entry);
 
   // emit return
-  auto *value = emitMainFunctionStatementList();
-  emitReturn(fn->getReturnType(), value);
+  auto *value = emitMainFunctionStatementList(session);
+  emitReturn(session, fn->getReturnType(), value);
 }
 
-void defineFunction(std::string name) {
+void defineFunction(EmitSession &session, std::string name) {
   // Function must be declated before define
-  auto* fn = TheModule->getFunction(name);
-  emitFunctionBody(fn);
+  auto* fn = session.TheModule->getFunction(name);
+  emitFunctionBody(session, fn);
   verifyFunction(*fn);
 }
 
-llvm::GlobalVariable* defineGlobalVariable(std::string name, llvm::Constant *init) {
-  TheModule->getOrInsertGlobal(name, init->getType());
-  auto *globalVar = TheModule->getNamedGlobal(name);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, std::string name, llvm::Constant *init) {
+  session.TheModule->getOrInsertGlobal(name, init->getType());
+  auto *globalVar = session.TheModule->getNamedGlobal(name);
   globalVar->setInitializer(init);
   globalVar->setDSOLocal(true);
   return globalVar;
 }
 
-llvm::Value* emitLoadValue(llvm::GlobalVariable *value) {
-  return Builder->CreateLoad(value->getInitializer()->getType(), value);
+llvm::Value* emitLoadValue(EmitSession &session, llvm::GlobalVariable *value) {
+  return session.Builder->CreateLoad(value->getInitializer()->getType(), value);
 }
 
-llvm::Value* emitLoadValue(llvm::Value *value) {
+llvm::Value* emitLoadValue(EmitSession &session, llvm::Value *value) {
   auto baseType = value->getType()->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, value);
+  return session.Builder->CreateLoad(baseType, value);
 }
 
-void emitAssign(llvm::Value *left, llvm::Value *right) {
-  Builder->CreateStore(right, left);
+void emitAssign(EmitSession &session, llvm::Value *left, llvm::Value *right) {
+  session.Builder->CreateStore(right, left);
 }
 
-llvm::Value* emitStackLocalVariable(llvm::Type *type, std::string name) {
-  return Builder->CreateAlloca(type, nullptr, name);
+llvm::Value* emitStackLocalVariable(EmitSession &session, llvm::Type *type, std::string name) {
+  return session.Builder->CreateAlloca(type, nullptr, name);
 }
 
-llvm::Value* emitMainFunctionStatementList() {
+llvm::Value* emitMainFunctionStatementList(EmitSession &session) {
   // int local_b;
-  auto local_b = emitStackLocalVariable(
-    Builder->getInt32Ty(),
+  auto local_b = emitStackLocalVariable(session, 
+    session.Builder->getInt32Ty(),
     "local_b"
   );
   // local_b = 2;
-  emitAssign(local_b, Builder->getInt32(2));
+  emitAssign(session, local_b, session.Builder->getInt32(2));
   // %0 = load i32, i32* @global_a
-  auto global_a = TheModule->getGlobalVariable("global_a");
-  auto global_a_rvalue = emitLoadValue(global_a);
+  auto global_a = session.TheModule->getGlobalVariable("global_a");
+  auto global_a_rvalue = emitLoadValue(session, global_a);
   // local_a = a;
-  emitAssign(local_b, global_a_rvalue);
+  emitAssign(session, local_b, global_a_rvalue);
   // %1 = load i32, i32 %local_b
-  auto *value = emitLoadValue(local_b);
+  auto *value = emitLoadValue(session, local_b);
   // return a
   return value;
 }
 
-void emitProgram() {
+void emitProgram(EmitSession &session) {
   // int global_a = 1
-  defineGlobalVariable("global_a", Builder->getInt32(1));
+  defineGlobalVariable(session, "global_a", session.Builder->getInt32(1));
 
-  declareFunction("main");
-  defineFunction("main");
+  declareFunction(session, "main");
+  defineFunction(session, "main");
 }
 
 int main(int argc, char *argv[]) {
-  initializeModule();
+  EmitSession session;
+  initializeModule(session);
 
   auto targetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(targetTriple);
+  session.TheModule->setTargetTriple(targetTriple);
 
-  registerFunctionProto();
+  registerFunctionProto(session);
 
-  emitProgram();
+  emitProgram(session);
 
-  TheModule->print(llvm::outs(), nullptr);
+  session.TheModule->print(llvm::outs(), nullptr);
 
-  saveModuleIRToFile("./out.ll");
+  saveModuleIRToFile(session, "./out.ll");
   return 0;
 }
 
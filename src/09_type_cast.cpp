@@ -1,3 +1,4 @@
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
@@ -7,124 +8,178 @@
 #include <map>
 #include <string>
 
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
+typedef struct FunProto {
+  llvm::Type *returnType;
+  std::vector<llvm::Type *> params;
+  bool isVarArg;
+} FunProto;
+
+// Everything one emission writes into. Sessions share no state, so each
+// thread can build its own module alongside the others.
+struct EmitSession {
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  // Calls onInsert() for every instruction it emits.
+  std::unique_ptr<llvm::IRBuilder<llvm::ConstantFolder, llvm::IRBuilderCallbackInserter>> Builder;
+  std::map<std::string, FunProto> funProtoMap;
+  // Values already loaded from an address in the current block, so reading
+  // it again before a store or call reuses the first load.
+  llvm::DenseMap<llvm::Value *, llvm::Value *> availableLoads;
+  llvm::BasicBlock *availableLoadsBlock = nullptr;
+};
+
+// Whatever may write memory, a store emitted directly through the builder
+// as much as one from emitAssign(), or a call, makes every cached load stale.
+static void onInsert(EmitSession &session, llvm::Instruction *inst) {
+  if (inst->mayWriteToMemory()) {
+    session.availableLoads.clear();
+  }
+}
 
-static void initializeModule() {
+static void initializeModule(EmitSession &session) {
   // Open a new context and moduel
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("ir_builder", *TheContext);
-  // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+  session.TheContext = std::make_unique<llvm::LLVMContext>();
+  session.TheModule = std::make_unique<llvm::Module>("ir_builder", *session.TheContext);
+  // Create a new builder for the module. The session must stay put from here
+  // on, the builder's inserter refers to it.
+  session.Builder = std::make_unique<llvm::IRBuilder<llvm::ConstantFolder, llvm::IRBuilderCallbackInserter>>(
+    *session.TheContext, llvm::ConstantFolder(),
+    llvm::IRBuilderCallbackInserter([&session](llvm::Instruction *inst) { onInsert(session, inst); }));
 }
 
-static void saveModuleIRToFile(const std::string& filename) {
+static void saveModuleIRToFile(EmitSession &session, const std::string& filename) {
   std::error_code errorCode;
   llvm::raw_fd_ostream out(filename, errorCode);
-  TheModule->print(out, nullptr);
+  session.TheModule->print(out, nullptr);
 }
 
-typedef struct FunProto {
-  llvm::Type *returnType;
-  std::vector<llvm::Type *> params;
-  bool isVarArg;
-} FunProto;
-
-static std::map<std::string, FunProto> funProtoMap;
-
-void registerFunctionProto() {
-  auto int32Ty = Builder->getInt32Ty();
-  funProtoMap["main"] = {
+void registerFunctionProto(EmitSession &session) {
+  auto int32Ty = session.Builder->getInt32Ty();
+  session.funProtoMap["main"] = {
     int32Ty,
     {},
     false,
   };
 }
 
-llvm::Function *declareFunction(std::string name) {
-  auto* func = TheModule->getFunction(name);
+llvm::Function *declareFunction(EmitSession &session, std::string name) {
+  auto* func = session.TheModule->getFunction(name);
   if (func == nullptr) {
-    FunProto funProto = funProtoMap[name];
+    FunProto funProto = session.funProtoMap[name];
     auto* funcType = llvm::FunctionType::get(funProto.returnType, funProto.params, funProto.isVarArg);
-    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, TheModule.get());
+    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, session.TheModule.get());
     func->setDSOLocal(true);
   }
   return func;
 }
 
-void emitReturn(llvm::Type *ty, llvm::Value *value) {
+void emitReturn(EmitSession &session, llvm::Type *ty, llvm::Value *value) {
   if (ty->isVoidTy()) {
-    Builder->CreateRetVoid();
+    session.Builder->CreateRetVoid();
   } else {
-    Builder->CreateRet(value);
+    session.Builder->CreateRet(value);
   }
 }
 
-llvm::Value* emitMainFunctionStatementList();
+llvm::Value* emitMainFunctionStatementList(EmitSession &session);
 
-void emitFunctionBody(llvm::Function *fn) {
+void emitFunctionBody(EmitSession &session, llvm::Function *fn) {
   // Create entry basic block
-  auto *entry = llvm::BasicBlock::Create(*TheContext, "entry", fn);
-  Builder->SetInsertPoint(entry);
+  auto *entry = llvm::BasicBlock::Create(*session.TheContext, "entry", fn);
+  session.Builder->SetInsertPoint(entry);
 
   // emit return
-  auto *value = emitMainFunctionStatementList();
-  emitReturn(fn->getReturnType(), value);
+  auto *value = emitMainFunctionStatementList(session);
+  emitReturn(session, fn->getReturnType(), value);
 }
 
-void defineFunction(std::string name) {
+void defineFunction(EmitSession &session, std::string name) {
   // Function must be declated before define
-  auto* fn = TheModule->getFunction(name);
-  emitFunctionBody(fn);
+  auto* fn = session.TheModule->getFunction(name);
+  emitFunctionBody(session, fn);
   verifyFunction(*fn);
 }
 
-llvm::GlobalVariable* defineGlobalVariable(llvm::Type *type, std::string name, llvm::Constant *init) {
-  TheModule->getOrInsertGlobal(name, type);
-  auto *globalVar = TheModule->getNamedGlobal(name);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, llvm::Type *type, std::string name, llvm::Constant *init) {
+  session.TheModule->getOrInsertGlobal(name, type);
+  auto *globalVar = session.TheModule->getNamedGlobal(name);
   globalVar->setInitializer(init);
   globalVar->setDSOLocal(true);
   return globalVar;
 }
 
-llvm::Value* emitLoadValue(llvm::GlobalVariable *value) {
-  return Builder->CreateLoad(value->getInitializer()->getType(), value);
+// Forget every available load.
+void invalidateAvailableLoads(EmitSession &session) {
+  session.availableLoads.clear();
+}
+
+// A load is only available in the block it was emitted in, so start over
+// whenever the builder has moved on to another block.
+void syncAvailableLoadsBlock(EmitSession &session) {
+  auto block = session.Builder->GetInsertBlock();
+  if (block != session.availableLoadsBlock) {
+    invalidateAvailableLoads(session);
+    session.availableLoadsBlock = block;
+  }
+}
+
+// The cached value of `address`, or null.
+llvm::Value* findAvailableLoad(EmitSession &session, llvm::Value *address) {
+  syncAvailableLoadsBlock(session);
+  return session.availableLoads.lookup(address);
+}
+
+llvm::Value* emitLoadValue(EmitSession &session, llvm::GlobalVariable *value) {
+  if (auto available = findAvailableLoad(session, value)) {
+    return available;
+  }
+  auto load = session.Builder->CreateLoad(value->getInitializer()->getType(), value);
+  session.availableLoads[value] = load;
+  return load;
 }
 
-llvm::Value* emitLoadValue(llvm::Value *value) {
+llvm::Value* emitLoadValue(EmitSession &session, llvm::Value *value) {
+  if (auto available = findAvailableLoad(session, value)) {
+    return available;
+  }
   auto baseType = value->getType()->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, value);
+  auto load = session.Builder->CreateLoad(baseType, value);
+  session.availableLoads[value] = load;
+  return load;
 }
 
-llvm::Value* emitLoadGlobalVar(std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  auto rValue = emitLoadValue(globalVar);
+llvm::Value* emitLoadGlobalVar(EmitSession &session, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  auto rValue = emitLoadValue(session, globalVar);
   return rValue;
 }
 
-void emitAssign(llvm::Value *left, llvm::Value *right) {
-  Builder->CreateStore(right, left);
+void emitAssign(EmitSession &session, llvm::Value *left, llvm::Value *right) {
+  // The store drops every cached load, since `left` may alias any of them,
+  // but reading `left` back gives `right`.
+  syncAvailableLoadsBlock(session);
+  session.Builder->CreateStore(right, left);
+  session.availableLoads[left] = right;
 }
 
-llvm::Value* emitStackLocalVariable(llvm::Type *type, std::string name) {
-  return Builder->CreateAlloca(type, nullptr, name);
+llvm::Value* emitStackLocalVariable(EmitSession &session, llvm::Type *type, std::string name) {
+  return session.Builder->CreateAlloca(type, nullptr, name);
 }
 
-void emitConstant(llvm::Type *ty, std::string name, llvm::Constant *init) {
+void emitConstant(EmitSession &session, llvm::Type *ty, std::string name, llvm::Constant *init) {
   // private constant format: @__constant.function_name.variable_name
-  auto currentFunction = Builder->GetInsertBlock()->getParent();
+  auto currentFunction = session.Builder->GetInsertBlock()->getParent();
   std::string funcName = currentFunction->getName().data();
   std::string constVarName = "__constant." + funcName + "."+ name;
 
-  auto constantVar = defineGlobalVariable(ty, constVarName, init);
+  auto constantVar = defineGlobalVariable(session, ty, constVarName, init);
 
   constantVar->setConstant(true);
   constantVar->setLinkage(llvm::GlobalValue::LinkageTypes::PrivateLinkage);
 }
 
-void emitStringPtr(std::string content, std::string name) {
-  auto strPtr = Builder->CreateGlobalStringPtr(content, "." + name);
+void emitStringPtr(EmitSession &session, std::string content, std::string name) {
+  auto strPtr = session.Builder->CreateGlobalStringPtr(content, "." + name);
 }
 
 /**
@@ -133,202 +188,203 @@ void emitStringPtr(std::string content, std::string name) {
  * int i_32 = 3;
  * long i_64 = 4;
  */
-void emitIntegers() {
+void emitIntegers(EmitSession &session) {
   // char i_8 = 1;
-  defineGlobalVariable(Builder->getInt8Ty(), "i_8", Builder->getInt8(1));
+  defineGlobalVariable(session, session.Builder->getInt8Ty(), "i_8", session.Builder->getInt8(1));
 
   // short i_16 = 2;
-  defineGlobalVariable(Builder->getInt16Ty(), "i_16", Builder->getInt16(2));
+  defineGlobalVariable(session, session.Builder->getInt16Ty(), "i_16", session.Builder->getInt16(2));
 
   // int i_32 = 3;
-  defineGlobalVariable(Builder->getInt32Ty(), "i_32", Builder->getInt32(3));
+  defineGlobalVariable(session, session.Builder->getInt32Ty(), "i_32", session.Builder->getInt32(3));
 
   // long i_64 = 4;
-  defineGlobalVariable(Builder->getInt64Ty(), "i_64", Builder->getInt64(4));
+  defineGlobalVariable(session, session.Builder->getInt64Ty(), "i_64", session.Builder->getInt64(4));
 
   // unsigned char ui_8 = 1
-  defineGlobalVariable(Builder->getInt8Ty(), "ui_8", Builder->getInt8(1));
+  defineGlobalVariable(session, session.Builder->getInt8Ty(), "ui_8", session.Builder->getInt8(1));
 
   // unsigned int ui_32 = 3;
-  defineGlobalVariable(Builder->getInt32Ty(), "ui_32", Builder->getInt32(3));
+  defineGlobalVariable(session, session.Builder->getInt32Ty(), "ui_32", session.Builder->getInt32(3));
 
 }
 
-void emitFloats() {
+void emitFloats(EmitSession &session) {
   // float f = 1.0;
-  defineGlobalVariable(Builder->getFloatTy(), "f", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, session.Builder->getFloatTy(), "f", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // double d = 2.0
-  defineGlobalVariable(Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(Builder->getDoubleTy(), 2.0));
+  defineGlobalVariable(session, session.Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(session.Builder->getDoubleTy(), 2.0));
   
   //long double ld = 3.0;
-  auto ldType = llvm::Type::getX86_FP80Ty(*TheContext);
-  defineGlobalVariable(ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
+  auto ldType = llvm::Type::getX86_FP80Ty(*session.TheContext);
+  defineGlobalVariable(session, ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
 }
 
 // int arr[] = { 1, 2, 3, 4 };
-void emitArray() {
+void emitArray(EmitSession &session) {
   // int arr[4];
   int num = 4;
-  llvm::Type *ty = Builder->getInt32Ty();
+  llvm::Type *ty = session.Builder->getInt32Ty();
   llvm::ArrayType *arrType = llvm::ArrayType::get(ty, num);
 
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
-  list.push_back(Builder->getInt32(2));
-  list.push_back(Builder->getInt32(3));
-  list.push_back(Builder->getInt32(4));
+  list.push_back(session.Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(2));
+  list.push_back(session.Builder->getInt32(3));
+  list.push_back(session.Builder->getInt32(4));
 
   llvm::Constant *c = llvm::ConstantArray::get(arrType, list);
 
-  defineGlobalVariable(arrType, "arr", c);
+  defineGlobalVariable(session, arrType, "arr", c);
 }
 
 /**
  * struct point { int x; int y; };
  * struct point point = { 1, 2 };
  */
-void emitStruct() {
+void emitStruct(EmitSession &session) {
   // struct point { int x; int y; }
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "struct.point");
-  structTy->setBody({Builder->getInt32Ty(), Builder->getInt32Ty()});
+  llvm::StructType *structTy = llvm::StructType::create(*session.TheContext, "struct.point");
+  structTy->setBody({session.Builder->getInt32Ty(), session.Builder->getInt32Ty()});
 
   // struct point  = { 11, 12 }
   int num = 2;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(11));
-  list.push_back(Builder->getInt32(12));
+  list.push_back(session.Builder->getInt32(11));
+  list.push_back(session.Builder->getInt32(12));
   
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
 
-  defineGlobalVariable(structTy, "pointer", c);
+  defineGlobalVariable(session, structTy, "pointer", c);
 }
 
 /**
  * union ab  {  int a;  float b; };
  * union ab u = { 1 };
  */
-void emitUnion() {
+void emitUnion(EmitSession &session) {
   // union ab  {  int a;  float b; };
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "union.ab");
-  structTy->setBody(Builder->getInt32Ty());
+  llvm::StructType *structTy = llvm::StructType::create(*session.TheContext, "union.ab");
+  structTy->setBody(session.Builder->getInt32Ty());
 
   // union ab u = { 1 };
   int num = 1;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(1));
 
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
-  defineGlobalVariable(structTy, "u", c);
+  defineGlobalVariable(session, structTy, "u", c);
 }
 
-void emitPointer() {
+void emitPointer(EmitSession &session) {
   // int *i_p;
-  auto pointerTy = llvm::PointerType::get(Builder->getInt32Ty(), 0);
+  auto pointerTy = llvm::PointerType::get(session.Builder->getInt32Ty(), 0);
   auto c = llvm::Constant::getNullValue(pointerTy);
-  defineGlobalVariable(pointerTy, "i_p", c);
+  defineGlobalVariable(session, pointerTy, "i_p", c);
 
   // char *c_p;
-  auto charPtrTy = llvm::PointerType::get(Builder->getInt8Ty(), 0);
+  auto charPtrTy = llvm::PointerType::get(session.Builder->getInt8Ty(), 0);
   auto cCharPtr = llvm::Constant::getNullValue(charPtrTy);
-  defineGlobalVariable(charPtrTy, "c_p", cCharPtr);
+  defineGlobalVariable(session, charPtrTy, "c_p", cCharPtr);
 }
 
 // char *str = "hello\n";
-void emitConstString() {
-  emitStringPtr("hello", "str");
+void emitConstString(EmitSession &session) {
+  emitStringPtr(session, "hello", "str");
 }
 
 
-llvm::Value* emitMainFunctionStatementList() {
+llvm::Value* emitMainFunctionStatementList(EmitSession &session) {
   // int i_32 = 3; (char)i_32
-  auto value = emitLoadGlobalVar("i_32");
-  auto intTrunc = Builder->CreateTrunc(value, Builder->getInt8Ty());
+  auto value = emitLoadGlobalVar(session, "i_32");
+  auto intTrunc = session.Builder->CreateTrunc(value, session.Builder->getInt8Ty());
   
   // unsigned int ui_32 = 3; (unsigned char)ui_32;
-  value = emitLoadGlobalVar("ui_32");
-  intTrunc = Builder->CreateTrunc(value, Builder->getInt8Ty());
+  value = emitLoadGlobalVar(session, "ui_32");
+  intTrunc = session.Builder->CreateTrunc(value, session.Builder->getInt8Ty());
 
   // char i_8 = 1; (int) i_8;
-  auto extValue = emitLoadGlobalVar("i_8");
-  auto intSExt = Builder->CreateSExt(extValue, Builder->getInt32Ty());
+  auto extValue = emitLoadGlobalVar(session, "i_8");
+  auto intSExt = session.Builder->CreateSExt(extValue, session.Builder->getInt32Ty());
 
   // unsigned ui_8 = 1; (unisgned int) ui_8;
- extValue = emitLoadGlobalVar("ui_8");
- intSExt = Builder->CreateZExt(extValue, Builder->getInt32Ty());
+ extValue = emitLoadGlobalVar(session, "ui_8");
+ intSExt = session.Builder->CreateZExt(extValue, session.Builder->getInt32Ty());
 
 
  // float f = 1.0;
  // double df = 2.0;
  // (float)df;
- auto fV = emitLoadGlobalVar("df");
- auto fTrunc = Builder->CreateFPTrunc(fV, Builder->getFloatTy());
+ auto fV = emitLoadGlobalVar(session, "df");
+ auto fTrunc = session.Builder->CreateFPTrunc(fV, session.Builder->getFloatTy());
 
  // (double)f;
- fV = emitLoadGlobalVar("f");
- auto fExt = Builder->CreateFPExt(fV, Builder->getDoubleTy());
+ fV = emitLoadGlobalVar(session, "f");
+ auto fExt = session.Builder->CreateFPExt(fV, session.Builder->getDoubleTy());
 
   // (int)f;
-  fV = emitLoadGlobalVar("f");
-  auto toInt = Builder->CreateFPToSI(fV, Builder->getInt32Ty());
+  fV = emitLoadGlobalVar(session, "f");
+  auto toInt = session.Builder->CreateFPToSI(fV, session.Builder->getInt32Ty());
 
   // (unsigned int )f;
-  fV = emitLoadGlobalVar("f");
-  toInt = Builder->CreateFPToUI(fV, Builder->getInt32Ty());
+  fV = emitLoadGlobalVar(session, "f");
+  toInt = session.Builder->CreateFPToUI(fV, session.Builder->getInt32Ty());
 
   // (float)i_32;
-  auto intV = emitLoadGlobalVar("i_32");
-  auto toF = Builder->CreateSIToFP(intV, Builder->getFloatTy());
+  auto intV = emitLoadGlobalVar(session, "i_32");
+  auto toF = session.Builder->CreateSIToFP(intV, session.Builder->getFloatTy());
 
   // (float)ui_32;
-  toF = Builder->CreateUIToFP(intV, Builder->getFloatTy());
+  toF = session.Builder->CreateUIToFP(intV, session.Builder->getFloatTy());
 
   // int *i_p;
   // char *c_p;
   // long i_64 = 4;
   // (int *) i_64;
-  auto longV = emitLoadGlobalVar("i_64");
-  auto intToPtr = Builder->CreateIntToPtr(longV, Builder->getInt32Ty()->getPointerTo());
+  auto longV = emitLoadGlobalVar(session, "i_64");
+  auto intToPtr = session.Builder->CreateIntToPtr(longV, session.Builder->getInt32Ty()->getPointerTo());
 
   // (long) i_p;
-  auto ptrV = emitLoadGlobalVar("i_p");
-  auto ptrToInt = Builder->CreatePtrToInt(ptrV, Builder->getInt64Ty());
+  auto ptrV = emitLoadGlobalVar(session, "i_p");
+  auto ptrToInt = session.Builder->CreatePtrToInt(ptrV, session.Builder->getInt64Ty());
 
   // (char *)i_p;
-  ptrV = emitLoadGlobalVar("i_p");
-  auto bitCast = Builder->CreateBitCast(ptrV, Builder->getInt8Ty()->getPointerTo());
+  ptrV = emitLoadGlobalVar(session, "i_p");
+  auto bitCast = session.Builder->CreateBitCast(ptrV, session.Builder->getInt8Ty()->getPointerTo());
 
   // return i_32;
   return value;
 }
 
-void emitProgram() {
-  emitIntegers();
-  emitFloats();
-  emitArray();
-  emitPointer();
-  emitStruct();
-  emitUnion();
+void emitProgram(EmitSession &session) {
+  emitIntegers(session);
+  emitFloats(session);
+  emitArray(session);
+  emitPointer(session);
+  emitStruct(session);
+  emitUnion(session);
 
-  declareFunction("main");
-  defineFunction("main");
+  declareFunction(session, "main");
+  defineFunction(session, "main");
 }
 
 int main(int argc, char *argv[]) {
-  initializeModule();
+  EmitSession session;
+  initializeModule(session);
 
   auto targetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(targetTriple);
+  session.TheModule->setTargetTriple(targetTriple);
 
-  registerFunctionProto();
+  registerFunctionProto(session);
 
-  emitProgram();
+  emitProgram(session);
 
-  TheModule->print(llvm::outs(), nullptr);
+  session.TheModule->print(llvm::outs(), nullptr);
 
-  saveModuleIRToFile("./out.ll");
+  saveModuleIRToFile(session, "./out.ll");
   return 0;
 }
@@ -1,29 +1,21 @@
+#include "llvm/Analysis/InstSimplifyFolder.h"
+#include "llvm/Analysis/InstructionSimplify.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Host.h"
 
 #include <map>
 #include <string>
 
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
+static llvm::cl::opt<bool> Simplify("simplify",
+  llvm::cl::desc("Build with InstSimplifyFolder, so simplifiable instructions are never emitted"));
 
-static void initializeModule() {
-  // Open a new context and moduel
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("ir_builder", *TheContext);
-  // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
-}
-
-static void saveModuleIRToFile(const std::string& filename) {
-  std::error_code errorCode;
-  llvm::raw_fd_ostream out(filename, errorCode);
-  TheModule->print(out, nullptr);
-}
+static llvm::cl::opt<bool> FoldConstantGlobals("fold-constant-globals",
+  llvm::cl::desc("Give the globals internal linkage, as in a whole-program build, and read the ones nothing writes as their initializers"));
 
 typedef struct FunProto {
   llvm::Type *returnType;
@@ -31,100 +23,134 @@ typedef struct FunProto {
   bool isVarArg;
 } FunProto;
 
-static std::map<std::string, FunProto> funProtoMap;
+// Everything one emission writes into. Sessions share no state, so each
+// thread can build its own module alongside the others.
+struct EmitSession {
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  // Whichever of the two builders below initializeModule() created.
+  llvm::IRBuilderBase *Builder = nullptr;
+  std::unique_ptr<llvm::IRBuilder<>> FoldingBuilder;
+  std::unique_ptr<llvm::IRBuilder<llvm::InstSimplifyFolder>> SimplifyingBuilder;
+  std::map<std::string, FunProto> funProtoMap;
+};
+
+static void initializeModule(EmitSession &session) {
+  // Open a new context and moduel
+  session.TheContext = std::make_unique<llvm::LLVMContext>();
+  session.TheModule = std::make_unique<llvm::Module>("ir_builder", *session.TheContext);
+  // Create a new builder for the module.
+  if (Simplify) {
+    llvm::InstSimplifyFolder folder(session.TheModule->getDataLayout());
+    session.SimplifyingBuilder = std::make_unique<llvm::IRBuilder<llvm::InstSimplifyFolder>>(*session.TheContext, folder);
+    session.Builder = session.SimplifyingBuilder.get();
+  } else {
+    session.FoldingBuilder = std::make_unique<llvm::IRBuilder<>>(*session.TheContext);
+    session.Builder = session.FoldingBuilder.get();
+  }
+}
 
-void registerFunctionProto() {
-  auto int32Ty = Builder->getInt32Ty();
-  funProtoMap["main"] = {
+static void saveModuleIRToFile(EmitSession &session, const std::string& filename) {
+  std::error_code errorCode;
+  llvm::raw_fd_ostream out(filename, errorCode);
+  session.TheModule->print(out, nullptr);
+}
+
+void registerFunctionProto(EmitSession &session) {
+  auto int32Ty = session.Builder->getInt32Ty();
+  session.funProtoMap["main"] = {
     int32Ty,
     {},
     false,
   };
 }
 
-llvm::Function *declareFunction(std::string name) {
-  auto* func = TheModule->getFunction(name);
+llvm::Function *declareFunction(EmitSession &session, std::string name) {
+  auto* func = session.TheModule->getFunction(name);
   if (func == nullptr) {
-    FunProto funProto = funProtoMap[name];
+    FunProto funProto = session.funProtoMap[name];
     auto* funcType = llvm::FunctionType::get(funProto.returnType, funProto.params, funProto.isVarArg);
-    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, TheModule.get());
+    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, session.TheModule.get());
     func->setDSOLocal(true);
   }
   return func;
 }
 
-void emitReturn(llvm::Type *ty, llvm::Value *value) {
+void emitReturn(EmitSession &session, llvm::Type *ty, llvm::Value *value) {
   if (ty->isVoidTy()) {
-    Builder->CreateRetVoid();
+    session.Builder->CreateRetVoid();
   } else {
-    Builder->CreateRet(value);
+    session.Builder->CreateRet(value);
   }
 }
 
-llvm::Value* emitMainFunctionStatementList();
+llvm::Value* emitMainFunctionStatementList(EmitSession &session);
 
-void emitFunctionBody(llvm::Function *fn) {
+void emitFunctionBody(EmitSession &session, llvm::Function *fn) {
   // Create entry basic block
-  auto *entry = llvm::BasicBlock::Create(*TheContext, "entry", fn);
-  Builder->SetInsertPoint(entry);
+  auto *entry = llvm::BasicBlock::Create(*session.TheContext, "entry", fn);
+  session.Builder->SetInsertPoint(entry);
 
   // emit return
-  auto *value = emitMainFunctionStatementList();
-  emitReturn(fn->getReturnType(), value);
+  auto *value = emitMainFunctionStatementList(session);
+  emitReturn(session, fn->getReturnType(), value);
 }
 
-void defineFunction(std::string name) {
+void defineFunction(EmitSession &session, std::string name) {
   // Function must be declated before define
-  auto* fn = TheModule->getFunction(name);
-  emitFunctionBody(fn);
+  auto* fn = session.TheModule->getFunction(name);
+  emitFunctionBody(session, fn);
   verifyFunction(*fn);
 }
 
-llvm::GlobalVariable* defineGlobalVariable(llvm::Type *type, std::string name, llvm::Constant *init) {
-  TheModule->getOrInsertGlobal(name, type);
-  auto *globalVar = TheModule->getNamedGlobal(name);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, llvm::Type *type, std::string name, llvm::Constant *init) {
+  session.TheModule->getOrInsertGlobal(name, type);
+  auto *globalVar = session.TheModule->getNamedGlobal(name);
   globalVar->setInitializer(init);
   globalVar->setDSOLocal(true);
+  if (FoldConstantGlobals) {
+    globalVar->setLinkage(llvm::GlobalValue::InternalLinkage);
+  }
   return globalVar;
 }
 
-llvm::Value* emitLoadValue(llvm::GlobalVariable *value) {
-  return Builder->CreateLoad(value->getInitializer()->getType(), value);
+llvm::Value* emitLoadValue(EmitSession &session, llvm::GlobalVariable *value) {
+  return session.Builder->CreateLoad(value->getInitializer()->getType(), value);
 }
 
-llvm::Value* emitLoadValue(llvm::Value *value) {
+llvm::Value* emitLoadValue(EmitSession &session, llvm::Value *value) {
   auto baseType = value->getType()->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, value);
+  return session.Builder->CreateLoad(baseType, value);
 }
 
-llvm::Value* emitLoadGlobalVar(std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  auto rValue = emitLoadValue(globalVar);
+llvm::Value* emitLoadGlobalVar(EmitSession &session, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name, /*AllowInternal=*/true);
+  auto rValue = emitLoadValue(session, globalVar);
   return rValue;
 }
 
-void emitAssign(llvm::Value *left, llvm::Value *right) {
-  Builder->CreateStore(right, left);
+void emitAssign(EmitSession &session, llvm::Value *left, llvm::Value *right) {
+  session.Builder->CreateStore(right, left);
 }
 
-llvm::Value* emitStackLocalVariable(llvm::Type *type, std::string name) {
-  return Builder->CreateAlloca(type, nullptr, name);
+llvm::Value* emitStackLocalVariable(EmitSession &session, llvm::Type *type, std::string name) {
+  return session.Builder->CreateAlloca(type, nullptr, name);
 }
 
-void emitConstant(llvm::Type *ty, std::string name, llvm::Constant *init) {
+void emitConstant(EmitSession &session, llvm::Type *ty, std::string name, llvm::Constant *init) {
   // private constant format: @__constant.function_name.variable_name
-  auto currentFunction = Builder->GetInsertBlock()->getParent();
+  auto currentFunction = session.Builder->GetInsertBlock()->getParent();
   std::string funcName = currentFunction->getName().data();
   std::string constVarName = "__constant." + funcName + "."+ name;
 
-  auto constantVar = defineGlobalVariable(ty, constVarName, init);
+  auto constantVar = defineGlobalVariable(session, ty, constVarName, init);
 
   constantVar->setConstant(true);
   constantVar->setLinkage(llvm::GlobalValue::LinkageTypes::PrivateLinkage);
 }
 
-void emitStringPtr(std::string content, std::string name) {
-  auto strPtr = Builder->CreateGlobalStringPtr(content, "." + name);
+void emitStringPtr(EmitSession &session, std::string content, std::string name) {
+  auto strPtr = session.Builder->CreateGlobalStringPtr(content, "." + name);
 }
 
 /**
@@ -133,167 +159,223 @@ void emitStringPtr(std::string content, std::string name) {
  * int i_32 = 3;
  * long i_64 = 4;
  */
-void emitIntegers() {
+void emitIntegers(EmitSession &session) {
   // char i_8 = 1;
-  defineGlobalVariable(Builder->getInt8Ty(), "i_8", Builder->getInt8(1));
+  defineGlobalVariable(session, session.Builder->getInt8Ty(), "i_8", session.Builder->getInt8(1));
 
   // short i_16 = 2;
-  defineGlobalVariable(Builder->getInt16Ty(), "i_16", Builder->getInt16(2));
+  defineGlobalVariable(session, session.Builder->getInt16Ty(), "i_16", session.Builder->getInt16(2));
 
   // int i_32 = 3;
-  defineGlobalVariable(Builder->getInt32Ty(), "i_32", Builder->getInt32(3));
+  defineGlobalVariable(session, session.Builder->getInt32Ty(), "i_32", session.Builder->getInt32(3));
 
   // long i_64 = 4;
-  defineGlobalVariable(Builder->getInt64Ty(), "i_64", Builder->getInt64(4));
+  defineGlobalVariable(session, session.Builder->getInt64Ty(), "i_64", session.Builder->getInt64(4));
 
   // unsigned char ui_8 = 1
-  defineGlobalVariable(Builder->getInt8Ty(), "ui_8", Builder->getInt8(1));
+  defineGlobalVariable(session, session.Builder->getInt8Ty(), "ui_8", session.Builder->getInt8(1));
 
   // unsigned int ui_32 = 3;
-  defineGlobalVariable(Builder->getInt32Ty(), "ui_32", Builder->getInt32(3));
+  defineGlobalVariable(session, session.Builder->getInt32Ty(), "ui_32", session.Builder->getInt32(3));
 
 }
 
-void emitFloats() {
+void emitFloats(EmitSession &session) {
   // float f = 1.0;
-  defineGlobalVariable(Builder->getFloatTy(), "f", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, session.Builder->getFloatTy(), "f", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // double d = 2.0
-  defineGlobalVariable(Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(Builder->getDoubleTy(), 2.0));
+  defineGlobalVariable(session, session.Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(session.Builder->getDoubleTy(), 2.0));
   
   //long double ld = 3.0;
-  auto ldType = llvm::Type::getX86_FP80Ty(*TheContext);
-  defineGlobalVariable(ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
+  auto ldType = llvm::Type::getX86_FP80Ty(*session.TheContext);
+  defineGlobalVariable(session, ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
 }
 
 // int arr[] = { 1, 2, 3, 4 };
-void emitArray() {
+void emitArray(EmitSession &session) {
   // int arr[4];
   int num = 4;
-  llvm::Type *ty = Builder->getInt32Ty();
+  llvm::Type *ty = session.Builder->getInt32Ty();
   llvm::ArrayType *arrType = llvm::ArrayType::get(ty, num);
 
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
-  list.push_back(Builder->getInt32(2));
-  list.push_back(Builder->getInt32(3));
-  list.push_back(Builder->getInt32(4));
+  list.push_back(session.Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(2));
+  list.push_back(session.Builder->getInt32(3));
+  list.push_back(session.Builder->getInt32(4));
 
   llvm::Constant *c = llvm::ConstantArray::get(arrType, list);
 
-  defineGlobalVariable(arrType, "arr", c);
+  defineGlobalVariable(session, arrType, "arr", c);
 }
 
 /**
  * struct point { int x; int y; };
  * struct point point = { 1, 2 };
  */
-void emitStruct() {
+void emitStruct(EmitSession &session) {
   // struct point { int x; int y; }
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "struct.point");
-  structTy->setBody({Builder->getInt32Ty(), Builder->getInt32Ty()});
+  llvm::StructType *structTy = llvm::StructType::create(*session.TheContext, "struct.point");
+  structTy->setBody({session.Builder->getInt32Ty(), session.Builder->getInt32Ty()});
 
   // struct point  = { 11, 12 }
   int num = 2;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(11));
-  list.push_back(Builder->getInt32(12));
+  list.push_back(session.Builder->getInt32(11));
+  list.push_back(session.Builder->getInt32(12));
   
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
 
-  defineGlobalVariable(structTy, "pointer", c);
+  defineGlobalVariable(session, structTy, "pointer", c);
 }
 
 /**
  * union ab  {  int a;  float b; };
  * union ab u = { 1 };
  */
-void emitUnion() {
+void emitUnion(EmitSession &session) {
   // union ab  {  int a;  float b; };
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "union.ab");
-  structTy->setBody(Builder->getInt32Ty());
+  llvm::StructType *structTy = llvm::StructType::create(*session.TheContext, "union.ab");
+  structTy->setBody(session.Builder->getInt32Ty());
 
   // union ab u = { 1 };
   int num = 1;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(1));
 
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
-  defineGlobalVariable(structTy, "u", c);
+  defineGlobalVariable(session, structTy, "u", c);
 }
 
-void emitPointer() {
+void emitPointer(EmitSession &session) {
   // int *i_p;
-  auto pointerTy = llvm::PointerType::get(Builder->getInt32Ty(), 0);
+  auto pointerTy = llvm::PointerType::get(session.Builder->getInt32Ty(), 0);
   auto c = llvm::Constant::getNullValue(pointerTy);
-  defineGlobalVariable(pointerTy, "i_p", c);
+  defineGlobalVariable(session, pointerTy, "i_p", c);
 
   // char *c_p;
-  auto charPtrTy = llvm::PointerType::get(Builder->getInt8Ty(), 0);
+  auto charPtrTy = llvm::PointerType::get(session.Builder->getInt8Ty(), 0);
   auto cCharPtr = llvm::Constant::getNullValue(charPtrTy);
-  defineGlobalVariable(charPtrTy, "c_p", cCharPtr);
+  defineGlobalVariable(session, charPtrTy, "c_p", cCharPtr);
 }
 
 // char *str = "hello\n";
-void emitConstString() {
-  emitStringPtr("hello", "str");
+void emitConstString(EmitSession &session) {
+  emitStringPtr(session, "hello", "str");
 }
 
-llvm::Value* emitMainFunctionStatementList() {
-  auto sV = emitLoadGlobalVar("i_32");
-  auto uV = emitLoadGlobalVar("ui_32");
+llvm::Value* emitMainFunctionStatementList(EmitSession &session) {
+  auto sV = emitLoadGlobalVar(session, "i_32");
+  auto uV = emitLoadGlobalVar(session, "ui_32");
 
-  auto offset = Builder->getInt32(1);
+  auto offset = session.Builder->getInt32(1);
   // i32_1 << 1;
-  Builder->CreateShl(sV, offset);
+  session.Builder->CreateShl(sV, offset);
 
   // ui32_1 << 1;
-  Builder->CreateShl(uV, offset);
+  session.Builder->CreateShl(uV, offset);
 
   // i32_1 ->> 1;
-  Builder->CreateAShr(sV, offset);
+  session.Builder->CreateAShr(sV, offset);
 
   // ui32_1 >> 1;
-  Builder->CreateLShr(uV, offset);
+  session.Builder->CreateLShr(uV, offset);
 
   // i32_1 & ui32_1;
-  Builder->CreateAnd(sV, uV);
+  session.Builder->CreateAnd(sV, uV);
 
   // i32_1 | ui32_1;
-  Builder->CreateOr(sV, uV);
+  session.Builder->CreateOr(sV, uV);
 
   // i32_1 ^ ui32_1;
-  Builder->CreateXor(sV, uV);
+  session.Builder->CreateXor(sV, uV);
 
   // ~i32_1 -> i32_1 ^ -1;
-  Builder->CreateXor(sV, Builder->getInt32(-1));
+  session.Builder->CreateXor(sV, session.Builder->getInt32(-1));
+
+  // return (i32_1 & i32_1) | (ui32_1 & 0); which --simplify emits as return i32_1;
+  auto same = session.Builder->CreateAnd(sV, sV);
+  auto zero = session.Builder->CreateAnd(uV, session.Builder->getInt32(0));
+  return session.Builder->CreateOr(same, zero);
+}
 
-  // return i32_1;
-  return sV;
+// Replace every load of a global that nothing in the finished module writes
+// or takes the address of with its initializer, then simplify what used the
+// loads. Only globals with local linkage qualify, since a global another
+// unit can name may be stored to there; those are marked constant as well.
+void foldConstantGlobals(EmitSession &session) {
+  bool folded = false;
+  for (auto &global : session.TheModule->globals()) {
+    if (!global.hasLocalLinkage() || !global.hasDefinitiveInitializer()) {
+      continue;
+    }
+    llvm::SmallVector<llvm::LoadInst *, 8> loads;
+    bool onlyLoaded = llvm::all_of(global.users(), [&](llvm::User *user) {
+      auto load = llvm::dyn_cast<llvm::LoadInst>(user);
+      if (load == nullptr || load->isVolatile() || load->getType() != global.getValueType()) {
+        return false;
+      }
+      loads.push_back(load);
+      return true;
+    });
+    if (!onlyLoaded) {
+      continue;
+    }
+    global.setConstant(true);
+    for (auto *load : loads) {
+      load->replaceAllUsesWith(global.getInitializer());
+      load->eraseFromParent();
+      folded = true;
+    }
+  }
+
+  // Operands are defined before their users, so each sweep in program order
+  // sees an instruction after everything it uses; repeat until nothing folds.
+  auto &dataLayout = session.TheModule->getDataLayout();
+  while (folded) {
+    folded = false;
+    for (auto &fn : *session.TheModule) {
+      for (auto &inst : llvm::make_early_inc_range(llvm::instructions(fn))) {
+        if (auto simplified = llvm::SimplifyInstruction(&inst, { dataLayout, &inst })) {
+          inst.replaceAllUsesWith(simplified);
+          inst.eraseFromParent();
+          folded = true;
+        }
+      }
+    }
+  }
 }
 
-void emitProgram() {
-  emitIntegers();
+void emitProgram(EmitSession &session) {
+  emitIntegers(session);
 
-  declareFunction("main");
-  defineFunction("main");
+  declareFunction(session, "main");
+  defineFunction(session, "main");
+
+  if (FoldConstantGlobals) {
+    foldConstantGlobals(session);
+  }
 }
 
 int main(int argc, char *argv[]) {
-  initializeModule();
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+
+  EmitSession session;
+  initializeModule(session);
 
   auto targetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(targetTriple);
+  session.TheModule->setTargetTriple(targetTriple);
 
-  registerFunctionProto();
+  registerFunctionProto(session);
 
-  emitProgram();
+  emitProgram(session);
 
-  TheModule->print(llvm::outs(), nullptr);
+  session.TheModule->print(llvm::outs(), nullptr);
 
-  saveModuleIRToFile("./out.ll");
+  saveModuleIRToFile(session, "./out.ll");
   return 0;
 }
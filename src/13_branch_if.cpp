@@ -1,29 +1,28 @@
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Host.h"
 
 #include <map>
 #include <string>
 
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
+enum IfLowering { IfBranches, IfSelect, IfAuto };
 
-static void initializeModule() {
-  // Open a new context and moduel
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("ir_builder", *TheContext);
-  // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
-}
+static llvm::cl::opt<IfLowering> Lowering("if-lowering",
+  llvm::cl::desc("How to emit an if/else whose arms only assign a value"),
+  llvm::cl::values(
+    clEnumValN(IfBranches, "branches", "then, else and ifEnd blocks"),
+    clEnumValN(IfSelect, "select", "a select, when both arms are safe to speculate"),
+    clEnumValN(IfAuto, "auto", "branches when the site is hinted likely either way, a select otherwise")),
+  llvm::cl::init(IfBranches));
 
-static void saveModuleIRToFile(const std::string& filename) {
-  std::error_code errorCode;
-  llvm::raw_fd_ostream out(filename, errorCode);
-  TheModule->print(out, nullptr);
-}
+// What a site knows about its condition, the way __builtin_expect and
+// __builtin_unpredictable would tell clang.
+enum BranchHint { HintNone, HintLikelyTrue, HintLikelyFalse, HintUnpredictable };
 
 typedef struct FunProto {
   llvm::Type *returnType;
@@ -31,113 +30,134 @@ typedef struct FunProto {
   bool isVarArg;
 } FunProto;
 
-static std::map<std::string, FunProto> funProtoMap;
+// Everything one emission writes into. Sessions share no state, so each
+// thread can build its own module alongside the others.
+struct EmitSession {
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  std::unique_ptr<llvm::IRBuilder<>> Builder;
+  std::map<std::string, FunProto> funProtoMap;
+};
+
+static void initializeModule(EmitSession &session) {
+  // Open a new context and moduel
+  session.TheContext = std::make_unique<llvm::LLVMContext>();
+  session.TheModule = std::make_unique<llvm::Module>("ir_builder", *session.TheContext);
+  // Create a new builder for the module.
+  session.Builder = std::make_unique<llvm::IRBuilder<>>(*session.TheContext);
+}
+
+static void saveModuleIRToFile(EmitSession &session, const std::string& filename) {
+  std::error_code errorCode;
+  llvm::raw_fd_ostream out(filename, errorCode);
+  session.TheModule->print(out, nullptr);
+}
 
-void registerFunctionProto() {
-  auto int32Ty = Builder->getInt32Ty();
-  funProtoMap["main"] = {
+void registerFunctionProto(EmitSession &session) {
+  auto int32Ty = session.Builder->getInt32Ty();
+  session.funProtoMap["main"] = {
     int32Ty,
     {},
     false,
   };
 }
 
-llvm::Function *declareFunction(std::string name) {
-  auto* func = TheModule->getFunction(name);
+llvm::Function *declareFunction(EmitSession &session, std::string name) {
+  auto* func = session.TheModule->getFunction(name);
   if (func == nullptr) {
-    FunProto funProto = funProtoMap[name];
+    FunProto funProto = session.funProtoMap[name];
     auto* funcType = llvm::FunctionType::get(funProto.returnType, funProto.params, funProto.isVarArg);
-    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, TheModule.get());
+    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, session.TheModule.get());
     func->setDSOLocal(true);
   }
   return func;
 }
 
-void emitReturn(llvm::Type *ty, llvm::Value *value) {
+void emitReturn(EmitSession &session, llvm::Type *ty, llvm::Value *value) {
   if (ty->isVoidTy()) {
-    Builder->CreateRetVoid();
+    session.Builder->CreateRetVoid();
   } else {
-    Builder->CreateRet(value);
+    session.Builder->CreateRet(value);
   }
 }
 
-llvm::BasicBlock* createBB(llvm::Function *fn, std::string name) {
-  return llvm::BasicBlock::Create(*TheContext, name, fn);
+llvm::BasicBlock* createBB(EmitSession &session, llvm::Function *fn, std::string name) {
+  return llvm::BasicBlock::Create(*session.TheContext, name, fn);
 }
 
-llvm::Value* emitMainFunctionStatementList(llvm::Function *);
+llvm::Value* emitMainFunctionStatementList(EmitSession &, llvm::Function *);
 
-void emitFunctionBody(llvm::Function *fn) {
+void emitFunctionBody(EmitSession &session, llvm::Function *fn) {
   // Create entry basic block
-  auto *entry = createBB(fn, "entry");
-  Builder->SetInsertPoint(entry);
+  auto *entry = createBB(session, fn, "entry");
+  session.Builder->SetInsertPoint(entry);
 
   // emit return
-  auto *value = emitMainFunctionStatementList(fn);
-  emitReturn(fn->getReturnType(), value);
+  auto *value = emitMainFunctionStatementList(session, fn);
+  emitReturn(session, fn->getReturnType(), value);
 }
 
-void defineFunction(std::string name) {
+void defineFunction(EmitSession &session, std::string name) {
   // Function must be declated before define
-  auto* fn = TheModule->getFunction(name);
-  emitFunctionBody(fn);
+  auto* fn = session.TheModule->getFunction(name);
+  emitFunctionBody(session, fn);
   verifyFunction(*fn);
 }
 
-llvm::GlobalVariable* defineGlobalVariable(llvm::Type *type, std::string name, llvm::Constant *init) {
-  TheModule->getOrInsertGlobal(name, type);
-  auto *globalVar = TheModule->getNamedGlobal(name);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, llvm::Type *type, std::string name, llvm::Constant *init) {
+  session.TheModule->getOrInsertGlobal(name, type);
+  auto *globalVar = session.TheModule->getNamedGlobal(name);
   globalVar->setInitializer(init);
   globalVar->setDSOLocal(true);
   return globalVar;
 }
 
-llvm::GlobalVariable* defineGlobalVariable(std::string name, llvm::Constant *init) {
-  return defineGlobalVariable(init->getType(), name, init);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, std::string name, llvm::Constant *init) {
+  return defineGlobalVariable(session, init->getType(), name, init);
 }
 
-llvm::Value* emitLoadValue(llvm::GlobalVariable *value) {
-  return Builder->CreateLoad(value->getInitializer()->getType(), value);
+llvm::Value* emitLoadValue(EmitSession &session, llvm::GlobalVariable *value) {
+  return session.Builder->CreateLoad(value->getInitializer()->getType(), value);
 }
 
-llvm::Value* emitLoadValue(llvm::Value *value) {
+llvm::Value* emitLoadValue(EmitSession &session, llvm::Value *value) {
   auto baseType = value->getType()->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, value);
+  return session.Builder->CreateLoad(baseType, value);
 }
 
-llvm::Value* emitLoadGlobalVar(std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  auto rValue = emitLoadValue(globalVar);
+llvm::Value* emitLoadGlobalVar(EmitSession &session, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  auto rValue = emitLoadValue(session, globalVar);
   return rValue;
 }
 
-void emitAssign(llvm::Value *left, llvm::Value *right) {
-  Builder->CreateStore(right, left);
+void emitAssign(EmitSession &session, llvm::Value *left, llvm::Value *right) {
+  session.Builder->CreateStore(right, left);
 }
 
-void emitStoreGlobalVar(llvm::Value *value, std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  emitAssign(globalVar, value);
+void emitStoreGlobalVar(EmitSession &session, llvm::Value *value, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  emitAssign(session, globalVar, value);
 }
 
-llvm::Value* emitStackLocalVariable(llvm::Type *type, std::string name) {
-  return Builder->CreateAlloca(type, nullptr, name);
+llvm::Value* emitStackLocalVariable(EmitSession &session, llvm::Type *type, std::string name) {
+  return session.Builder->CreateAlloca(type, nullptr, name);
 }
 
-void emitConstant(llvm::Type *ty, std::string name, llvm::Constant *init) {
+void emitConstant(EmitSession &session, llvm::Type *ty, std::string name, llvm::Constant *init) {
   // private constant format: @__constant.function_name.variable_name
-  auto currentFunction = Builder->GetInsertBlock()->getParent();
+  auto currentFunction = session.Builder->GetInsertBlock()->getParent();
   std::string funcName = currentFunction->getName().data();
   std::string constVarName = "__constant." + funcName + "."+ name;
 
-  auto constantVar = defineGlobalVariable(ty, constVarName, init);
+  auto constantVar = defineGlobalVariable(session, ty, constVarName, init);
 
   constantVar->setConstant(true);
   constantVar->setLinkage(llvm::GlobalValue::LinkageTypes::PrivateLinkage);
 }
 
-void emitStringPtr(std::string content, std::string name) {
-  auto strPtr = Builder->CreateGlobalStringPtr(content, "." + name);
+void emitStringPtr(EmitSession &session, std::string content, std::string name) {
+  auto strPtr = session.Builder->CreateGlobalStringPtr(content, "." + name);
 }
 
 /**
@@ -146,186 +166,263 @@ void emitStringPtr(std::string content, std::string name) {
  * int i_32 = 3;
  * long i_64 = 4;
  */
-void emitIntegers() {
+void emitIntegers(EmitSession &session) {
   // char i_8 = 1;
-  defineGlobalVariable(Builder->getInt8Ty(), "i_8", Builder->getInt8(1));
+  defineGlobalVariable(session, session.Builder->getInt8Ty(), "i_8", session.Builder->getInt8(1));
 
   // short i_16 = 2;
-  defineGlobalVariable(Builder->getInt16Ty(), "i_16", Builder->getInt16(2));
+  defineGlobalVariable(session, session.Builder->getInt16Ty(), "i_16", session.Builder->getInt16(2));
 
   // int i_32 = 3;
-  defineGlobalVariable(Builder->getInt32Ty(), "i_32", Builder->getInt32(3));
+  defineGlobalVariable(session, session.Builder->getInt32Ty(), "i_32", session.Builder->getInt32(3));
 
   // long i_64 = 4;
-  defineGlobalVariable(Builder->getInt64Ty(), "i_64", Builder->getInt64(4));
+  defineGlobalVariable(session, session.Builder->getInt64Ty(), "i_64", session.Builder->getInt64(4));
 
   // unsigned char ui_8 = 1
-  defineGlobalVariable(Builder->getInt8Ty(), "ui_8", Builder->getInt8(1));
+  defineGlobalVariable(session, session.Builder->getInt8Ty(), "ui_8", session.Builder->getInt8(1));
 
   // unsigned int ui_32 = 3;
-  defineGlobalVariable(Builder->getInt32Ty(), "ui_32", Builder->getInt32(3));
+  defineGlobalVariable(session, session.Builder->getInt32Ty(), "ui_32", session.Builder->getInt32(3));
 
   // int i32_1 = 1;
-  defineGlobalVariable("i32_1", Builder->getInt32(1));
+  defineGlobalVariable(session, "i32_1", session.Builder->getInt32(1));
  // int i32_2 = 2;
-  defineGlobalVariable("i32_2", Builder->getInt32(2));
+  defineGlobalVariable(session, "i32_2", session.Builder->getInt32(2));
 
   // unsigned int ui32_1 = 1;
-  defineGlobalVariable("ui32_1", Builder->getInt32(1));
+  defineGlobalVariable(session, "ui32_1", session.Builder->getInt32(1));
   // unsigned int ui32_2 = 2;
-  defineGlobalVariable("ui32_2", Builder->getInt32(2));
+  defineGlobalVariable(session, "ui32_2", session.Builder->getInt32(2));
 
   // int result = 0;
-  defineGlobalVariable("result", Builder->getInt32(0));
+  defineGlobalVariable(session, "result", session.Builder->getInt32(0));
 }
 
-void emitFloats() {
+void emitFloats(EmitSession &session) {
   // float f = 1.0;
-  defineGlobalVariable(Builder->getFloatTy(), "f", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, session.Builder->getFloatTy(), "f", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // double d = 2.0
-  defineGlobalVariable(Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(Builder->getDoubleTy(), 2.0));
+  defineGlobalVariable(session, session.Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(session.Builder->getDoubleTy(), 2.0));
   
   //long double ld = 3.0;
-  auto ldType = llvm::Type::getX86_FP80Ty(*TheContext);
-  defineGlobalVariable(ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
+  auto ldType = llvm::Type::getX86_FP80Ty(*session.TheContext);
+  defineGlobalVariable(session, ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
 
   // float f_1 = 1.0;
-  defineGlobalVariable("f_1", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, "f_1", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // float f_2 = 2.0
-  defineGlobalVariable("f_2", llvm::ConstantFP::get(Builder->getFloatTy(), 2.0));
+  defineGlobalVariable(session, "f_2", llvm::ConstantFP::get(session.Builder->getFloatTy(), 2.0));
 }
 
 // int arr[] = { 1, 2, 3, 4 };
-void emitArray() {
+void emitArray(EmitSession &session) {
   // int arr[4];
   int num = 4;
-  llvm::Type *ty = Builder->getInt32Ty();
+  llvm::Type *ty = session.Builder->getInt32Ty();
   llvm::ArrayType *arrType = llvm::ArrayType::get(ty, num);
 
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
-  list.push_back(Builder->getInt32(2));
-  list.push_back(Builder->getInt32(3));
-  list.push_back(Builder->getInt32(4));
+  list.push_back(session.Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(2));
+  list.push_back(session.Builder->getInt32(3));
+  list.push_back(session.Builder->getInt32(4));
 
   llvm::Constant *c = llvm::ConstantArray::get(arrType, list);
 
-  defineGlobalVariable(arrType, "arr", c);
+  defineGlobalVariable(session, arrType, "arr", c);
 }
 
 /**
  * struct point { int x; int y; };
  * struct point point = { 1, 2 };
  */
-void emitStruct() {
+void emitStruct(EmitSession &session) {
   // struct point { int x; int y; }
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "struct.point");
-  structTy->setBody({Builder->getInt32Ty(), Builder->getInt32Ty()});
+  llvm::StructType *structTy = llvm::StructType::create(*session.TheContext, "struct.point");
+  structTy->setBody({session.Builder->getInt32Ty(), session.Builder->getInt32Ty()});
 
   // struct point  = { 11, 12 }
   int num = 2;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(11));
-  list.push_back(Builder->getInt32(12));
+  list.push_back(session.Builder->getInt32(11));
+  list.push_back(session.Builder->getInt32(12));
   
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
 
-  defineGlobalVariable(structTy, "pointer", c);
+  defineGlobalVariable(session, structTy, "pointer", c);
 }
 
 /**
  * union ab  {  int a;  float b; };
  * union ab u = { 1 };
  */
-void emitUnion() {
+void emitUnion(EmitSession &session) {
   // union ab  {  int a;  float b; };
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "union.ab");
-  structTy->setBody(Builder->getInt32Ty());
+  llvm::StructType *structTy = llvm::StructType::create(*session.TheContext, "union.ab");
+  structTy->setBody(session.Builder->getInt32Ty());
 
   // union ab u = { 1 };
   int num = 1;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(1));
 
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
-  defineGlobalVariable(structTy, "u", c);
+  defineGlobalVariable(session, structTy, "u", c);
 }
 
-void emitPointer() {
+void emitPointer(EmitSession &session) {
   // int *i_p;
-  auto pointerTy = llvm::PointerType::get(Builder->getInt32Ty(), 0);
+  auto pointerTy = llvm::PointerType::get(session.Builder->getInt32Ty(), 0);
   auto c = llvm::Constant::getNullValue(pointerTy);
-  defineGlobalVariable(pointerTy, "i_p", c);
+  defineGlobalVariable(session, pointerTy, "i_p", c);
 
   // char *c_p;
-  auto charPtrTy = llvm::PointerType::get(Builder->getInt8Ty(), 0);
+  auto charPtrTy = llvm::PointerType::get(session.Builder->getInt8Ty(), 0);
   auto cCharPtr = llvm::Constant::getNullValue(charPtrTy);
-  defineGlobalVariable(charPtrTy, "c_p", cCharPtr);
+  defineGlobalVariable(session, charPtrTy, "c_p", cCharPtr);
 }
 
 // char *str = "hello\n";
-void emitConstString() {
-  emitStringPtr("hello", "str");
+void emitConstString(EmitSession &session) {
+  emitStringPtr(session, "hello", "str");
 }
 
-llvm::Value* emitMainFunctionStatementList(llvm::Function *fn) {
-  llvm::BasicBlock *thenBB = createBB(fn, "then");
-  llvm::BasicBlock *elseBB = createBB(fn, "else");
-  llvm::BasicBlock *mergeBB = createBB(fn, "ifEnd");
+// Attach the hint as !prof branch weights or !unpredictable to a br or select.
+static void setBranchHint(EmitSession &session, llvm::Instruction *inst, BranchHint hint) {
+  llvm::MDBuilder mdBuilder(*session.TheContext);
+  switch (hint) {
+  case HintLikelyTrue:
+    inst->setMetadata(llvm::LLVMContext::MD_prof, mdBuilder.createBranchWeights(2000, 1));
+    break;
+  case HintLikelyFalse:
+    inst->setMetadata(llvm::LLVMContext::MD_prof, mdBuilder.createBranchWeights(1, 2000));
+    break;
+  case HintUnpredictable:
+    inst->setMetadata(llvm::LLVMContext::MD_unpredictable, mdBuilder.createUnpredictable());
+    break;
+  case HintNone:
+    break;
+  }
+}
 
-  auto siV1 = emitLoadGlobalVar("i32_1");
-  auto siV2 = emitLoadGlobalVar("i32_2");
+// Emit both arms in the current block and select between them. Gives up and
+// returns null, leaving the block as it was, if an arm emitted anything that
+// is not safe to run unconditionally.
+static llvm::Value* emitIfAssignSelect(EmitSession &session, llvm::Value *cond,
+                                      llvm::function_ref<llvm::Value*()> thenValue,
+                                      llvm::function_ref<llvm::Value*()> elseValue, BranchHint hint) {
+  auto block = session.Builder->GetInsertBlock();
+  auto firstNew = block->empty() ? nullptr : &block->back();
+  auto thenV = thenValue();
+  auto elseV = elseValue();
+
+  std::vector<llvm::Instruction *> emitted;
+  auto it = firstNew ? std::next(firstNew->getIterator()) : block->begin();
+  for (; it != block->end(); ++it) {
+    emitted.push_back(&*it);
+  }
+  for (auto inst : emitted) {
+    if (!llvm::isSafeToSpeculativelyExecute(inst)) {
+      for (auto dead : llvm::reverse(emitted)) {
+        dead->eraseFromParent();
+      }
+      return nullptr;
+    }
+  }
+
+  auto select = session.Builder->CreateSelect(cond, thenV, elseV);
+  if (auto inst = llvm::dyn_cast<llvm::Instruction>(select)) {
+    setBranchHint(session, inst, hint);
+  }
+  return select;
+}
+
+// if (cond) target = thenValue(); else target = elseValue();
+// Each callback emits the code for its arm's value. Both are side-effect free
+// in the branchless forms, so a site picks the lowering that suits it: a
+// select for unpredictable conditions, branches for well-predicted ones.
+void emitIfAssign(EmitSession &session, llvm::Function *fn, llvm::Value *cond,
+                  llvm::function_ref<llvm::Value*()> thenValue,
+                  llvm::function_ref<llvm::Value*()> elseValue,
+                  std::string target, BranchHint hint = HintNone, IfLowering lowering = Lowering) {
+  if (lowering == IfAuto) {
+    lowering = hint == HintLikelyTrue || hint == HintLikelyFalse ? IfBranches : IfSelect;
+  }
+  if (lowering == IfSelect) {
+    if (auto value = emitIfAssignSelect(session, cond, thenValue, elseValue, hint)) {
+      emitStoreGlobalVar(session, value, target);
+      return;
+    }
+  }
+
+  llvm::BasicBlock *thenBB = createBB(session, fn, "then");
+  llvm::BasicBlock *elseBB = createBB(session, fn, "else");
+  llvm::BasicBlock *mergeBB = createBB(session, fn, "ifEnd");
 
-  // if(i32_1 > i32_2)
-  auto compare = Builder->CreateICmp(llvm::ICmpInst::ICMP_SGT, siV1, siV2);
   // if exp then bb else bb
-  Builder->CreateCondBr(compare, thenBB, elseBB);
+  auto br = session.Builder->CreateCondBr(cond, thenBB, elseBB);
+  setBranchHint(session, br, hint);
 
   // then
-  Builder->SetInsertPoint(thenBB); 
-  // result = i32_1;
-  siV1 = emitLoadGlobalVar("i32_1");
-  emitStoreGlobalVar(siV1, "result");
-  Builder->CreateBr(mergeBB);
+  session.Builder->SetInsertPoint(thenBB); 
+  emitStoreGlobalVar(session, thenValue(), target);
+  session.Builder->CreateBr(mergeBB);
 
   // else
-  Builder->SetInsertPoint(elseBB); 
-  // result = i32_2;
-  siV1 = emitLoadGlobalVar("i32_2");
-  emitStoreGlobalVar(siV1, "result");
-  Builder->CreateBr(mergeBB);
+  session.Builder->SetInsertPoint(elseBB); 
+  emitStoreGlobalVar(session, elseValue(), target);
+  session.Builder->CreateBr(mergeBB);
 
   // end
-  Builder->SetInsertPoint(mergeBB);
-  auto value = emitLoadGlobalVar("result");
+  session.Builder->SetInsertPoint(mergeBB);
+}
+
+llvm::Value* emitMainFunctionStatementList(EmitSession &session, llvm::Function *fn) {
+  auto siV1 = emitLoadGlobalVar(session, "i32_1");
+  auto siV2 = emitLoadGlobalVar(session, "i32_2");
+
+  // if(i32_1 > i32_2)
+  auto compare = session.Builder->CreateICmp(llvm::ICmpInst::ICMP_SGT, siV1, siV2);
+  emitIfAssign(session, fn, compare,
+    // result = i32_1;
+    [&] { return emitLoadGlobalVar(session, "i32_1"); },
+    // result = i32_2;
+    [&] { return emitLoadGlobalVar(session, "i32_2"); },
+    "result");
+
+  auto value = emitLoadGlobalVar(session, "result");
   // return result;
   return value;
 }
 
-void emitProgram() {
-  emitIntegers();
+void emitProgram(EmitSession &session) {
+  emitIntegers(session);
 
-  declareFunction("main");
-  defineFunction("main");
+  declareFunction(session, "main");
+  defineFunction(session, "main");
 }
 
 int main(int argc, char *argv[]) {
-  initializeModule();
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+
+  EmitSession session;
+  initializeModule(session);
 
   auto targetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(targetTriple);
+  session.TheModule->setTargetTriple(targetTriple);
 
-  registerFunctionProto();
+  registerFunctionProto(session);
 
-  emitProgram();
+  emitProgram(session);
 
-  TheModule->print(llvm::outs(), nullptr);
+  session.TheModule->print(llvm::outs(), nullptr);
 
-  saveModuleIRToFile("./out.ll");
+  saveModuleIRToFile(session, "./out.ll");
   return 0;
 }
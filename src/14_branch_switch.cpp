@@ -2,28 +2,25 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Host.h"
 
 #include <map>
 #include <string>
 
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
+enum SwitchLowering { SwitchBranches, SwitchSelect, SwitchTable, SwitchAuto };
 
-static void initializeModule() {
-  // Open a new context and moduel
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("ir_builder", *TheContext);
-  // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
-}
+static llvm::cl::opt<SwitchLowering> Lowering("switch-lowering",
+  llvm::cl::desc("How to emit a switch whose cases only assign constants"),
+  llvm::cl::values(
+    clEnumValN(SwitchBranches, "branches", "a switch instruction and a block per case"),
+    clEnumValN(SwitchSelect, "select", "a chain of selects"),
+    clEnumValN(SwitchTable, "table", "a load from a constant lookup table, if one is small and dense enough"),
+    clEnumValN(SwitchAuto, "auto", "a table for dense switches with 4+ cases, selects for fewer, branches otherwise")),
+  llvm::cl::init(SwitchBranches));
 
-static void saveModuleIRToFile(const std::string& filename) {
-  std::error_code errorCode;
-  llvm::raw_fd_ostream out(filename, errorCode);
-  TheModule->print(out, nullptr);
-}
+static llvm::cl::opt<bool> SwitchEdgeCases("switch-edge-cases",
+  llvm::cl::desc("Also emit switches at the limits of a lookup table, and count the ones that matched in main's result"));
 
 typedef struct FunProto {
   llvm::Type *returnType;
@@ -31,113 +28,134 @@ typedef struct FunProto {
   bool isVarArg;
 } FunProto;
 
-static std::map<std::string, FunProto> funProtoMap;
+// Everything one emission writes into. Sessions share no state, so each
+// thread can build its own module alongside the others.
+struct EmitSession {
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  std::unique_ptr<llvm::IRBuilder<>> Builder;
+  std::map<std::string, FunProto> funProtoMap;
+};
 
-void registerFunctionProto() {
-  auto int32Ty = Builder->getInt32Ty();
-  funProtoMap["main"] = {
+static void initializeModule(EmitSession &session) {
+  // Open a new context and moduel
+  session.TheContext = std::make_unique<llvm::LLVMContext>();
+  session.TheModule = std::make_unique<llvm::Module>("ir_builder", *session.TheContext);
+  // Create a new builder for the module.
+  session.Builder = std::make_unique<llvm::IRBuilder<>>(*session.TheContext);
+}
+
+static void saveModuleIRToFile(EmitSession &session, const std::string& filename) {
+  std::error_code errorCode;
+  llvm::raw_fd_ostream out(filename, errorCode);
+  session.TheModule->print(out, nullptr);
+}
+
+void registerFunctionProto(EmitSession &session) {
+  auto int32Ty = session.Builder->getInt32Ty();
+  session.funProtoMap["main"] = {
     int32Ty,
     {},
     false,
   };
 }
 
-llvm::Function *declareFunction(std::string name) {
-  auto* func = TheModule->getFunction(name);
+llvm::Function *declareFunction(EmitSession &session, std::string name) {
+  auto* func = session.TheModule->getFunction(name);
   if (func == nullptr) {
-    FunProto funProto = funProtoMap[name];
+    FunProto funProto = session.funProtoMap[name];
     auto* funcType = llvm::FunctionType::get(funProto.returnType, funProto.params, funProto.isVarArg);
-    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, TheModule.get());
+    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, session.TheModule.get());
     func->setDSOLocal(true);
   }
   return func;
 }
 
-void emitReturn(llvm::Type *ty, llvm::Value *value) {
+void emitReturn(EmitSession &session, llvm::Type *ty, llvm::Value *value) {
   if (ty->isVoidTy()) {
-    Builder->CreateRetVoid();
+    session.Builder->CreateRetVoid();
   } else {
-    Builder->CreateRet(value);
+    session.Builder->CreateRet(value);
   }
 }
 
-llvm::BasicBlock* createBB(llvm::Function *fn, std::string name) {
-  return llvm::BasicBlock::Create(*TheContext, name, fn);
+llvm::BasicBlock* createBB(EmitSession &session, llvm::Function *fn, std::string name) {
+  return llvm::BasicBlock::Create(*session.TheContext, name, fn);
 }
 
-llvm::Value* emitMainFunctionStatementList(llvm::Function *);
+llvm::Value* emitMainFunctionStatementList(EmitSession &, llvm::Function *);
 
-void emitFunctionBody(llvm::Function *fn) {
+void emitFunctionBody(EmitSession &session, llvm::Function *fn) {
   // Create entry basic block
-  auto *entry = createBB(fn, "entry");
-  Builder->SetInsertPoint(entry);
+  auto *entry = createBB(session, fn, "entry");
+  session.Builder->SetInsertPoint(entry);
 
   // emit return
-  auto *value = emitMainFunctionStatementList(fn);
-  emitReturn(fn->getReturnType(), value);
+  auto *value = emitMainFunctionStatementList(session, fn);
+  emitReturn(session, fn->getReturnType(), value);
 }
 
-void defineFunction(std::string name) {
+void defineFunction(EmitSession &session, std::string name) {
   // Function must be declated before define
-  auto* fn = TheModule->getFunction(name);
-  emitFunctionBody(fn);
+  auto* fn = session.TheModule->getFunction(name);
+  emitFunctionBody(session, fn);
   verifyFunction(*fn);
 }
 
-llvm::GlobalVariable* defineGlobalVariable(llvm::Type *type, std::string name, llvm::Constant *init) {
-  TheModule->getOrInsertGlobal(name, type);
-  auto *globalVar = TheModule->getNamedGlobal(name);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, llvm::Type *type, std::string name, llvm::Constant *init) {
+  session.TheModule->getOrInsertGlobal(name, type);
+  auto *globalVar = session.TheModule->getNamedGlobal(name);
   globalVar->setInitializer(init);
   globalVar->setDSOLocal(true);
   return globalVar;
 }
 
-llvm::GlobalVariable* defineGlobalVariable(std::string name, llvm::Constant *init) {
-  return defineGlobalVariable(init->getType(), name, init);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, std::string name, llvm::Constant *init) {
+  return defineGlobalVariable(session, init->getType(), name, init);
 }
 
-llvm::Value* emitLoadValue(llvm::GlobalVariable *value) {
-  return Builder->CreateLoad(value->getInitializer()->getType(), value);
+llvm::Value* emitLoadValue(EmitSession &session, llvm::GlobalVariable *value) {
+  return session.Builder->CreateLoad(value->getInitializer()->getType(), value);
 }
 
-llvm::Value* emitLoadValue(llvm::Value *value) {
+llvm::Value* emitLoadValue(EmitSession &session, llvm::Value *value) {
   auto baseType = value->getType()->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, value);
+  return session.Builder->CreateLoad(baseType, value);
 }
 
-llvm::Value* emitLoadGlobalVar(std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  auto rValue = emitLoadValue(globalVar);
+llvm::Value* emitLoadGlobalVar(EmitSession &session, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  auto rValue = emitLoadValue(session, globalVar);
   return rValue;
 }
 
-void emitAssign(llvm::Value *left, llvm::Value *right) {
-  Builder->CreateStore(right, left);
+void emitAssign(EmitSession &session, llvm::Value *left, llvm::Value *right) {
+  session.Builder->CreateStore(right, left);
 }
 
-void emitStoreGlobalVar(llvm::Value *value, std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  emitAssign(globalVar, value);
+void emitStoreGlobalVar(EmitSession &session, llvm::Value *value, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  emitAssign(session, globalVar, value);
 }
 
-llvm::Value* emitStackLocalVariable(llvm::Type *type, std::string name) {
-  return Builder->CreateAlloca(type, nullptr, name);
+llvm::Value* emitStackLocalVariable(EmitSession &session, llvm::Type *type, std::string name) {
+  return session.Builder->CreateAlloca(type, nullptr, name);
 }
 
-void emitConstant(llvm::Type *ty, std::string name, llvm::Constant *init) {
+void emitConstant(EmitSession &session, llvm::Type *ty, std::string name, llvm::Constant *init) {
   // private constant format: @__constant.function_name.variable_name
-  auto currentFunction = Builder->GetInsertBlock()->getParent();
+  auto currentFunction = session.Builder->GetInsertBlock()->getParent();
   std::string funcName = currentFunction->getName().data();
   std::string constVarName = "__constant." + funcName + "."+ name;
 
-  auto constantVar = defineGlobalVariable(ty, constVarName, init);
+  auto constantVar = defineGlobalVariable(session, ty, constVarName, init);
 
   constantVar->setConstant(true);
   constantVar->setLinkage(llvm::GlobalValue::LinkageTypes::PrivateLinkage);
 }
 
-void emitStringPtr(std::string content, std::string name) {
-  auto strPtr = Builder->CreateGlobalStringPtr(content, "." + name);
+void emitStringPtr(EmitSession &session, std::string content, std::string name) {
+  auto strPtr = session.Builder->CreateGlobalStringPtr(content, "." + name);
 }
 
 /**
@@ -146,189 +164,359 @@ void emitStringPtr(std::string content, std::string name) {
  * int i_32 = 3;
  * long i_64 = 4;
  */
-void emitIntegers() {
+void emitIntegers(EmitSession &session) {
   // char i_8 = 1;
-  defineGlobalVariable(Builder->getInt8Ty(), "i_8", Builder->getInt8(1));
+  defineGlobalVariable(session, session.Builder->getInt8Ty(), "i_8", session.Builder->getInt8(1));
 
   // short i_16 = 2;
-  defineGlobalVariable(Builder->getInt16Ty(), "i_16", Builder->getInt16(2));
+  defineGlobalVariable(session, session.Builder->getInt16Ty(), "i_16", session.Builder->getInt16(2));
 
   // int i_32 = 3;
-  defineGlobalVariable(Builder->getInt32Ty(), "i_32", Builder->getInt32(3));
+  defineGlobalVariable(session, session.Builder->getInt32Ty(), "i_32", session.Builder->getInt32(3));
 
   // long i_64 = 4;
-  defineGlobalVariable(Builder->getInt64Ty(), "i_64", Builder->getInt64(4));
+  defineGlobalVariable(session, session.Builder->getInt64Ty(), "i_64", session.Builder->getInt64(4));
 
   // unsigned char ui_8 = 1
-  defineGlobalVariable(Builder->getInt8Ty(), "ui_8", Builder->getInt8(1));
+  defineGlobalVariable(session, session.Builder->getInt8Ty(), "ui_8", session.Builder->getInt8(1));
 
   // unsigned int ui_32 = 3;
-  defineGlobalVariable(Builder->getInt32Ty(), "ui_32", Builder->getInt32(3));
+  defineGlobalVariable(session, session.Builder->getInt32Ty(), "ui_32", session.Builder->getInt32(3));
 
   // int i32_1 = 1;
-  defineGlobalVariable("i32_1", Builder->getInt32(1));
+  defineGlobalVariable(session, "i32_1", session.Builder->getInt32(1));
  // int i32_2 = 2;
-  defineGlobalVariable("i32_2", Builder->getInt32(2));
+  defineGlobalVariable(session, "i32_2", session.Builder->getInt32(2));
 
   // unsigned int ui32_1 = 1;
-  defineGlobalVariable("ui32_1", Builder->getInt32(1));
+  defineGlobalVariable(session, "ui32_1", session.Builder->getInt32(1));
   // unsigned int ui32_2 = 2;
-  defineGlobalVariable("ui32_2", Builder->getInt32(2));
+  defineGlobalVariable(session, "ui32_2", session.Builder->getInt32(2));
   
   // int level = 1;
-  defineGlobalVariable("level", Builder->getInt32(1));
+  defineGlobalVariable(session, "level", session.Builder->getInt32(1));
   // int result = 0;
-  defineGlobalVariable("result", Builder->getInt32(0));
+  defineGlobalVariable(session, "result", session.Builder->getInt32(0));
 }
 
-void emitFloats() {
+void emitFloats(EmitSession &session) {
   // float f = 1.0;
-  defineGlobalVariable(Builder->getFloatTy(), "f", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, session.Builder->getFloatTy(), "f", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // double d = 2.0
-  defineGlobalVariable(Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(Builder->getDoubleTy(), 2.0));
+  defineGlobalVariable(session, session.Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(session.Builder->getDoubleTy(), 2.0));
   
   //long double ld = 3.0;
-  auto ldType = llvm::Type::getX86_FP80Ty(*TheContext);
-  defineGlobalVariable(ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
+  auto ldType = llvm::Type::getX86_FP80Ty(*session.TheContext);
+  defineGlobalVariable(session, ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
 
   // float f_1 = 1.0;
-  defineGlobalVariable("f_1", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, "f_1", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // float f_2 = 2.0
-  defineGlobalVariable("f_2", llvm::ConstantFP::get(Builder->getFloatTy(), 2.0));
+  defineGlobalVariable(session, "f_2", llvm::ConstantFP::get(session.Builder->getFloatTy(), 2.0));
 }
 
 // int arr[] = { 1, 2, 3, 4 };
-void emitArray() {
+void emitArray(EmitSession &session) {
   // int arr[4];
   int num = 4;
-  llvm::Type *ty = Builder->getInt32Ty();
+  llvm::Type *ty = session.Builder->getInt32Ty();
   llvm::ArrayType *arrType = llvm::ArrayType::get(ty, num);
 
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
-  list.push_back(Builder->getInt32(2));
-  list.push_back(Builder->getInt32(3));
-  list.push_back(Builder->getInt32(4));
+  list.push_back(session.Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(2));
+  list.push_back(session.Builder->getInt32(3));
+  list.push_back(session.Builder->getInt32(4));
 
   llvm::Constant *c = llvm::ConstantArray::get(arrType, list);
 
-  defineGlobalVariable(arrType, "arr", c);
+  defineGlobalVariable(session, arrType, "arr", c);
 }
 
 /**
  * struct point { int x; int y; };
  * struct point point = { 1, 2 };
  */
-void emitStruct() {
+void emitStruct(EmitSession &session) {
   // struct point { int x; int y; }
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "struct.point");
-  structTy->setBody({Builder->getInt32Ty(), Builder->getInt32Ty()});
+  llvm::StructType *structTy = llvm::StructType::create(*session.TheContext, "struct.point");
+  structTy->setBody({session.Builder->getInt32Ty(), session.Builder->getInt32Ty()});
 
   // struct point  = { 11, 12 }
   int num = 2;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(11));
-  list.push_back(Builder->getInt32(12));
+  list.push_back(session.Builder->getInt32(11));
+  list.push_back(session.Builder->getInt32(12));
   
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
 
-  defineGlobalVariable(structTy, "pointer", c);
+  defineGlobalVariable(session, structTy, "pointer", c);
 }
 
 /**
  * union ab  {  int a;  float b; };
  * union ab u = { 1 };
  */
-void emitUnion() {
+void emitUnion(EmitSession &session) {
   // union ab  {  int a;  float b; };
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "union.ab");
-  structTy->setBody(Builder->getInt32Ty());
+  llvm::StructType *structTy = llvm::StructType::create(*session.TheContext, "union.ab");
+  structTy->setBody(session.Builder->getInt32Ty());
 
   // union ab u = { 1 };
   int num = 1;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(1));
 
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
-  defineGlobalVariable(structTy, "u", c);
+  defineGlobalVariable(session, structTy, "u", c);
 }
 
-void emitPointer() {
+void emitPointer(EmitSession &session) {
   // int *i_p;
-  auto pointerTy = llvm::PointerType::get(Builder->getInt32Ty(), 0);
+  auto pointerTy = llvm::PointerType::get(session.Builder->getInt32Ty(), 0);
   auto c = llvm::Constant::getNullValue(pointerTy);
-  defineGlobalVariable(pointerTy, "i_p", c);
+  defineGlobalVariable(session, pointerTy, "i_p", c);
 
   // char *c_p;
-  auto charPtrTy = llvm::PointerType::get(Builder->getInt8Ty(), 0);
+  auto charPtrTy = llvm::PointerType::get(session.Builder->getInt8Ty(), 0);
   auto cCharPtr = llvm::Constant::getNullValue(charPtrTy);
-  defineGlobalVariable(charPtrTy, "c_p", cCharPtr);
+  defineGlobalVariable(session, charPtrTy, "c_p", cCharPtr);
 }
 
 // char *str = "hello\n";
-void emitConstString() {
-  emitStringPtr("hello", "str");
+void emitConstString(EmitSession &session) {
+  emitStringPtr(session, "hello", "str");
 }
 
-llvm::Value* emitMainFunctionStatementList(llvm::Function *fn) {
-  llvm::BasicBlock *aBB = createBB(fn, "aBB");
-  llvm::BasicBlock *bBB = createBB(fn, "bBB");
-  llvm::BasicBlock *defaultBB = createBB(fn, "defaultBB");
-  llvm::BasicBlock *endBB = createBB(fn, "switchEnd");
+// case value: target = result; break;
+struct ConstantCase {
+  llvm::ConstantInt *value;
+  llvm::Constant *result;
+  // The case's block when emitted as branches, case<value> if null.
+  const char *blockName = nullptr;
+};
+
+// Lookup tables hold at most this many entries.
+static const uint64_t MaxSwitchTableSize = 4096;
+
+// Whether `cases` fit a lookup table: at most MaxSwitchTableSize entries, at
+// least half of them real cases. Sets the smallest case and the entry count.
+static bool getSwitchTableRange(llvm::ArrayRef<ConstantCase> cases, llvm::APInt &min, uint64_t &size) {
+  if (cases.empty()) {
+    return false;
+  }
+  min = cases.front().value->getValue();
+  auto max = min;
+  for (auto &c : cases) {
+    min = llvm::APIntOps::smin(min, c.value->getValue());
+    max = llvm::APIntOps::smax(max, c.value->getValue());
+  }
+  // One bit wider, so the span of i64 cases cannot wrap.
+  unsigned width = min.getBitWidth() + 1;
+  auto span = max.sext(width) - min.sext(width);
+  if (span.uge(MaxSwitchTableSize)) {
+    return false;
+  }
+  size = span.getZExtValue() + 1;
+  return size <= 2 * cases.size();
+}
 
-  // switch(level)
-  auto siV = emitLoadGlobalVar("level");
-  // switch ... case
-  llvm::SwitchInst *switchInst = Builder->CreateSwitch(siV, defaultBB);
-  switchInst->addCase(Builder->getInt32(1), aBB);
-  switchInst->addCase(Builder->getInt32(2), bBB);
+// switch (cond) { case ...: target = ...; break; default: target = defaultResult; }
+static void emitConstantSwitchBranches(EmitSession &session, llvm::Function *fn, llvm::Value *cond,
+                                       llvm::ArrayRef<ConstantCase> cases, llvm::Constant *defaultResult,
+                                       std::string target) {
+  llvm::BasicBlock *defaultBB = createBB(session, fn, "defaultBB");
+  llvm::BasicBlock *endBB = createBB(session, fn, "switchEnd");
+
+  llvm::SwitchInst *switchInst = session.Builder->CreateSwitch(cond, defaultBB);
+  for (auto &c : cases) {
+    std::string name = c.blockName ? c.blockName : "case" + std::to_string(c.value->getSExtValue());
+    llvm::BasicBlock *caseBB = createBB(session, fn, name);
+    caseBB->moveBefore(defaultBB);
+    switchInst->addCase(c.value, caseBB);
+
+    session.Builder->SetInsertPoint(caseBB);
+    emitStoreGlobalVar(session, c.result, target);
+    session.Builder->CreateBr(endBB);
+  }
+
+  session.Builder->SetInsertPoint(defaultBB);
+  emitStoreGlobalVar(session, defaultResult, target);
+  session.Builder->CreateBr(endBB);
+
+  session.Builder->SetInsertPoint(endBB);
+}
+
+// result = cond == v1 ? r1 : cond == v2 ? r2 : ... : defaultResult;
+static llvm::Value* emitConstantSwitchSelect(EmitSession &session, llvm::Value *cond,
+                                            llvm::ArrayRef<ConstantCase> cases, llvm::Constant *defaultResult) {
+  llvm::Value *result = defaultResult;
+  for (auto &c : llvm::reverse(cases)) {
+    auto isCase = session.Builder->CreateICmpEQ(cond, c.value);
+    result = session.Builder->CreateSelect(isCase, c.result, result);
+  }
+  return result;
+}
 
-  // Case 1
-  Builder->SetInsertPoint(aBB);
-  emitStoreGlobalVar(Builder->getInt32(90), "result");
-  Builder->CreateBr(endBB);
+// Look the result up in a private table of `size` entries from case `min`
+// on, holes holding the default. The index is clamped before the load and the
+// default selected after it, so out of range values never branch.
+static llvm::Value* emitConstantSwitchTable(EmitSession &session, llvm::Value *cond,
+                                           llvm::ArrayRef<ConstantCase> cases, llvm::Constant *defaultResult,
+                                           const llvm::APInt &min, uint64_t size, std::string target) {
+  std::vector<llvm::Constant *> entries(size, defaultResult);
+  for (auto &c : cases) {
+    entries[(c.value->getValue() - min).getZExtValue()] = c.result;
+  }
+  auto tableType = llvm::ArrayType::get(defaultResult->getType(), size);
+  auto table = new llvm::GlobalVariable(*session.TheModule, tableType, true, llvm::GlobalValue::PrivateLinkage,
+                                        llvm::ConstantArray::get(tableType, entries), "switch.table." + target);
+  table->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+
+  // Rebase in cond's type, where every case lands in 0..size-1, then widen
+  // without sign: a GEP would sign extend an i8 index of 128 or more, and
+  // `size` itself wraps to 0 in cond's type when the table covers all of it.
+  auto condType = llvm::cast<llvm::IntegerType>(cond->getType());
+  auto indexType = condType->getBitWidth() > 64 ? condType : session.Builder->getInt64Ty();
+  auto rebased = session.Builder->CreateSub(cond, llvm::ConstantInt::get(condType, min));
+  auto index = session.Builder->CreateZExt(rebased, indexType);
+  auto inRange = session.Builder->CreateICmpULT(index, llvm::ConstantInt::get(indexType, size));
+  auto safeIndex = session.Builder->CreateSelect(inRange, index, llvm::ConstantInt::get(indexType, 0));
+  auto entryAddr = session.Builder->CreateInBoundsGEP(tableType, table, {session.Builder->getInt64(0), safeIndex});
+  auto entry = session.Builder->CreateLoad(defaultResult->getType(), entryAddr);
+  return session.Builder->CreateSelect(inRange, entry, defaultResult);
+}
 
-  // Case 'B'
-  Builder->SetInsertPoint(bBB);
-  emitStoreGlobalVar(Builder->getInt32(80), "result");
-  Builder->CreateBr(endBB);
+// A switch whose every arm assigns a constant to `target`. With
+// --switch-lowering it computes the constant without branching instead.
+void emitConstantSwitch(EmitSession &session, llvm::Function *fn, llvm::Value *cond,
+                        llvm::ArrayRef<ConstantCase> cases, llvm::Constant *defaultResult, std::string target) {
+  auto lowering = Lowering.getValue();
+  llvm::APInt min;
+  uint64_t size = 0;
+  bool fitsTable = getSwitchTableRange(cases, min, size);
+  if (lowering == SwitchAuto) {
+    if (cases.size() < 4) {
+      lowering = SwitchSelect;
+    } else {
+      lowering = fitsTable ? SwitchTable : SwitchBranches;
+    }
+  } else if (lowering == SwitchTable && !fitsTable) {
+    lowering = SwitchBranches;
+  }
 
-  // default
-  Builder->SetInsertPoint(defaultBB);
-  emitStoreGlobalVar(Builder->getInt32(70), "result");
-  Builder->CreateBr(endBB);
+  switch (lowering) {
+  case SwitchSelect:
+    emitStoreGlobalVar(session, emitConstantSwitchSelect(session, cond, cases, defaultResult), target);
+    break;
+  case SwitchTable:
+    emitStoreGlobalVar(session, emitConstantSwitchTable(session, cond, cases, defaultResult, min, size, target),
+                       target);
+    break;
+  default:
+    emitConstantSwitchBranches(session, fn, cond, cases, defaultResult, target);
+    break;
+  }
+}
+
+/**
+ * char grade = 100;         switch (grade) { case 0 ... 199: wide = grade + 1000; }
+ * bool flag = true;         switch (flag) { case false: bit = 10; case true: bit = 20; }
+ * unsigned char byte = 200; switch (byte) { case 0 ... 255: full = byte * 3; }
+ */
+void emitSwitchEdgeCaseGlobals(EmitSession &session) {
+  defineGlobalVariable(session, "grade", session.Builder->getInt8(100));
+  defineGlobalVariable(session, "flag", session.Builder->getTrue());
+  defineGlobalVariable(session, "byte", session.Builder->getInt8(200));
+  defineGlobalVariable(session, "wide", session.Builder->getInt32(0));
+  defineGlobalVariable(session, "bit", session.Builder->getInt32(0));
+  defineGlobalVariable(session, "full", session.Builder->getInt32(0));
+}
+
+// The switches above, whose tables take rebased indices of 128 and more and
+// cover every value of their condition's type. Returns result plus one for
+// every switch that picked the right arm.
+llvm::Value* emitSwitchEdgeCases(EmitSession &session, llvm::Function *fn, llvm::Value *result) {
+  auto i8Type = session.Builder->getInt8Ty();
+  auto i1Type = session.Builder->getInt1Ty();
+  auto zero = session.Builder->getInt32(0);
+
+  std::vector<ConstantCase> wideCases;
+  for (unsigned v = 0; v < 200; ++v) {
+    wideCases.push_back({ llvm::ConstantInt::get(i8Type, v), session.Builder->getInt32(v + 1000) });
+  }
+  emitConstantSwitch(session, fn, emitLoadGlobalVar(session, "grade"), wideCases, zero, "wide");
+
+  emitConstantSwitch(session, fn, emitLoadGlobalVar(session, "flag"), {
+    { llvm::ConstantInt::get(i1Type, 0), session.Builder->getInt32(10) },
+    { llvm::ConstantInt::get(i1Type, 1), session.Builder->getInt32(20) },
+  }, zero, "bit");
+
+  std::vector<ConstantCase> fullCases;
+  for (unsigned v = 0; v < 256; ++v) {
+    fullCases.push_back({ llvm::ConstantInt::get(i8Type, v), session.Builder->getInt32(v * 3) });
+  }
+  emitConstantSwitch(session, fn, emitLoadGlobalVar(session, "byte"), fullCases, zero, "full");
+
+  for (auto expected : { std::make_pair("wide", 1100), std::make_pair("bit", 20), std::make_pair("full", 600) }) {
+    auto matched = session.Builder->CreateICmpEQ(emitLoadGlobalVar(session, expected.first),
+                                                 session.Builder->getInt32(expected.second));
+    result = session.Builder->CreateAdd(result, session.Builder->CreateZExt(matched, result->getType()));
+  }
+  return result;
+}
+
+llvm::Value* emitMainFunctionStatementList(EmitSession &session, llvm::Function *fn) {
+  // switch(level)
+  auto siV = emitLoadGlobalVar(session, "level");
+  // switch ... case
+  emitConstantSwitch(session, fn, siV, {
+    // Case 1
+    { session.Builder->getInt32(1), session.Builder->getInt32(90), "aBB" },
+    // Case 'B'
+    { session.Builder->getInt32(2), session.Builder->getInt32(80), "bBB" },
+  }, session.Builder->getInt32(70), "result");
 
   // end
-  Builder->SetInsertPoint(endBB);
-  auto value = emitLoadGlobalVar("result");
+  auto value = emitLoadGlobalVar(session, "result");
+  if (SwitchEdgeCases) {
+    // return result + matched switches;
+    return emitSwitchEdgeCases(session, fn, value);
+  }
   // return result;
   return value;
 }
 
-void emitProgram() {
-  emitIntegers();
+void emitProgram(EmitSession &session) {
+  emitIntegers(session);
+  if (SwitchEdgeCases) {
+    emitSwitchEdgeCaseGlobals(session);
+  }
 
-  declareFunction("main");
-  defineFunction("main");
+  declareFunction(session, "main");
+  defineFunction(session, "main");
 }
 
 int main(int argc, char *argv[]) {
-  initializeModule();
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+
+  EmitSession session;
+  initializeModule(session);
 
   auto targetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(targetTriple);
+  session.TheModule->setTargetTriple(targetTriple);
 
-  registerFunctionProto();
+  registerFunctionProto(session);
 
-  emitProgram();
+  emitProgram(session);
 
-  TheModule->print(llvm::outs(), nullptr);
+  session.TheModule->print(llvm::outs(), nullptr);
 
-  saveModuleIRToFile("./out.ll");
+  saveModuleIRToFile(session, "./out.ll");
   return 0;
 }
@@ -1,29 +1,51 @@
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 
 #include <map>
 #include <string>
 
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
+static llvm::cl::opt<bool> SSALoops("ssa-loops",
+  llvm::cl::desc("Keep loop-carried locals in phi nodes instead of allocas"));
 
-static void initializeModule() {
-  // Open a new context and moduel
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("ir_builder", *TheContext);
-  // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
-}
+static llvm::cl::opt<unsigned> VectorizeWidth("hint-vectorize-width",
+  llvm::cl::desc("Ask for the loop to be vectorized N wide"), llvm::cl::init(0));
 
-static void saveModuleIRToFile(const std::string& filename) {
-  std::error_code errorCode;
-  llvm::raw_fd_ostream out(filename, errorCode);
-  TheModule->print(out, nullptr);
-}
+static llvm::cl::opt<unsigned> InterleaveCount("hint-interleave-count",
+  llvm::cl::desc("Ask for N interleaved copies of the loop body"), llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned> UnrollCount("hint-unroll-count",
+  llvm::cl::desc("Ask for the loop to be unrolled N times"), llvm::cl::init(0));
+
+static llvm::cl::opt<bool> UnrollFull("hint-unroll-full",
+  llvm::cl::desc("Ask for the loop to be unrolled completely"));
+
+static llvm::cl::opt<bool> Distribute("hint-distribute",
+  llvm::cl::desc("Allow the loop to be split into several loops"));
+
+static llvm::cl::opt<bool> ParallelAccesses("hint-parallel-accesses",
+  llvm::cl::desc("Promise that no memory access of one iteration aliases another iteration's"));
+
+static llvm::cl::opt<unsigned> EmitUnroll("emit-unroll",
+  llvm::cl::desc("Treat the loop bounds as constants and emit N copies of the body per iteration"),
+  llvm::cl::init(0));
+
+static llvm::cl::opt<bool> EmitUnrollFull("emit-unroll-full",
+  llvm::cl::desc("Treat the loop bounds as constants and emit the loop without a loop"));
+
+static llvm::cl::opt<bool> LoopReport("loop-report",
+  llvm::cl::desc("Run the -O2 pipeline on a copy of the module and report what became of each hinted loop"));
+
+static llvm::cl::opt<unsigned> ScaleData("scale-data",
+  llvm::cl::desc("Also emit a hinted loop over a global int data[N] that survives until the loop passes"),
+  llvm::cl::init(0));
 
 typedef struct FunProto {
   llvm::Type *returnType;
@@ -31,292 +53,716 @@ typedef struct FunProto {
   bool isVarArg;
 } FunProto;
 
-static std::map<std::string, FunProto> funProtoMap;
+// What a loop asks of the loop passes, as llvm.loop metadata on its back
+// edge. Zero and false mean no hint.
+struct LoopHints {
+  unsigned vectorizeWidth = 0;
+  unsigned interleaveCount = 0;
+  unsigned unrollCount = 0;
+  bool unrollFull = false;
+  bool distribute = false;
+  // No iteration's loads and stores alias another iteration's.
+  bool parallelAccesses = false;
+  // The loop has been unrolled already.
+  bool unrollDisable = false;
+};
+
+// A loop emitLoopHints() attached hints to, for the loop report.
+struct HintedLoop {
+  std::string name;
+  LoopHints hints;
+  std::vector<llvm::BasicBlock *> blocks;
+};
+
+// Everything one emission writes into. Sessions share no state, so each
+// thread can build its own module alongside the others.
+struct EmitSession {
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  std::unique_ptr<llvm::IRBuilder<>> Builder;
+  std::map<std::string, FunProto> funProtoMap;
+  std::vector<HintedLoop> hintedLoops;
+};
+
+static void initializeModule(EmitSession &session) {
+  // Open a new context and moduel
+  session.TheContext = std::make_unique<llvm::LLVMContext>();
+  session.TheModule = std::make_unique<llvm::Module>("ir_builder", *session.TheContext);
+  // Create a new builder for the module.
+  session.Builder = std::make_unique<llvm::IRBuilder<>>(*session.TheContext);
+}
 
-void registerFunctionProto() {
-  auto int32Ty = Builder->getInt32Ty();
-  funProtoMap["main"] = {
+static void saveModuleIRToFile(EmitSession &session, const std::string& filename) {
+  std::error_code errorCode;
+  llvm::raw_fd_ostream out(filename, errorCode);
+  session.TheModule->print(out, nullptr);
+}
+
+void registerFunctionProto(EmitSession &session) {
+  auto int32Ty = session.Builder->getInt32Ty();
+  session.funProtoMap["main"] = {
     int32Ty,
     {},
     false,
   };
 }
 
-llvm::Function *declareFunction(std::string name) {
-  auto* func = TheModule->getFunction(name);
+llvm::Function *declareFunction(EmitSession &session, std::string name) {
+  auto* func = session.TheModule->getFunction(name);
   if (func == nullptr) {
-    FunProto funProto = funProtoMap[name];
+    FunProto funProto = session.funProtoMap[name];
     auto* funcType = llvm::FunctionType::get(funProto.returnType, funProto.params, funProto.isVarArg);
-    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, TheModule.get());
+    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, session.TheModule.get());
     func->setDSOLocal(true);
   }
   return func;
 }
 
-void emitReturn(llvm::Type *ty, llvm::Value *value) {
+void emitReturn(EmitSession &session, llvm::Type *ty, llvm::Value *value) {
   if (ty->isVoidTy()) {
-    Builder->CreateRetVoid();
+    session.Builder->CreateRetVoid();
   } else {
-    Builder->CreateRet(value);
+    session.Builder->CreateRet(value);
   }
 }
 
-llvm::BasicBlock* createBB(llvm::Function *fn, std::string name) {
-  return llvm::BasicBlock::Create(*TheContext, name, fn);
+llvm::BasicBlock* createBB(EmitSession &session, llvm::Function *fn, std::string name) {
+  return llvm::BasicBlock::Create(*session.TheContext, name, fn);
 }
 
-llvm::Value* emitMainFunctionStatementList(llvm::Function *);
+llvm::Value* emitMainFunctionStatementList(EmitSession &, llvm::Function *);
 
-void emitFunctionBody(llvm::Function *fn) {
+void emitFunctionBody(EmitSession &session, llvm::Function *fn) {
   // Create entry basic block
-  auto *entry = createBB(fn, "entry");
-  Builder->SetInsertPoint(entry);
+  auto *entry = createBB(session, fn, "entry");
+  session.Builder->SetInsertPoint(entry);
 
   // emit return
-  auto *value = emitMainFunctionStatementList(fn);
-  emitReturn(fn->getReturnType(), value);
+  auto *value = emitMainFunctionStatementList(session, fn);
+  emitReturn(session, fn->getReturnType(), value);
 }
 
-void defineFunction(std::string name) {
+void defineFunction(EmitSession &session, std::string name) {
   // Function must be declated before define
-  auto* fn = TheModule->getFunction(name);
-  emitFunctionBody(fn);
+  auto* fn = session.TheModule->getFunction(name);
+  emitFunctionBody(session, fn);
   verifyFunction(*fn);
 }
 
-llvm::GlobalVariable* defineGlobalVariable(llvm::Type *type, std::string name, llvm::Constant *init) {
-  TheModule->getOrInsertGlobal(name, type);
-  auto *globalVar = TheModule->getNamedGlobal(name);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, llvm::Type *type, std::string name, llvm::Constant *init) {
+  session.TheModule->getOrInsertGlobal(name, type);
+  auto *globalVar = session.TheModule->getNamedGlobal(name);
   globalVar->setInitializer(init);
   globalVar->setDSOLocal(true);
   return globalVar;
 }
 
-llvm::GlobalVariable* defineGlobalVariable(std::string name, llvm::Constant *init) {
-  return defineGlobalVariable(init->getType(), name, init);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, std::string name, llvm::Constant *init) {
+  return defineGlobalVariable(session, init->getType(), name, init);
 }
 
-llvm::Value* emitLoadValue(llvm::GlobalVariable *value) {
-  return Builder->CreateLoad(value->getInitializer()->getType(), value);
+llvm::Value* emitLoadValue(EmitSession &session, llvm::GlobalVariable *value) {
+  return session.Builder->CreateLoad(value->getInitializer()->getType(), value);
 }
 
-llvm::Value* emitLoadValue(llvm::Value *value) {
+llvm::Value* emitLoadValue(EmitSession &session, llvm::Value *value) {
   auto baseType = value->getType()->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, value);
+  return session.Builder->CreateLoad(baseType, value);
 }
 
-llvm::Value* emitLoadGlobalVar(std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  auto rValue = emitLoadValue(globalVar);
+llvm::Value* emitLoadGlobalVar(EmitSession &session, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  auto rValue = emitLoadValue(session, globalVar);
   return rValue;
 }
 
-void emitAssign(llvm::Value *left, llvm::Value *right) {
-  Builder->CreateStore(right, left);
+void emitAssign(EmitSession &session, llvm::Value *left, llvm::Value *right) {
+  session.Builder->CreateStore(right, left);
 }
 
-void emitStoreGlobalVar(llvm::Value *value, std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  emitAssign(globalVar, value);
+void emitStoreGlobalVar(EmitSession &session, llvm::Value *value, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  emitAssign(session, globalVar, value);
 }
 
-llvm::Value* emitStackLocalVariable(llvm::Type *type, std::string name) {
-  return Builder->CreateAlloca(type, nullptr, name);
+llvm::Value* emitStackLocalVariable(EmitSession &session, llvm::Type *type, std::string name) {
+  return session.Builder->CreateAlloca(type, nullptr, name);
 }
 
-void emitConstant(llvm::Type *ty, std::string name, llvm::Constant *init) {
+void emitConstant(EmitSession &session, llvm::Type *ty, std::string name, llvm::Constant *init) {
   // private constant format: @__constant.function_name.variable_name
-  auto currentFunction = Builder->GetInsertBlock()->getParent();
+  auto currentFunction = session.Builder->GetInsertBlock()->getParent();
   std::string funcName = currentFunction->getName().data();
   std::string constVarName = "__constant." + funcName + "."+ name;
 
-  auto constantVar = defineGlobalVariable(ty, constVarName, init);
+  auto constantVar = defineGlobalVariable(session, ty, constVarName, init);
 
   constantVar->setConstant(true);
   constantVar->setLinkage(llvm::GlobalValue::LinkageTypes::PrivateLinkage);
 }
 
-void emitStringPtr(std::string content, std::string name) {
-  auto strPtr = Builder->CreateGlobalStringPtr(content, "." + name);
+void emitStringPtr(EmitSession &session, std::string content, std::string name) {
+  auto strPtr = session.Builder->CreateGlobalStringPtr(content, "." + name);
 }
 
-void emitIntegers() {
+// What emitIntegers() initializes start and end to. The unrolled loops take
+// these as their bounds instead of loading the globals.
+static const int32_t startInit = 1;
+static const int32_t endInit = 10;
+
+void emitIntegers(EmitSession &session) {
   // int start = 1;
-  defineGlobalVariable("start", Builder->getInt32(1));
+  defineGlobalVariable(session, "start", session.Builder->getInt32(startInit));
   // int end = 10;
-  defineGlobalVariable("end", Builder->getInt32(10));
+  defineGlobalVariable(session, "end", session.Builder->getInt32(endInit));
   // int result = 0;
-  defineGlobalVariable("result", Builder->getInt32(0));
+  defineGlobalVariable(session, "result", session.Builder->getInt32(0));
 }
 
-void emitFloats() {
+void emitFloats(EmitSession &session) {
   // float f = 1.0;
-  defineGlobalVariable(Builder->getFloatTy(), "f", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, session.Builder->getFloatTy(), "f", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // double d = 2.0
-  defineGlobalVariable(Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(Builder->getDoubleTy(), 2.0));
+  defineGlobalVariable(session, session.Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(session.Builder->getDoubleTy(), 2.0));
   
   //long double ld = 3.0;
-  auto ldType = llvm::Type::getX86_FP80Ty(*TheContext);
-  defineGlobalVariable(ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
+  auto ldType = llvm::Type::getX86_FP80Ty(*session.TheContext);
+  defineGlobalVariable(session, ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
 
   // float f_1 = 1.0;
-  defineGlobalVariable("f_1", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, "f_1", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // float f_2 = 2.0
-  defineGlobalVariable("f_2", llvm::ConstantFP::get(Builder->getFloatTy(), 2.0));
+  defineGlobalVariable(session, "f_2", llvm::ConstantFP::get(session.Builder->getFloatTy(), 2.0));
 }
 
 // int arr[] = { 1, 2, 3, 4 };
-void emitArray() {
+void emitArray(EmitSession &session) {
   // int arr[4];
   int num = 4;
-  llvm::Type *ty = Builder->getInt32Ty();
+  llvm::Type *ty = session.Builder->getInt32Ty();
   llvm::ArrayType *arrType = llvm::ArrayType::get(ty, num);
 
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
-  list.push_back(Builder->getInt32(2));
-  list.push_back(Builder->getInt32(3));
-  list.push_back(Builder->getInt32(4));
+  list.push_back(session.Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(2));
+  list.push_back(session.Builder->getInt32(3));
+  list.push_back(session.Builder->getInt32(4));
 
   llvm::Constant *c = llvm::ConstantArray::get(arrType, list);
 
-  defineGlobalVariable(arrType, "arr", c);
+  defineGlobalVariable(session, arrType, "arr", c);
 }
 
 /**
  * struct point { int x; int y; };
  * struct point point = { 1, 2 };
  */
-void emitStruct() {
+void emitStruct(EmitSession &session) {
   // struct point { int x; int y; }
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "struct.point");
-  structTy->setBody({Builder->getInt32Ty(), Builder->getInt32Ty()});
+  llvm::StructType *structTy = llvm::StructType::create(*session.TheContext, "struct.point");
+  structTy->setBody({session.Builder->getInt32Ty(), session.Builder->getInt32Ty()});
 
   // struct point  = { 11, 12 }
   int num = 2;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(11));
-  list.push_back(Builder->getInt32(12));
+  list.push_back(session.Builder->getInt32(11));
+  list.push_back(session.Builder->getInt32(12));
   
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
 
-  defineGlobalVariable(structTy, "pointer", c);
+  defineGlobalVariable(session, structTy, "pointer", c);
 }
 
 /**
  * union ab  {  int a;  float b; };
  * union ab u = { 1 };
  */
-void emitUnion() {
+void emitUnion(EmitSession &session) {
   // union ab  {  int a;  float b; };
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "union.ab");
-  structTy->setBody(Builder->getInt32Ty());
+  llvm::StructType *structTy = llvm::StructType::create(*session.TheContext, "union.ab");
+  structTy->setBody(session.Builder->getInt32Ty());
 
   // union ab u = { 1 };
   int num = 1;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(1));
 
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
-  defineGlobalVariable(structTy, "u", c);
+  defineGlobalVariable(session, structTy, "u", c);
 }
 
-void emitPointer() {
+void emitPointer(EmitSession &session) {
   // int *i_p;
-  auto pointerTy = llvm::PointerType::get(Builder->getInt32Ty(), 0);
+  auto pointerTy = llvm::PointerType::get(session.Builder->getInt32Ty(), 0);
   auto c = llvm::Constant::getNullValue(pointerTy);
-  defineGlobalVariable(pointerTy, "i_p", c);
+  defineGlobalVariable(session, pointerTy, "i_p", c);
 
   // char *c_p;
-  auto charPtrTy = llvm::PointerType::get(Builder->getInt8Ty(), 0);
+  auto charPtrTy = llvm::PointerType::get(session.Builder->getInt8Ty(), 0);
   auto cCharPtr = llvm::Constant::getNullValue(charPtrTy);
-  defineGlobalVariable(charPtrTy, "c_p", cCharPtr);
+  defineGlobalVariable(session, charPtrTy, "c_p", cCharPtr);
 }
 
 // char *str = "hello\n";
-void emitConstString() {
-  emitStringPtr("hello", "str");
+void emitConstString(EmitSession &session) {
+  emitStringPtr(session, "hello", "str");
+}
+
+// A local carried around a loop, in an alloca like any other local. With
+// --ssa-loops emitLoopVarEnd() then rewrites its loads and stores into phis
+// through SSAUpdater, wherever the stores sit, so the loop is already in
+// register form without a mem2reg run.
+struct LoopVar {
+  // Set in an unrolled copy of a body, where the value is known outright.
+  llvm::Value *known = nullptr;
+  llvm::AllocaInst *addr = nullptr;
+  // Every load and store of addr, for emitLoopVarEnd().
+  llvm::SmallVector<llvm::Instruction *, 8> accesses;
+};
+
+LoopVar emitLoopVar(EmitSession &session, llvm::Type *type, std::string name) {
+  LoopVar var;
+  var.addr = session.Builder->CreateAlloca(type, nullptr, name);
+  return var;
+}
+
+llvm::Value* emitLoadLoopVar(EmitSession &session, LoopVar &var) {
+  if (var.known != nullptr) {
+    return var.known;
+  }
+  auto load = session.Builder->CreateLoad(var.addr->getAllocatedType(), var.addr);
+  var.accesses.push_back(load);
+  return load;
+}
+
+void emitStoreLoopVar(EmitSession &session, LoopVar &var, llvm::Value *value) {
+  var.accesses.push_back(session.Builder->CreateStore(value, var.addr));
+}
+
+// Call once the loop is complete, back edge included, since SSAUpdater needs
+// every predecessor of the header to place its phis.
+void emitLoopVarEnd(EmitSession &session, LoopVar &var) {
+  if (!SSALoops) {
+    return;
+  }
+  // The phis take over the alloca's name.
+  auto name = var.addr->getName().str();
+  var.addr->setName("");
+  llvm::SSAUpdater updater;
+  llvm::LoadAndStorePromoter(var.accesses, updater, name).run(var.accesses);
+  var.addr->eraseFromParent();
+  var.addr = nullptr;
+  var.accesses.clear();
+}
+
+LoopHints loopHintsFromOptions() {
+  LoopHints hints;
+  hints.vectorizeWidth = VectorizeWidth;
+  hints.interleaveCount = InterleaveCount;
+  hints.unrollCount = UnrollCount;
+  hints.unrollFull = UnrollFull;
+  hints.distribute = Distribute;
+  hints.parallelAccesses = ParallelAccesses;
+  return hints;
+}
+
+// Attach `hints` to the loop made of `blocks`, whose back edge is `latch`.
+void emitLoopHints(EmitSession &session, llvm::Instruction *latch, llvm::ArrayRef<llvm::BasicBlock *> blocks,
+                   const LoopHints &hints) {
+  auto &context = *session.TheContext;
+  auto flag = [&](std::string name) -> llvm::Metadata * {
+    return llvm::MDNode::get(context, llvm::MDString::get(context, name));
+  };
+  auto count = [&](std::string name, unsigned value) -> llvm::Metadata * {
+    auto constant = llvm::ConstantAsMetadata::get(session.Builder->getInt32(value));
+    return llvm::MDNode::get(context, {llvm::MDString::get(context, name), constant});
+  };
+  auto enable = [&](std::string name) -> llvm::Metadata * {
+    auto constant = llvm::ConstantAsMetadata::get(session.Builder->getTrue());
+    return llvm::MDNode::get(context, {llvm::MDString::get(context, name), constant});
+  };
+
+  llvm::SmallVector<llvm::Metadata *, 8> properties;
+  if (hints.vectorizeWidth > 0) {
+    properties.push_back(enable("llvm.loop.vectorize.enable"));
+    properties.push_back(count("llvm.loop.vectorize.width", hints.vectorizeWidth));
+  }
+  if (hints.interleaveCount > 0) {
+    properties.push_back(count("llvm.loop.interleave.count", hints.interleaveCount));
+  }
+  if (hints.unrollDisable) {
+    properties.push_back(flag("llvm.loop.unroll.disable"));
+  } else if (hints.unrollFull) {
+    properties.push_back(flag("llvm.loop.unroll.full"));
+  } else if (hints.unrollCount > 0) {
+    properties.push_back(count("llvm.loop.unroll.count", hints.unrollCount));
+  }
+  if (hints.distribute) {
+    properties.push_back(enable("llvm.loop.distribute.enable"));
+  }
+  if (hints.parallelAccesses) {
+    // Every access in the loop joins one access group the loop vouches for.
+    auto group = llvm::MDNode::getDistinct(context, {});
+    for (auto block : blocks) {
+      for (auto &inst : *block) {
+        if (inst.mayReadOrWriteMemory()) {
+          inst.setMetadata(llvm::LLVMContext::MD_access_group, group);
+        }
+      }
+    }
+    properties.push_back(llvm::MDNode::get(context, {llvm::MDString::get(context, "llvm.loop.parallel_accesses"), group}));
+  }
+  if (properties.empty()) {
+    return;
+  }
+
+  // The loop ID refers to itself, so it is never uniqued with another loop's.
+  properties.insert(properties.begin(), nullptr);
+  auto loopID = llvm::MDNode::getDistinct(context, properties);
+  loopID->replaceOperandWith(0, loopID);
+  latch->setMetadata(llvm::LLVMContext::MD_loop, loopID);
+
+  auto header = blocks.front();
+  session.hintedLoops.push_back({header->getParent()->getName().str() + ", loop at %" + header->getName().str(),
+                                 hints, blocks.vec()});
+}
+
+// Which hint a loop pass remark answers: "vectorize" for the vectorize width
+// and interleave count, "unroll" or "distribute".
+static std::string remarkHint(llvm::StringRef pass, llvm::StringRef message) {
+  if (pass == "loop-vectorize" || message.startswith("loop not vectorized") ||
+      message.startswith("loop not interleaved")) {
+    return "vectorize";
+  }
+  if (pass == "loop-unroll" || message.startswith("loop not unrolled")) {
+    return "unroll";
+  }
+  if (pass == "loop-distribute" || message.startswith("loop not distributed")) {
+    return "distribute";
+  }
+  return "";
 }
 
-llvm::Value* genIncrement(llvm::Value *left, int step) {
+// Collects what the loop passes say about the hinted loops.
+struct LoopRemarkHandler : public llvm::DiagnosticHandler {
+  struct Remark {
+    std::string hint;
+    bool applied;
+    std::string message;
+  };
+  // The blocks of each hinted loop in the module being optimized, and the
+  // remarks made about it. A block the passes delete drops out.
+  std::vector<std::vector<llvm::WeakVH>> loopBlocks;
+  std::vector<std::vector<Remark>> loopRemarks;
+
+  static bool isLoopPass(llvm::StringRef pass) {
+    return pass == "loop-vectorize" || pass == "loop-unroll" || pass == "loop-distribute" ||
+           pass == "transform-warning";
+  }
+  bool isAnalysisRemarkEnabled(llvm::StringRef pass) const override { return false; }
+  bool isMissedOptRemarkEnabled(llvm::StringRef pass) const override { return isLoopPass(pass); }
+  bool isPassedOptRemarkEnabled(llvm::StringRef pass) const override { return isLoopPass(pass); }
+  bool isAnyRemarkEnabled() const override { return true; }
+
+  bool handleDiagnostics(const llvm::DiagnosticInfo &info) override {
+    auto remark = llvm::dyn_cast<llvm::DiagnosticInfoIROptimization>(&info);
+    if (remark == nullptr) {
+      return false;
+    }
+    // Other passes' remarks are swallowed, as clang does without -Rpass.
+    bool failure = llvm::isa<llvm::DiagnosticInfoOptimizationFailure>(remark);
+    if (!failure && !isLoopPass(remark->getPassName())) {
+      return true;
+    }
+    if (!remark->isPassed() && !remark->isMissed() && !failure) {
+      return true;
+    }
+    // Loop remarks are made about the loop header.
+    auto region = remark->getCodeRegion();
+    std::string message = remark->getMsg();
+    for (size_t i = 0; i < loopBlocks.size(); ++i) {
+      for (auto &block : loopBlocks[i]) {
+        if (region != nullptr && block == region) {
+          loopRemarks[i].push_back({remarkHint(remark->getPassName(), message), remark->isPassed(), message});
+          return true;
+        }
+      }
+    }
+    return true;
+  }
+};
+
+// The hints a loop asked for that a loop pass could act on, each with the
+// hint its remarks answer.
+static std::vector<std::pair<std::string, std::string>> describeHints(const LoopHints &hints) {
+  std::vector<std::pair<std::string, std::string>> described;
+  if (hints.vectorizeWidth > 0) {
+    described.push_back({"vectorize width " + std::to_string(hints.vectorizeWidth), "vectorize"});
+  }
+  if (hints.interleaveCount > 0) {
+    described.push_back({"interleave count " + std::to_string(hints.interleaveCount), "vectorize"});
+  }
+  if (hints.unrollDisable) {
+    // Asks for nothing to happen.
+  } else if (hints.unrollFull) {
+    described.push_back({"unroll full", "unroll"});
+  } else if (hints.unrollCount > 0) {
+    described.push_back({"unroll count " + std::to_string(hints.unrollCount), "unroll"});
+  }
+  if (hints.distribute) {
+    described.push_back({"distribute", "distribute"});
+  }
+  return described;
+}
+
+// Optimize a copy of the module the way clang -O2 would and report, for each
+// hint of each hinted loop, whether the loop passes applied it.
+void reportLoopTransforms(EmitSession &session) {
+  llvm::ValueToValueMapTy vmap;
+  auto module = llvm::CloneModule(*session.TheModule, vmap);
+  auto handler = std::make_unique<LoopRemarkHandler>();
+  for (auto &loop : session.hintedLoops) {
+    std::vector<llvm::WeakVH> blocks;
+    for (auto block : loop.blocks) {
+      blocks.push_back(llvm::WeakVH(vmap[block]));
+    }
+    handler->loopBlocks.push_back(blocks);
+    handler->loopRemarks.emplace_back();
+  }
+  auto remarks = handler.get();
+  auto previous = session.TheContext->getDiagnosticHandler();
+  session.TheContext->setDiagnosticHandler(std::move(handler));
+
+  llvm::LoopAnalysisManager loopAnalysis;
+  llvm::FunctionAnalysisManager functionAnalysis;
+  llvm::CGSCCAnalysisManager cgsccAnalysis;
+  llvm::ModuleAnalysisManager moduleAnalysis;
+  llvm::PassBuilder builder;
+  builder.registerModuleAnalyses(moduleAnalysis);
+  builder.registerCGSCCAnalyses(cgsccAnalysis);
+  builder.registerFunctionAnalyses(functionAnalysis);
+  builder.registerLoopAnalyses(loopAnalysis);
+  builder.crossRegisterProxies(loopAnalysis, functionAnalysis, cgsccAnalysis, moduleAnalysis);
+  builder.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2).run(*module, moduleAnalysis);
+
+  for (size_t i = 0; i < session.hintedLoops.size(); ++i) {
+    auto &loop = session.hintedLoops[i];
+    for (auto &hint : describeHints(loop.hints)) {
+      // A missed remark stands unless a later pass applied the hint after all.
+      const LoopRemarkHandler::Remark *answer = nullptr;
+      for (auto &remark : remarks->loopRemarks[i]) {
+        if (remark.hint == hint.second && (answer == nullptr || remark.applied)) {
+          answer = &remark;
+        }
+      }
+      llvm::errs() << "loop report: " << loop.name << ": " << hint.first << ": ";
+      if (answer == nullptr) {
+        llvm::errs() << "no remark, the loop was folded or deleted before the loop passes ran\n";
+      } else {
+        llvm::errs() << (answer->applied ? "applied: " : "missed: ") << answer->message << "\n";
+      }
+    }
+  }
+  session.TheContext->setDiagnosticHandler(std::move(previous));
+}
+
+llvm::Value* genIncrement(EmitSession &session, LoopVar &var, int step) {
   // Temporary variables/Registers
-  auto type = left->getType()->getNonOpaquePointerElementType();
-  auto valueL = Builder->CreateLoad(type, left);
-  auto valueR = Builder->getInt32(step);
-  auto value = Builder->CreateNSWAdd(valueL, valueR);
+  auto valueL = emitLoadLoopVar(session, var);
+  auto valueR = session.Builder->getInt32(step);
+  auto value = session.Builder->CreateNSWAdd(valueL, valueR);
   return value;
 }
 
-llvm::Value* emitMainFunctionStatementList(llvm::Function *fn) {
-  llvm::BasicBlock *conditionBB = createBB(fn, "condition");
-  llvm::BasicBlock *bodyBB = createBB(fn, "body");
-  llvm::BasicBlock *incrementBB = createBB(fn, "increment");
-  llvm::BasicBlock *endBB = createBB(fn, "end");
+// for (index = first(); index <= last(); index += step) body(index);
+// The canonical counted loop: condition, body and increment blocks, with
+// last() evaluated in the condition block on every iteration.
+void emitForLoop(EmitSession &session, llvm::Function *fn, llvm::function_ref<llvm::Value*()> first,
+                 llvm::function_ref<llvm::Value*()> last, int step,
+                 llvm::function_ref<void(LoopVar &)> body, const LoopHints &hints) {
+  llvm::BasicBlock *conditionBB = createBB(session, fn, "condition");
+  llvm::BasicBlock *bodyBB = createBB(session, fn, "body");
+  llvm::BasicBlock *incrementBB = createBB(session, fn, "increment");
+  llvm::BasicBlock *endBB = createBB(session, fn, "end");
 
   // int index;
-  auto indexAddr = Builder->CreateAlloca(Builder->getInt32Ty(), nullptr, "index");
+  auto index = emitLoopVar(session, session.Builder->getInt32Ty(), "index");
 
   // index = start;
-  auto startV = emitLoadGlobalVar("start");
-  Builder->CreateStore(startV, indexAddr);
+  emitStoreLoopVar(session, index, first());
 
   // goto for condition
-  Builder->CreateBr(conditionBB);
+  session.Builder->CreateBr(conditionBB);
   
   // condition bb 
-  Builder->SetInsertPoint(conditionBB);
-  // index <= start;
-  auto indexV = emitLoadValue(indexAddr);
-  auto endV = emitLoadGlobalVar("end");
-  auto compare = Builder->CreateICmpSLE(indexV, endV);
-  Builder->CreateCondBr(compare, bodyBB, endBB);
+  session.Builder->SetInsertPoint(conditionBB);
+  // index <= end;
+  auto indexV = emitLoadLoopVar(session, index);
+  auto endV = last();
+  auto compare = session.Builder->CreateICmpSLE(indexV, endV);
+  session.Builder->CreateCondBr(compare, bodyBB, endBB);
 
   // body bb
-  Builder->SetInsertPoint(bodyBB);
-  // result = result + index;
-  auto resultV = emitLoadGlobalVar("result");
-  indexV = emitLoadValue(indexAddr);
-  auto sum = Builder->CreateNSWAdd(resultV, indexV);
-  emitStoreGlobalVar(sum, "result");
-  Builder->CreateBr(incrementBB);
-
-  // increment BB index = index + 1
-  Builder->SetInsertPoint(incrementBB);
-  auto incVal = genIncrement(indexAddr, 1);
-  Builder->CreateStore(incVal, indexAddr);
-  Builder->CreateBr(conditionBB);
+  session.Builder->SetInsertPoint(bodyBB);
+  body(index);
+  session.Builder->CreateBr(incrementBB);
+
+  // increment BB index = index + step
+  session.Builder->SetInsertPoint(incrementBB);
+  auto incVal = genIncrement(session, index, step);
+  emitStoreLoopVar(session, index, incVal);
+  auto latch = session.Builder->CreateBr(conditionBB);
+  emitLoopHints(session, latch, {conditionBB, bodyBB, incrementBB}, hints);
+  emitLoopVarEnd(session, index);
 
   // end
-  Builder->SetInsertPoint(endBB);
-  auto value = emitLoadGlobalVar("result");
+  session.Builder->SetInsertPoint(endBB);
+}
+
+// How emitUnrolledForLoop() copies the body of a loop with constant bounds.
+struct UnrollPolicy {
+  // Copy it once per iteration, without any loop, if there are at most
+  // maxFullTripCount iterations.
+  bool full = false;
+  unsigned maxFullTripCount = 64;
+  // Otherwise copy it this many times per iteration of the loop, and the
+  // iterations left over once more each after it.
+  unsigned factor = 1;
+};
+
+UnrollPolicy unrollPolicyFromOptions() {
+  UnrollPolicy policy;
+  policy.full = EmitUnrollFull;
+  policy.factor = std::max(1u, EmitUnroll.getValue());
+  return policy;
+}
+
+// for (index = first; index <= last; index++) body(index);
+// with both bounds known, unrolled at emission time as `policy` says.
+void emitUnrolledForLoop(EmitSession &session, llvm::Function *fn, llvm::ConstantInt *first,
+                         llvm::ConstantInt *last, const UnrollPolicy &policy,
+                         llvm::function_ref<void(LoopVar &)> body, LoopHints hints) {
+  auto type = first->getType();
+  int64_t firstV = first->getSExtValue();
+  int64_t lastV = last->getSExtValue();
+  uint64_t tripCount = lastV >= firstV ? uint64_t(lastV - firstV) + 1 : 0;
+
+  auto emitCopy = [&](llvm::Value *value) {
+    LoopVar copy;
+    copy.known = value;
+    body(copy);
+  };
+
+  if (policy.full && tripCount <= policy.maxFullTripCount) {
+    for (uint64_t i = 0; i < tripCount; ++i) {
+      emitCopy(llvm::ConstantInt::get(type, firstV + i));
+    }
+    return;
+  }
+  if (policy.factor <= 1) {
+    emitForLoop(session, fn, [&] { return first; }, [&] { return last; }, 1, body, hints);
+    return;
+  }
+
+  // Whole groups of `factor` iterations run in the loop, the rest after it.
+  uint64_t factor = policy.factor;
+  uint64_t loopTrips = tripCount / factor * factor;
+  if (loopTrips > 0) {
+    auto loopLast = llvm::ConstantInt::get(type, firstV + loopTrips - factor);
+    hints.unrollDisable = true;
+    emitForLoop(session, fn, [&] { return first; }, [&] { return loopLast; }, factor,
+      [&](LoopVar &index) {
+        auto indexV = emitLoadLoopVar(session, index);
+        for (uint64_t i = 0; i < factor; ++i) {
+          emitCopy(i == 0 ? indexV : session.Builder->CreateNSWAdd(indexV, llvm::ConstantInt::get(type, i)));
+        }
+      }, hints);
+  }
+  for (uint64_t i = loopTrips; i < tripCount; ++i) {
+    emitCopy(llvm::ConstantInt::get(type, firstV + i));
+  }
+}
+
+llvm::Value* emitMainFunctionStatementList(EmitSession &session, llvm::Function *fn) {
+  // result = result + index;
+  auto body = [&](LoopVar &index) {
+    auto resultV = emitLoadGlobalVar(session, "result");
+    auto indexV = emitLoadLoopVar(session, index);
+    auto sum = session.Builder->CreateNSWAdd(resultV, indexV);
+    emitStoreGlobalVar(session, sum, "result");
+  };
+
+  if (ScaleData > 0) {
+    // for (index = 0; index <= N - 1; index++) data[index] = data[index] * 3 + index;
+    auto data = session.TheModule->getGlobalVariable("data");
+    emitForLoop(session, fn,
+      [&] { return session.Builder->getInt32(0); },
+      [&] { return session.Builder->getInt32(ScaleData - 1); },
+      1, [&](LoopVar &index) {
+        auto indexV = emitLoadLoopVar(session, index);
+        auto offset = session.Builder->CreateSExt(indexV, session.Builder->getInt64Ty());
+        auto element = session.Builder->CreateInBoundsGEP(data->getValueType(), data,
+                                                          {session.Builder->getInt64(0), offset});
+        auto value = session.Builder->CreateLoad(session.Builder->getInt32Ty(), element);
+        auto scaled = session.Builder->CreateNSWMul(value, session.Builder->getInt32(3));
+        session.Builder->CreateStore(session.Builder->CreateNSWAdd(scaled, indexV), element);
+      }, loopHintsFromOptions());
+  }
+
+  // for (index = start; index <= end; index++)
+  auto policy = unrollPolicyFromOptions();
+  if (policy.full || policy.factor > 1) {
+    auto startV = session.Builder->getInt32(startInit);
+    auto endV = session.Builder->getInt32(endInit);
+    emitUnrolledForLoop(session, fn, startV, endV, policy, body, loopHintsFromOptions());
+  } else {
+    emitForLoop(session, fn,
+      [&] { return emitLoadGlobalVar(session, "start"); },
+      [&] { return emitLoadGlobalVar(session, "end"); },
+      1, body, loopHintsFromOptions());
+  }
+
+  auto value = emitLoadGlobalVar(session, "result");
   // return result;
   return value;
 }
 
-void emitProgram() {
-  emitIntegers();
+void emitProgram(EmitSession &session) {
+  emitIntegers(session);
+  if (ScaleData > 0) {
+    // int data[N];
+    auto dataType = llvm::ArrayType::get(session.Builder->getInt32Ty(), ScaleData);
+    defineGlobalVariable(session, dataType, "data", llvm::ConstantAggregateZero::get(dataType));
+  }
 
-  declareFunction("main");
-  defineFunction("main");
+  declareFunction(session, "main");
+  defineFunction(session, "main");
 }
 
 int main(int argc, char *argv[]) {
-  initializeModule();
+  llvm::cl::ParseCommandLineOptions(argc, argv);
+
+  EmitSession session;
+  initializeModule(session);
 
   auto targetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(targetTriple);
+  session.TheModule->setTargetTriple(targetTriple);
 
-  registerFunctionProto();
+  registerFunctionProto(session);
 
-  emitProgram();
+  emitProgram(session);
 
-  TheModule->print(llvm::outs(), nullptr);
+  session.TheModule->print(llvm::outs(), nullptr);
+
+  if (LoopReport) {
+    reportLoopTransforms(session);
+  }
 
-  saveModuleIRToFile("./out.ll");
+  saveModuleIRToFile(session, "./out.ll");
   return 0;
 }
@@ -1,17 +1,42 @@
+#include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 
 #include <map>
 #include <string>
 
 using namespace llvm;
 
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<Module> TheModule;
-static std::unique_ptr<IRBuilder<>> Builder;
+static cl::opt<bool> SSALoops("ssa-loops",
+  cl::desc("Keep loop-carried locals in phi nodes instead of allocas"));
+
+static cl::opt<unsigned> VectorizeWidth("hint-vectorize-width",
+  cl::desc("Ask for the loop to be vectorized N wide"), cl::init(0));
+
+static cl::opt<unsigned> InterleaveCount("hint-interleave-count",
+  cl::desc("Ask for N interleaved copies of the loop body"), cl::init(0));
+
+static cl::opt<unsigned> UnrollCount("hint-unroll-count",
+  cl::desc("Ask for the loop to be unrolled N times"), cl::init(0));
+
+static cl::opt<bool> UnrollFull("hint-unroll-full",
+  cl::desc("Ask for the loop to be unrolled completely"));
+
+static cl::opt<bool> Distribute("hint-distribute",
+  cl::desc("Allow the loop to be split into several loops"));
+
+static cl::opt<bool> ParallelAccesses("hint-parallel-accesses",
+  cl::desc("Promise that no memory access of one iteration aliases another iteration's"));
+
+static cl::opt<bool> LoopReport("loop-report",
+  cl::desc("Run the -O2 pipeline on a copy of the module and report what became of each hinted loop"));
 
 typedef struct FunProto {
   Type *returnType;
@@ -19,196 +44,480 @@ typedef struct FunProto {
   bool isVarArg;
 } FunProto;
 
-static std::map<std::string, FunProto> funProtoMap;
-
-static void initializeModule() {
+// What a loop asks of the loop passes, as llvm.loop metadata on its back
+// edge. Zero and false mean no hint.
+struct LoopHints {
+  unsigned vectorizeWidth = 0;
+  unsigned interleaveCount = 0;
+  unsigned unrollCount = 0;
+  bool unrollFull = false;
+  bool distribute = false;
+  // No iteration's loads and stores alias another iteration's.
+  bool parallelAccesses = false;
+};
+
+// A loop emitLoopHints() attached hints to, for the loop report.
+struct HintedLoop {
+  std::string name;
+  LoopHints hints;
+  std::vector<BasicBlock *> blocks;
+};
+
+// Everything one emission writes into. Sessions share no state, so each
+// thread can build its own module alongside the others.
+struct EmitSession {
+  std::unique_ptr<LLVMContext> TheContext;
+  std::unique_ptr<Module> TheModule;
+  std::unique_ptr<IRBuilder<>> Builder;
+  std::map<std::string, FunProto> funProtoMap;
+  std::vector<HintedLoop> hintedLoops;
+};
+
+static void initializeModule(EmitSession &session) {
   // Open a new context and moduel
-  TheContext = std::make_unique<LLVMContext>();
-  TheModule = std::make_unique<Module>("ir_builder", *TheContext);
+  session.TheContext = std::make_unique<LLVMContext>();
+  session.TheModule = std::make_unique<Module>("ir_builder", *session.TheContext);
   // Create a new builder for the module.
-  Builder = std::make_unique<IRBuilder<>>(*TheContext);
+  session.Builder = std::make_unique<IRBuilder<>>(*session.TheContext);
 }
 
-static void saveModuleIRToFile(const std::string& filename) {
+static void saveModuleIRToFile(EmitSession &session, const std::string& filename) {
   std::error_code errorCode;
   llvm::raw_fd_ostream out(filename, errorCode);
-  TheModule->print(out, nullptr);
+  session.TheModule->print(out, nullptr);
 }
 
-void registerFunctionProto() {
-  auto int32Ty = Builder->getInt32Ty();
-  funProtoMap["main"] = {
+void registerFunctionProto(EmitSession &session) {
+  auto int32Ty = session.Builder->getInt32Ty();
+  session.funProtoMap["main"] = {
     int32Ty,
     {},
     false,
   };
 }
 
-Function *declareFunction(std::string name) {
-  Function* func = TheModule->getFunction(name);
+Function *declareFunction(EmitSession &session, std::string name) {
+  Function* func = session.TheModule->getFunction(name);
   if (func == nullptr) {
-    FunProto funProto = funProtoMap[name];
+    FunProto funProto = session.funProtoMap[name];
     FunctionType* funcType = FunctionType::get(funProto.returnType, funProto.params, funProto.isVarArg);
-    func = Function::Create(funcType, Function::ExternalLinkage, name, TheModule.get());
+    func = Function::Create(funcType, Function::ExternalLinkage, name, session.TheModule.get());
     func->setDSOLocal(true);
   }
   return func;
 }
 
-void emitReturn(Type *ty, Value *value) {
+void emitReturn(EmitSession &session, Type *ty, Value *value) {
   if (ty->isVoidTy()) {
-    Builder->CreateRetVoid();
+    session.Builder->CreateRetVoid();
   } else {
-    Builder->CreateRet(value);
+    session.Builder->CreateRet(value);
   }
 }
 
-static BasicBlock *createBB(Function *fn, std::string Name) {
-  return BasicBlock::Create(*TheContext, Name, fn);
+static BasicBlock *createBB(EmitSession &session, Function *fn, std::string Name) {
+  return BasicBlock::Create(*session.TheContext, Name, fn);
 }
 
-Value* emitMainFunctionStatementList(Function *);
+Value* emitMainFunctionStatementList(EmitSession &, Function *);
 
-void emitFunctionBody(Function *fn) {
+void emitFunctionBody(EmitSession &session, Function *fn) {
   // Create entry basic block
-  BasicBlock *entry = createBB(fn, "entry");
-  Builder->SetInsertPoint(entry);
+  BasicBlock *entry = createBB(session, fn, "entry");
+  session.Builder->SetInsertPoint(entry);
 
-  Value *value = emitMainFunctionStatementList(fn);
+  Value *value = emitMainFunctionStatementList(session, fn);
   // emit return
-  emitReturn(fn->getReturnType(), value);
+  emitReturn(session, fn->getReturnType(), value);
 }
 
-void defineFunction(std::string name) {
+void defineFunction(EmitSession &session, std::string name) {
   // Function must be declated before define
-  Function* fn = TheModule->getFunction(name);
-  emitFunctionBody(fn);
+  Function* fn = session.TheModule->getFunction(name);
+  emitFunctionBody(session, fn);
   verifyFunction(*fn);
 }
 
-GlobalVariable* defineGlobalVariable(std::string name, llvm::Constant *init) {
-  TheModule->getOrInsertGlobal(name, init->getType());
-  GlobalVariable *globalVar = TheModule->getNamedGlobal(name);
+GlobalVariable* defineGlobalVariable(EmitSession &session, std::string name, llvm::Constant *init) {
+  session.TheModule->getOrInsertGlobal(name, init->getType());
+  GlobalVariable *globalVar = session.TheModule->getNamedGlobal(name);
   globalVar->setInitializer(init);
   globalVar->setDSOLocal(true);
   return globalVar;
 }
 
-void emitIntegers() {
+void emitIntegers(EmitSession &session) {
   // int start = 1;
-  defineGlobalVariable("start", Builder->getInt32(1));
+  defineGlobalVariable(session, "start", session.Builder->getInt32(1));
   // int end = 10;
-  defineGlobalVariable("end", Builder->getInt32(10));
+  defineGlobalVariable(session, "end", session.Builder->getInt32(10));
   // int result = 0;
-  defineGlobalVariable("result", Builder->getInt32(0));
+  defineGlobalVariable(session, "result", session.Builder->getInt32(0));
 }
 
-void emitFloats() {
+void emitFloats(EmitSession &session) {
   // float f_1 = 1.0;
-  defineGlobalVariable("f_1", ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, "f_1", ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // float f_2 = 2.0
-  defineGlobalVariable("f_2", ConstantFP::get(Builder->getFloatTy(), 2.0));
+  defineGlobalVariable(session, "f_2", ConstantFP::get(session.Builder->getFloatTy(), 2.0));
 }
 
-Value* emitLoadValue(GlobalVariable *value) {
-  return Builder->CreateLoad(value->getInitializer()->getType(), value);
+Value* emitLoadValue(EmitSession &session, GlobalVariable *value) {
+  return session.Builder->CreateLoad(value->getInitializer()->getType(), value);
 }
 
-Value* emitLoadValue(Value *value) {
+Value* emitLoadValue(EmitSession &session, Value *value) {
   auto baseType = value->getType()->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, value);
+  return session.Builder->CreateLoad(baseType, value);
 }
 
-Value* emitLoadGlobalVar(std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  auto rValue = emitLoadValue(globalVar);
+Value* emitLoadGlobalVar(EmitSession &session, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  auto rValue = emitLoadValue(session, globalVar);
   return rValue;
 }
 
-void emitAssign(Value *left, Value *right) {
-  Builder->CreateStore(right, left);
+void emitAssign(EmitSession &session, Value *left, Value *right) {
+  session.Builder->CreateStore(right, left);
+}
+
+void emitStoreGlobalVar(EmitSession &session, Value *value, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  emitAssign(session, globalVar, value);
+}
+
+Value* emitAllocaLocalVariable(EmitSession &session, Type *type, std::string name) {
+  return session.Builder->CreateAlloca(type, nullptr, name);
+}
+
+// A local carried around a loop, in an alloca like any other local. With
+// --ssa-loops emitLoopVarEnd() then rewrites its loads and stores into phis
+// through SSAUpdater, wherever the stores sit, so the loop is already in
+// register form without a mem2reg run.
+struct LoopVar {
+  AllocaInst *addr = nullptr;
+  // Every load and store of addr, for emitLoopVarEnd().
+  SmallVector<Instruction *, 8> accesses;
+};
+
+LoopVar emitLoopVar(EmitSession &session, Type *type, std::string name) {
+  LoopVar var;
+  var.addr = session.Builder->CreateAlloca(type, nullptr, name);
+  return var;
+}
+
+Value* emitLoadLoopVar(EmitSession &session, LoopVar &var) {
+  auto load = session.Builder->CreateLoad(var.addr->getAllocatedType(), var.addr);
+  var.accesses.push_back(load);
+  return load;
+}
+
+void emitStoreLoopVar(EmitSession &session, LoopVar &var, Value *value) {
+  var.accesses.push_back(session.Builder->CreateStore(value, var.addr));
+}
+
+// Call once the loop is complete, back edge included, since SSAUpdater needs
+// every predecessor of the header to place its phis.
+void emitLoopVarEnd(EmitSession &session, LoopVar &var) {
+  if (!SSALoops) {
+    return;
+  }
+  // The phis take over the alloca's name.
+  auto name = var.addr->getName().str();
+  var.addr->setName("");
+  SSAUpdater updater;
+  LoadAndStorePromoter(var.accesses, updater, name).run(var.accesses);
+  var.addr->eraseFromParent();
+  var.addr = nullptr;
+  var.accesses.clear();
+}
+
+LoopHints loopHintsFromOptions() {
+  LoopHints hints;
+  hints.vectorizeWidth = VectorizeWidth;
+  hints.interleaveCount = InterleaveCount;
+  hints.unrollCount = UnrollCount;
+  hints.unrollFull = UnrollFull;
+  hints.distribute = Distribute;
+  hints.parallelAccesses = ParallelAccesses;
+  return hints;
+}
+
+// Attach `hints` to the loop made of `blocks`, whose back edge is `latch`.
+void emitLoopHints(EmitSession &session, Instruction *latch, ArrayRef<BasicBlock *> blocks,
+                   const LoopHints &hints) {
+  auto &context = *session.TheContext;
+  auto flag = [&](std::string name) -> Metadata * {
+    return MDNode::get(context, MDString::get(context, name));
+  };
+  auto count = [&](std::string name, unsigned value) -> Metadata * {
+    auto constant = ConstantAsMetadata::get(session.Builder->getInt32(value));
+    return MDNode::get(context, {MDString::get(context, name), constant});
+  };
+  auto enable = [&](std::string name) -> Metadata * {
+    auto constant = ConstantAsMetadata::get(session.Builder->getTrue());
+    return MDNode::get(context, {MDString::get(context, name), constant});
+  };
+
+  SmallVector<Metadata *, 8> properties;
+  if (hints.vectorizeWidth > 0) {
+    properties.push_back(enable("llvm.loop.vectorize.enable"));
+    properties.push_back(count("llvm.loop.vectorize.width", hints.vectorizeWidth));
+  }
+  if (hints.interleaveCount > 0) {
+    properties.push_back(count("llvm.loop.interleave.count", hints.interleaveCount));
+  }
+  if (hints.unrollFull) {
+    properties.push_back(flag("llvm.loop.unroll.full"));
+  } else if (hints.unrollCount > 0) {
+    properties.push_back(count("llvm.loop.unroll.count", hints.unrollCount));
+  }
+  if (hints.distribute) {
+    properties.push_back(enable("llvm.loop.distribute.enable"));
+  }
+  if (hints.parallelAccesses) {
+    // Every access in the loop joins one access group the loop vouches for.
+    auto group = MDNode::getDistinct(context, {});
+    for (auto block : blocks) {
+      for (auto &inst : *block) {
+        if (inst.mayReadOrWriteMemory()) {
+          inst.setMetadata(LLVMContext::MD_access_group, group);
+        }
+      }
+    }
+    properties.push_back(MDNode::get(context, {MDString::get(context, "llvm.loop.parallel_accesses"), group}));
+  }
+  if (properties.empty()) {
+    return;
+  }
+
+  // The loop ID refers to itself, so it is never uniqued with another loop's.
+  properties.insert(properties.begin(), nullptr);
+  auto loopID = MDNode::getDistinct(context, properties);
+  loopID->replaceOperandWith(0, loopID);
+  latch->setMetadata(LLVMContext::MD_loop, loopID);
+
+  auto header = blocks.front();
+  session.hintedLoops.push_back({header->getParent()->getName().str() + ", loop at %" + header->getName().str(),
+                                 hints, blocks.vec()});
+}
+
+// Which hint a loop pass remark answers: "vectorize" for the vectorize width
+// and interleave count, "unroll" or "distribute".
+static std::string remarkHint(StringRef pass, StringRef message) {
+  if (pass == "loop-vectorize" || message.startswith("loop not vectorized") ||
+      message.startswith("loop not interleaved")) {
+    return "vectorize";
+  }
+  if (pass == "loop-unroll" || message.startswith("loop not unrolled")) {
+    return "unroll";
+  }
+  if (pass == "loop-distribute" || message.startswith("loop not distributed")) {
+    return "distribute";
+  }
+  return "";
 }
 
-void emitStoreGlobalVar(Value *value, std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  emitAssign(globalVar, value);
+// Collects what the loop passes say about the hinted loops.
+struct LoopRemarkHandler : public DiagnosticHandler {
+  struct Remark {
+    std::string hint;
+    bool applied;
+    std::string message;
+  };
+  // The blocks of each hinted loop in the module being optimized, and the
+  // remarks made about it. A block the passes delete drops out.
+  std::vector<std::vector<WeakVH>> loopBlocks;
+  std::vector<std::vector<Remark>> loopRemarks;
+
+  static bool isLoopPass(StringRef pass) {
+    return pass == "loop-vectorize" || pass == "loop-unroll" || pass == "loop-distribute" ||
+           pass == "transform-warning";
+  }
+  bool isAnalysisRemarkEnabled(StringRef pass) const override { return false; }
+  bool isMissedOptRemarkEnabled(StringRef pass) const override { return isLoopPass(pass); }
+  bool isPassedOptRemarkEnabled(StringRef pass) const override { return isLoopPass(pass); }
+  bool isAnyRemarkEnabled() const override { return true; }
+
+  bool handleDiagnostics(const DiagnosticInfo &info) override {
+    auto remark = dyn_cast<DiagnosticInfoIROptimization>(&info);
+    if (remark == nullptr) {
+      return false;
+    }
+    // Other passes' remarks are swallowed, as clang does without -Rpass.
+    bool failure = isa<DiagnosticInfoOptimizationFailure>(remark);
+    if (!failure && !isLoopPass(remark->getPassName())) {
+      return true;
+    }
+    if (!remark->isPassed() && !remark->isMissed() && !failure) {
+      return true;
+    }
+    // Loop remarks are made about the loop header.
+    auto region = remark->getCodeRegion();
+    std::string message = remark->getMsg();
+    for (size_t i = 0; i < loopBlocks.size(); ++i) {
+      for (auto &block : loopBlocks[i]) {
+        if (region != nullptr && block == region) {
+          loopRemarks[i].push_back({remarkHint(remark->getPassName(), message), remark->isPassed(), message});
+          return true;
+        }
+      }
+    }
+    return true;
+  }
+};
+
+// The hints a loop asked for that a loop pass could act on, each with the
+// hint its remarks answer.
+static std::vector<std::pair<std::string, std::string>> describeHints(const LoopHints &hints) {
+  std::vector<std::pair<std::string, std::string>> described;
+  if (hints.vectorizeWidth > 0) {
+    described.push_back({"vectorize width " + std::to_string(hints.vectorizeWidth), "vectorize"});
+  }
+  if (hints.interleaveCount > 0) {
+    described.push_back({"interleave count " + std::to_string(hints.interleaveCount), "vectorize"});
+  }
+  if (hints.unrollFull) {
+    described.push_back({"unroll full", "unroll"});
+  } else if (hints.unrollCount > 0) {
+    described.push_back({"unroll count " + std::to_string(hints.unrollCount), "unroll"});
+  }
+  if (hints.distribute) {
+    described.push_back({"distribute", "distribute"});
+  }
+  return described;
 }
 
-Value* emitAllocaLocalVariable(Type *type, std::string name) {
-  return Builder->CreateAlloca(type, nullptr, name);
+// Optimize a copy of the module the way clang -O2 would and report, for each
+// hint of each hinted loop, whether the loop passes applied it.
+void reportLoopTransforms(EmitSession &session) {
+  ValueToValueMapTy vmap;
+  auto module = CloneModule(*session.TheModule, vmap);
+  auto handler = std::make_unique<LoopRemarkHandler>();
+  for (auto &loop : session.hintedLoops) {
+    std::vector<WeakVH> blocks;
+    for (auto block : loop.blocks) {
+      blocks.push_back(WeakVH(vmap[block]));
+    }
+    handler->loopBlocks.push_back(blocks);
+    handler->loopRemarks.emplace_back();
+  }
+  auto remarks = handler.get();
+  auto previous = session.TheContext->getDiagnosticHandler();
+  session.TheContext->setDiagnosticHandler(std::move(handler));
+
+  LoopAnalysisManager loopAnalysis;
+  FunctionAnalysisManager functionAnalysis;
+  CGSCCAnalysisManager cgsccAnalysis;
+  ModuleAnalysisManager moduleAnalysis;
+  PassBuilder builder;
+  builder.registerModuleAnalyses(moduleAnalysis);
+  builder.registerCGSCCAnalyses(cgsccAnalysis);
+  builder.registerFunctionAnalyses(functionAnalysis);
+  builder.registerLoopAnalyses(loopAnalysis);
+  builder.crossRegisterProxies(loopAnalysis, functionAnalysis, cgsccAnalysis, moduleAnalysis);
+  builder.buildPerModuleDefaultPipeline(OptimizationLevel::O2).run(*module, moduleAnalysis);
+
+  for (size_t i = 0; i < session.hintedLoops.size(); ++i) {
+    auto &loop = session.hintedLoops[i];
+    for (auto &hint : describeHints(loop.hints)) {
+      // A missed remark stands unless a later pass applied the hint after all.
+      const LoopRemarkHandler::Remark *answer = nullptr;
+      for (auto &remark : remarks->loopRemarks[i]) {
+        if (remark.hint == hint.second && (answer == nullptr || remark.applied)) {
+          answer = &remark;
+        }
+      }
+      errs() << "loop report: " << loop.name << ": " << hint.first << ": ";
+      if (answer == nullptr) {
+        errs() << "no remark, the loop was folded or deleted before the loop passes ran\n";
+      } else {
+        errs() << (answer->applied ? "applied: " : "missed: ") << answer->message << "\n";
+      }
+    }
+  }
+  session.TheContext->setDiagnosticHandler(std::move(previous));
 }
 
-Value* genIncrement(Value *left, int step) {
+Value* genIncrement(EmitSession &session, LoopVar &var, int step) {
   // Temporary variables/Registers
-  Type *type = left->getType()->getNonOpaquePointerElementType();
-  Value *valueL = Builder->CreateLoad(type, left);
-  Value *valueR = Builder->getInt32(step);
-  Value *value = value = Builder->CreateNSWAdd(valueL, valueR);
+  Value *valueL = emitLoadLoopVar(session, var);
+  Value *valueR = session.Builder->getInt32(step);
+  Value *value = value = session.Builder->CreateNSWAdd(valueL, valueR);
   return value;
 }
 
-Value* emitMainFunctionStatementList(Function *fn) {
-  BasicBlock *conditionBB = createBB(fn, "condition");
-  BasicBlock *bodyBB = createBB(fn, "body");
-  BasicBlock *endBB = createBB(fn, "end");
+Value* emitMainFunctionStatementList(EmitSession &session, Function *fn) {
+  BasicBlock *conditionBB = createBB(session, fn, "condition");
+  BasicBlock *bodyBB = createBB(session, fn, "body");
+  BasicBlock *endBB = createBB(session, fn, "end");
 
   // int index;
-  Value *indexAddr = Builder->CreateAlloca(Builder->getInt32Ty(), nullptr, "index");
+  LoopVar index = emitLoopVar(session, session.Builder->getInt32Ty(), "index");
 
   // index = start;
-  auto startV = emitLoadGlobalVar("start");
-  Builder->CreateStore(startV, indexAddr);
+  auto startV = emitLoadGlobalVar(session, "start");
+  emitStoreLoopVar(session, index, startV);
 
   // goto for condition
-  Builder->CreateBr(conditionBB);
+  session.Builder->CreateBr(conditionBB);
   
   // condition bb 
-  Builder->SetInsertPoint(conditionBB);
+  session.Builder->SetInsertPoint(conditionBB);
   // index <= start;
-  auto indexV = emitLoadValue(indexAddr);
-  auto endV = emitLoadGlobalVar("end");
-  auto compare = Builder->CreateICmpSLE(indexV, endV);
-  Builder->CreateCondBr(compare, bodyBB, endBB);
+  auto indexV = emitLoadLoopVar(session, index);
+  auto endV = emitLoadGlobalVar(session, "end");
+  auto compare = session.Builder->CreateICmpSLE(indexV, endV);
+  session.Builder->CreateCondBr(compare, bodyBB, endBB);
 
   // body bb
-  Builder->SetInsertPoint(bodyBB);
+  session.Builder->SetInsertPoint(bodyBB);
   // result = result + index;
-  auto resultV = emitLoadGlobalVar("result");
-  indexV = emitLoadValue(indexAddr);
-  auto sum = Builder->CreateNSWAdd(resultV, indexV);
-  emitStoreGlobalVar(sum, "result");
+  auto resultV = emitLoadGlobalVar(session, "result");
+  indexV = emitLoadLoopVar(session, index);
+  auto sum = session.Builder->CreateNSWAdd(resultV, indexV);
+  emitStoreGlobalVar(session, sum, "result");
   // index = index + 1
-  Value *incVal = genIncrement(indexAddr, 1);
-  Builder->CreateStore(incVal, indexAddr);
-  Builder->CreateBr(conditionBB);
+  Value *incVal = genIncrement(session, index, 1);
+  emitStoreLoopVar(session, index, incVal);
+  auto latch = session.Builder->CreateBr(conditionBB);
+  emitLoopHints(session, latch, {conditionBB, bodyBB}, loopHintsFromOptions());
+  emitLoopVarEnd(session, index);
 
   // end
-  Builder->SetInsertPoint(endBB);
-  auto value = emitLoadGlobalVar("result");
+  session.Builder->SetInsertPoint(endBB);
+  auto value = emitLoadGlobalVar(session, "result");
   // return result;
   return value;
 }
 
-void emitProgram() {
-  emitIntegers();
+void emitProgram(EmitSession &session) {
+  emitIntegers(session);
 
-  declareFunction("main");
-  defineFunction("main");
+  declareFunction(session, "main");
+  defineFunction(session, "main");
 }
 
 int main(int argc, char *argv[]) {
-  initializeModule();
+  cl::ParseCommandLineOptions(argc, argv);
+
+  EmitSession session;
+  initializeModule(session);
 
   auto targetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(targetTriple);
+  session.TheModule->setTargetTriple(targetTriple);
+
+  registerFunctionProto(session);
 
-  registerFunctionProto();
+  emitProgram(session);
 
-  emitProgram();
+  session.TheModule->print(llvm::outs(), nullptr);
 
-  TheModule->print(llvm::outs(), nullptr);
+  if (LoopReport) {
+    reportLoopTransforms(session);
+  }
 
-  saveModuleIRToFile("./out.ll");
+  saveModuleIRToFile(session, "./out.ll");
   return 0;
 }
@@ -7,282 +7,316 @@
 #include <map>
 #include <string>
 
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
-
-static void initializeModule() {
-  // Open a new context and moduel
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("ir_builder", *TheContext);
-  // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
-}
-
-static void saveModuleIRToFile(const std::string& filename) {
-  std::error_code errorCode;
-  llvm::raw_fd_ostream out(filename, errorCode);
-  TheModule->print(out, nullptr);
-}
-
 typedef struct FunProto {
   llvm::Type *returnType;
   std::vector<llvm::Type *> params;
   bool isVarArg;
 } FunProto;
 
-static std::map<std::string, FunProto> funProtoMap;
+struct EmitSession;
 
 // emit function statement list
-typedef llvm::Value* (*EmitStatementList)(llvm::Function *);
-static std::map<std::string, EmitStatementList> funImplMap;
+typedef llvm::Value* (*EmitStatementList)(EmitSession &, llvm::Function *);
+
+// Named aggregates the program uses. Each one's ID indexes TypeRegistry.
+enum NamedType {
+  PointType,
+  UnionABType,
+};
+
+// The named struct types of one session. Each is created the first time it is
+// defined and handed out by ID after that, so lookups index a vector instead
+// of hashing the name, and no struct.point.0 duplicates appear.
+class TypeRegistry {
+public:
+  llvm::StructType *define(NamedType id, llvm::LLVMContext &context, llvm::StringRef name,
+                           llvm::ArrayRef<llvm::Type *> body) {
+    if (types.size() <= id) {
+      types.resize(id + 1, nullptr);
+    }
+    if (types[id] == nullptr) {
+      types[id] = llvm::StructType::create(context, body, name);
+    }
+    return types[id];
+  }
+
+  // nullptr until the type has been defined.
+  llvm::StructType *get(NamedType id) const {
+    return id < types.size() ? types[id] : nullptr;
+  }
+
+private:
+  std::vector<llvm::StructType *> types;
+};
+
+// Everything one emission writes into. Sessions share no state, so each
+// thread can build its own module alongside the others.
+struct EmitSession {
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  std::unique_ptr<llvm::IRBuilder<>> Builder;
+  TypeRegistry typeRegistry;
+  std::map<std::string, FunProto> funProtoMap;
+  std::map<std::string, EmitStatementList> funImplMap;
+};
+
+static void initializeModule(EmitSession &session) {
+  // Open a new context and moduel
+  session.TheContext = std::make_unique<llvm::LLVMContext>();
+  session.TheModule = std::make_unique<llvm::Module>("ir_builder", *session.TheContext);
+  // Create a new builder for the module.
+  session.Builder = std::make_unique<llvm::IRBuilder<>>(*session.TheContext);
+}
+
+static void saveModuleIRToFile(EmitSession &session, const std::string& filename) {
+  std::error_code errorCode;
+  llvm::raw_fd_ostream out(filename, errorCode);
+  session.TheModule->print(out, nullptr);
+}
 
-llvm::Value *getStructElementAddr(int index, llvm::Value *ptrval);
+llvm::Value *getStructElementAddr(EmitSession &session, int index, llvm::Value *ptrval);
 
-llvm::Type* emitPointType() {
-  auto element_ty = Builder->getInt32Ty();
-  auto point_ty = llvm::StructType::create(*TheContext, "struct.point");
-  point_ty->setBody({ element_ty, element_ty });
-  return point_ty;
+llvm::StructType* emitPointType(EmitSession &session) {
+  auto element_ty = session.Builder->getInt32Ty();
+  return session.typeRegistry.define(PointType, *session.TheContext, "struct.point", { element_ty, element_ty });
 }
 
-void registerFunctionProto() {
+void registerFunctionProto(EmitSession &session) {
   // int main(int)
-  funProtoMap["main"] = {
-    Builder->getInt32Ty(),
+  session.funProtoMap["main"] = {
+    session.Builder->getInt32Ty(),
     {},
     false,
   };
 
   // int sum(int, int)
-  funProtoMap["sum"] = {
-    Builder->getInt32Ty(),
-    { Builder->getInt32Ty(), Builder->getInt32Ty() },
+  session.funProtoMap["sum"] = {
+    session.Builder->getInt32Ty(),
+    { session.Builder->getInt32Ty(), session.Builder->getInt32Ty() },
     false,
   };
 
   // int printf(const char *format, ...)
-  funProtoMap["printf"] = {
-    Builder->getInt32Ty(),
-    { Builder->getInt8Ty()->getPointerTo() },
+  session.funProtoMap["printf"] = {
+    session.Builder->getInt32Ty(),
+    { session.Builder->getInt8Ty()->getPointerTo() },
     true,
   };
 
-  auto i32PtrTy = Builder->getInt32Ty()->getPointerTo();
+  auto i32PtrTy = session.Builder->getInt32Ty()->getPointerTo();
   // void swap_ptr(int *, int *)
-  funProtoMap["swap_ptr"] = {
-    Builder->getVoidTy(),
+  session.funProtoMap["swap_ptr"] = {
+    session.Builder->getVoidTy(),
     { i32PtrTy, i32PtrTy },
     false,
   };
 
-  auto i32Ty = Builder->getInt32Ty();
+  auto i32Ty = session.Builder->getInt32Ty();
   // void swap_arr(int[], int, int)
-  funProtoMap["swap_array"] = {
-    Builder->getVoidTy(),
+  session.funProtoMap["swap_array"] = {
+    session.Builder->getVoidTy(),
     { i32PtrTy, i32Ty, i32Ty },
     false,
   };
 
-  auto pointTy = emitPointType();
+  auto pointTy = emitPointType(session);
   // void swap_struct(struct point *)
-  funProtoMap["swap_struct"] = {
-    Builder->getVoidTy(),
+  session.funProtoMap["swap_struct"] = {
+    session.Builder->getVoidTy(),
     { pointTy->getPointerTo() },
     false,
   };   
 }
 
-llvm::Value* emitMainStatementList(llvm::Function *);
-llvm::Value* emitSumStatementList(llvm::Function *);
-llvm::Value* emitSwapPtrStatementList(llvm::Function *);
-llvm::Value* emitSwapArrayStatementList(llvm::Function *);
-llvm::Value* emitSwapPointStatementList(llvm::Function *);
+llvm::Value* emitMainStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitSumStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitSwapPtrStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitSwapArrayStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitSwapPointStatementList(EmitSession &, llvm::Function *);
 
-void registerFunctionImpl() {
-  funImplMap["main"] = emitMainStatementList;
-  funImplMap["sum"] = emitSumStatementList;
-  funImplMap["swap_ptr"] = emitSwapPtrStatementList;
-  funImplMap["swap_array"] = emitSwapArrayStatementList;
-  funImplMap["swap_struct"] = emitSwapPointStatementList;
+void registerFunctionImpl(EmitSession &session) {
+  session.funImplMap["main"] = emitMainStatementList;
+  session.funImplMap["sum"] = emitSumStatementList;
+  session.funImplMap["swap_ptr"] = emitSwapPtrStatementList;
+  session.funImplMap["swap_array"] = emitSwapArrayStatementList;
+  session.funImplMap["swap_struct"] = emitSwapPointStatementList;
 }
 
-llvm::Function *declareFunction(std::string name) {
-  auto* func = TheModule->getFunction(name);
+llvm::Function *declareFunction(EmitSession &session, std::string name) {
+  auto* func = session.TheModule->getFunction(name);
   if (func == nullptr) {
-    FunProto funProto = funProtoMap[name];
+    FunProto funProto = session.funProtoMap[name];
     auto* funcType = llvm::FunctionType::get(funProto.returnType, funProto.params, funProto.isVarArg);
-    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, TheModule.get());
+    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, session.TheModule.get());
     func->setDSOLocal(true);
   }
   return func;
 }
 
-void emitReturn(llvm::Type *ty, llvm::Value *value) {
+void emitReturn(EmitSession &session, llvm::Type *ty, llvm::Value *value) {
   if (ty->isVoidTy()) {
-    Builder->CreateRetVoid();
+    session.Builder->CreateRetVoid();
   } else {
-    Builder->CreateRet(value);
+    session.Builder->CreateRet(value);
   }
 }
 
-llvm::BasicBlock* createBB(llvm::Function *fn, std::string name) {
-  return llvm::BasicBlock::Create(*TheContext, name, fn);
+llvm::BasicBlock* createBB(EmitSession &session, llvm::Function *fn, std::string name) {
+  return llvm::BasicBlock::Create(*session.TheContext, name, fn);
 }
 
-void emitFunctionBody(llvm::Function *fn, std::string name) {
+void emitFunctionBody(EmitSession &session, llvm::Function *fn, std::string name) {
   // Create entry basic block
-  auto *entry = createBB(fn, "entry");
-  Builder->SetInsertPoint(entry);
+  auto *entry = createBB(session, fn, "entry");
+  session.Builder->SetInsertPoint(entry);
 
-  auto emitter = funImplMap[name];
-  auto value = emitter(fn);
+  auto emitter = session.funImplMap[name];
+  auto value = emitter(session, fn);
 
   // emit return
-  emitReturn(fn->getReturnType(), value);
+  emitReturn(session, fn->getReturnType(), value);
 }
 
-void defineFunction(std::string name) {
+void defineFunction(EmitSession &session, std::string name) {
   // Function must be declated before define
-  auto* fn = TheModule->getFunction(name);
-  emitFunctionBody(fn, name);
+  auto* fn = session.TheModule->getFunction(name);
+  emitFunctionBody(session, fn, name);
   verifyFunction(*fn);
 }
 
-llvm::GlobalVariable* defineGlobalVariable(llvm::Type *type, std::string name, llvm::Constant *init) {
-  TheModule->getOrInsertGlobal(name, type);
-  auto *globalVar = TheModule->getNamedGlobal(name);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, llvm::Type *type, std::string name, llvm::Constant *init) {
+  session.TheModule->getOrInsertGlobal(name, type);
+  auto *globalVar = session.TheModule->getNamedGlobal(name);
   globalVar->setInitializer(init);
   globalVar->setDSOLocal(true);
   return globalVar;
 }
 
-llvm::GlobalVariable* defineGlobalVariable(std::string name, llvm::Constant *init) {
-  return defineGlobalVariable(init->getType(), name, init);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, std::string name, llvm::Constant *init) {
+  return defineGlobalVariable(session, init->getType(), name, init);
 }
 
-llvm::Value* emitLoadValue(llvm::GlobalVariable *value) {
-  return Builder->CreateLoad(value->getInitializer()->getType(), value);
+llvm::Value* emitLoadValue(EmitSession &session, llvm::GlobalVariable *value) {
+  return session.Builder->CreateLoad(value->getInitializer()->getType(), value);
 }
 
-llvm::Value* emitLoadValue(llvm::Value *value) {
+llvm::Value* emitLoadValue(EmitSession &session, llvm::Value *value) {
   auto baseType = value->getType()->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, value);
+  return session.Builder->CreateLoad(baseType, value);
 }
 
-llvm::Value* emitLoadGlobalVar(std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  auto rValue = emitLoadValue(globalVar);
+llvm::Value* emitLoadGlobalVar(EmitSession &session, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  auto rValue = emitLoadValue(session, globalVar);
   return rValue;
 }
 
-void emitAssign(llvm::Value *left, llvm::Value *right) {
-  Builder->CreateStore(right, left);
+void emitAssign(EmitSession &session, llvm::Value *left, llvm::Value *right) {
+  session.Builder->CreateStore(right, left);
 }
 
-void emitStoreGlobalVar(llvm::Value *value, std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  emitAssign(globalVar, value);
+void emitStoreGlobalVar(EmitSession &session, llvm::Value *value, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  emitAssign(session, globalVar, value);
 }
 
-llvm::Value* emitStackLocalVariable(llvm::Type *type, std::string name) {
-  return Builder->CreateAlloca(type, nullptr, name);
+llvm::Value* emitStackLocalVariable(EmitSession &session, llvm::Type *type, std::string name) {
+  return session.Builder->CreateAlloca(type, nullptr, name);
 }
 
-void emitConstant(llvm::Type *ty, std::string name, llvm::Constant *init) {
+void emitConstant(EmitSession &session, llvm::Type *ty, std::string name, llvm::Constant *init) {
   // private constant format: @__constant.function_name.variable_name
-  auto currentFunction = Builder->GetInsertBlock()->getParent();
+  auto currentFunction = session.Builder->GetInsertBlock()->getParent();
   std::string funcName = currentFunction->getName().data();
   std::string constVarName = "__constant." + funcName + "."+ name;
 
-  auto constantVar = defineGlobalVariable(ty, constVarName, init);
+  auto constantVar = defineGlobalVariable(session, ty, constVarName, init);
 
   constantVar->setConstant(true);
   constantVar->setLinkage(llvm::GlobalValue::LinkageTypes::PrivateLinkage);
 }
 
-llvm::Constant* emitStringPtr(std::string content, std::string name) {
-  auto strPtr = Builder->CreateGlobalString(content, "." + name);
+llvm::Constant* emitStringPtr(EmitSession &session, std::string content, std::string name) {
+  auto strPtr = session.Builder->CreateGlobalString(content, "." + name);
   return strPtr;
 }
 
-void emitIntegers() {
+void emitIntegers(EmitSession &session) {
   // int start = 1;
-  defineGlobalVariable("start", Builder->getInt32(1));
+  defineGlobalVariable(session, "start", session.Builder->getInt32(1));
   // int end = 10;
-  defineGlobalVariable("end", Builder->getInt32(10));
+  defineGlobalVariable(session, "end", session.Builder->getInt32(10));
   // int result = 0;
-  defineGlobalVariable("result", Builder->getInt32(0));
+  defineGlobalVariable(session, "result", session.Builder->getInt32(0));
 }
 
-void emitFloats() {
+void emitFloats(EmitSession &session) {
   // float f = 1.0;
-  defineGlobalVariable(Builder->getFloatTy(), "f", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, session.Builder->getFloatTy(), "f", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // double d = 2.0
-  defineGlobalVariable(Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(Builder->getDoubleTy(), 2.0));
+  defineGlobalVariable(session, session.Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(session.Builder->getDoubleTy(), 2.0));
   
   //long double ld = 3.0;
-  auto ldType = llvm::Type::getX86_FP80Ty(*TheContext);
-  defineGlobalVariable(ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
+  auto ldType = llvm::Type::getX86_FP80Ty(*session.TheContext);
+  defineGlobalVariable(session, ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
 
   // float f_1 = 1.0;
-  defineGlobalVariable("f_1", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, "f_1", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // float f_2 = 2.0
-  defineGlobalVariable("f_2", llvm::ConstantFP::get(Builder->getFloatTy(), 2.0));
+  defineGlobalVariable(session, "f_2", llvm::ConstantFP::get(session.Builder->getFloatTy(), 2.0));
 }
 
 // int arr[] = { 1, 2, 3, 4 };
-void emitArray() {
+void emitArray(EmitSession &session) {
   // int arr[4];
   int num = 4;
-  llvm::Type *ty = Builder->getInt32Ty();
+  llvm::Type *ty = session.Builder->getInt32Ty();
   llvm::ArrayType *arrType = llvm::ArrayType::get(ty, num);
 
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
-  list.push_back(Builder->getInt32(2));
-  list.push_back(Builder->getInt32(3));
-  list.push_back(Builder->getInt32(4));
+  list.push_back(session.Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(2));
+  list.push_back(session.Builder->getInt32(3));
+  list.push_back(session.Builder->getInt32(4));
 
   llvm::Constant *c = llvm::ConstantArray::get(arrType, list);
 
-  defineGlobalVariable(arrType, "arr", c);
+  defineGlobalVariable(session, arrType, "arr", c);
 }
 
 /**
  * struct point { int x; int y; };
  * struct point point = { 1, 2 };
  */
-void emitStruct() {
+void emitStruct(EmitSession &session) {
   // struct point { int x; int y; }
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "struct.point");
-  structTy->setBody({Builder->getInt32Ty(), Builder->getInt32Ty()});
+  llvm::StructType *structTy = emitPointType(session);
 
   // struct point  = { 11, 12 }
   int num = 2;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(11));
-  list.push_back(Builder->getInt32(12));
+  list.push_back(session.Builder->getInt32(11));
+  list.push_back(session.Builder->getInt32(12));
   
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
 
-  defineGlobalVariable(structTy, "pointer", c);
+  defineGlobalVariable(session, structTy, "pointer", c);
 }
 
-llvm::Value* emitPoint() {
-  auto *point_ty = llvm::StructType::getTypeByName(*TheContext, "struct.point");  
+llvm::Value* emitPoint(EmitSession &session) {
+  auto *point_ty = session.typeRegistry.get(PointType);
   // struct point p;
-  auto tmp_p = Builder->CreateAlloca(point_ty, nullptr, "param_p");
+  auto tmp_p = session.Builder->CreateAlloca(point_ty, nullptr, "param_p");
   // p.x = 10;
-  auto p_x = getStructElementAddr(0, tmp_p);
-  Builder->CreateStore(Builder->getInt32(10), p_x);
+  auto p_x = getStructElementAddr(session, 0, tmp_p);
+  session.Builder->CreateStore(session.Builder->getInt32(10), p_x);
   // p.y = 20;
-  auto p_y = getStructElementAddr(1, tmp_p);
-  Builder->CreateStore(Builder->getInt32(20), p_y);
+  auto p_y = getStructElementAddr(session, 1, tmp_p);
+  session.Builder->CreateStore(session.Builder->getInt32(20), p_y);
   return tmp_p;
 }
 
@@ -290,313 +324,314 @@ llvm::Value* emitPoint() {
  * union ab  {  int a;  float b; };
  * union ab u = { 1 };
  */
-void emitUnion() {
+void emitUnion(EmitSession &session) {
   // union ab  {  int a;  float b; };
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "union.ab");
-  structTy->setBody(Builder->getInt32Ty());
+  llvm::StructType *structTy = session.typeRegistry.define(UnionABType, *session.TheContext, "union.ab",
+                                                           { session.Builder->getInt32Ty() });
 
   // union ab u = { 1 };
   int num = 1;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(1));
 
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
-  defineGlobalVariable(structTy, "u", c);
+  defineGlobalVariable(session, structTy, "u", c);
 }
 
-void emitPointer() {
+void emitPointer(EmitSession &session) {
   // int *i_p;
-  auto pointerTy = llvm::PointerType::get(Builder->getInt32Ty(), 0);
+  auto pointerTy = llvm::PointerType::get(session.Builder->getInt32Ty(), 0);
   auto c = llvm::Constant::getNullValue(pointerTy);
-  defineGlobalVariable(pointerTy, "i_p", c);
+  defineGlobalVariable(session, pointerTy, "i_p", c);
 
   // char *c_p;
-  auto charPtrTy = llvm::PointerType::get(Builder->getInt8Ty(), 0);
+  auto charPtrTy = llvm::PointerType::get(session.Builder->getInt8Ty(), 0);
   auto cCharPtr = llvm::Constant::getNullValue(charPtrTy);
-  defineGlobalVariable(charPtrTy, "c_p", cCharPtr);
+  defineGlobalVariable(session, charPtrTy, "c_p", cCharPtr);
 }
 
 // char *str = "hello\n";
-void emitConstString() {
-  emitStringPtr("hello", "str");
+void emitConstString(EmitSession &session) {
+  emitStringPtr(session, "hello", "str");
 }
 
-llvm::Value* genIncrement(llvm::Value *left, int step) {
+llvm::Value* genIncrement(EmitSession &session, llvm::Value *left, int step) {
   // Temporary variables/Registers
   auto type = left->getType()->getNonOpaquePointerElementType();
-  auto valueL = Builder->CreateLoad(type, left);
-  auto valueR = Builder->getInt32(step);
-  auto value = Builder->CreateNSWAdd(valueL, valueR);
+  auto valueL = session.Builder->CreateLoad(type, left);
+  auto valueR = session.Builder->getInt32(step);
+  auto value = session.Builder->CreateNSWAdd(valueL, valueR);
   return value;
 }
 
-llvm::Value *getRValue(llvm::Value *value, llvm::Type *type) {
-  auto address = Builder->CreateLoad(type, value);
+llvm::Value *getRValue(EmitSession &session, llvm::Value *value, llvm::Type *type) {
+  auto address = session.Builder->CreateLoad(type, value);
   auto baseType = type->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, address);
+  return session.Builder->CreateLoad(baseType, address);
 }
 
-llvm::Value *getElementAddr(llvm::Value *arrAddr, llvm::Value *indexAddr) {
+llvm::Value *getElementAddr(EmitSession &session, llvm::Value *arrAddr, llvm::Value *indexAddr) {
   auto ty = arrAddr->getType()->getNonOpaquePointerElementType();
   auto *baseType = ty->getNonOpaquePointerElementType();
-  auto arr = Builder->CreateLoad(ty, arrAddr);
+  auto arr = session.Builder->CreateLoad(ty, arrAddr);
 
   auto indexType = indexAddr->getType()->getNonOpaquePointerElementType();
-  auto indexValue = Builder->CreateLoad(indexType, indexAddr);
-  auto indexTy64Value = Builder->CreateSExt(indexValue, Builder->getInt64Ty());
+  auto indexValue = session.Builder->CreateLoad(indexType, indexAddr);
+  auto indexTy64Value = session.Builder->CreateSExt(indexValue, session.Builder->getInt64Ty());
 
   std::vector<llvm::Value *> IndexValues;
   IndexValues.push_back(indexTy64Value);
-  llvm::Value *target = Builder->CreateInBoundsGEP(arr->getType()->getNonOpaquePointerElementType(), arr, IndexValues);
+  llvm::Value *target = session.Builder->CreateInBoundsGEP(arr->getType()->getNonOpaquePointerElementType(), arr, IndexValues);
 
   return target;
 }
 
 /// Return the value offset.
-static llvm::Constant *getStructOffset(long offset) {
-  return llvm::ConstantInt::get(Builder->getInt32Ty(), offset);
+static llvm::Constant *getStructOffset(EmitSession &session, long offset) {
+  return llvm::ConstantInt::get(session.Builder->getInt32Ty(), offset);
 }
 
-llvm::Value *getStructElementAddr(int index, llvm::Value *ptrval) { 
+llvm::Value *getStructElementAddr(EmitSession &session, int index, llvm::Value *ptrval) { 
   std::vector<llvm::Value *> IndexValues;
-  IndexValues.push_back(getStructOffset(0));
-  IndexValues.push_back(getStructOffset(index));
-  llvm::Value *target = Builder->CreateInBoundsGEP(ptrval->getType()->getNonOpaquePointerElementType(), ptrval, IndexValues);
+  IndexValues.push_back(getStructOffset(session, 0));
+  IndexValues.push_back(getStructOffset(session, index));
+  llvm::Value *target = session.Builder->CreateInBoundsGEP(ptrval->getType()->getNonOpaquePointerElementType(), ptrval, IndexValues);
   return target;
 }
 
-llvm::Value *getStructElementRValue(llvm::Value *structAlloca, int index) {
+llvm::Value *getStructElementRValue(EmitSession &session, llvm::Value *structAlloca, int index) {
   auto ty = structAlloca->getType()->getNonOpaquePointerElementType();
-  auto structAddr = Builder->CreateLoad(ty, structAlloca);
-  auto elementAddr = getStructElementAddr(index, structAddr);
+  auto structAddr = session.Builder->CreateLoad(ty, structAlloca);
+  auto elementAddr = getStructElementAddr(session, index, structAddr);
   auto structType = llvm::dyn_cast<llvm::StructType>(structAddr->getType()->getNonOpaquePointerElementType());
   auto elementType = structType->getTypeAtIndex(index);
-  return Builder->CreateLoad(elementType, elementAddr);
+  return session.Builder->CreateLoad(elementType, elementAddr);
 }
 
-llvm::Value *getStructElementLValue(llvm::Value *structAlloca, int index) {
+llvm::Value *getStructElementLValue(EmitSession &session, llvm::Value *structAlloca, int index) {
   auto ty = structAlloca->getType()->getNonOpaquePointerElementType();
-  auto structAddr = Builder->CreateLoad(ty, structAlloca);
-  auto elementAddr = getStructElementAddr(index, structAddr);
+  auto structAddr = session.Builder->CreateLoad(ty, structAlloca);
+  auto elementAddr = getStructElementAddr(session, index, structAddr);
   return elementAddr;
 }
 
-llvm::Type* getPointerType(llvm::Type *baseType) {
+llvm::Type* getPointerType(EmitSession &session, llvm::Type *baseType) {
   return llvm::PointerType::get(baseType, 0);
 }
 
 /// Return the value offset.
-llvm::Constant *getOffset(long offset) {
-  return llvm::ConstantInt::get(Builder->getInt64Ty(), offset);
+llvm::Constant *getOffset(EmitSession &session, long offset) {
+  return llvm::ConstantInt::get(session.Builder->getInt64Ty(), offset);
 }
 
-llvm::Value *gen_get_member_ptr(int index, llvm::Value *ptrval) { 
+llvm::Value *gen_get_member_ptr(EmitSession &session, int index, llvm::Value *ptrval) { 
   std::vector<llvm::Value *> IndexValues;
-  IndexValues.push_back(getOffset(0));
-  IndexValues.push_back(getOffset(index));
-  llvm::Value *target = Builder->CreateInBoundsGEP(ptrval->getType()->getNonOpaquePointerElementType(), ptrval, IndexValues);
+  IndexValues.push_back(getOffset(session, 0));
+  IndexValues.push_back(getOffset(session, index));
+  llvm::Value *target = session.Builder->CreateInBoundsGEP(ptrval->getType()->getNonOpaquePointerElementType(), ptrval, IndexValues);
   return target;
 }
 
-llvm::Value* emitMainStatementList(llvm::Function *fn) {
+llvm::Value* emitMainStatementList(EmitSession &session, llvm::Function *fn) {
   // &point
-  auto pointAddr = emitPoint();
+  auto pointAddr = emitPoint(session);
   std::vector<llvm::Value*> argsV;
   argsV.push_back(pointAddr);
 
   // swap_struct(&point);
-  auto targetFn = TheModule->getFunction("swap_struct");
-  Builder->CreateCall(targetFn, argsV);
+  auto targetFn = session.TheModule->getFunction("swap_struct");
+  session.Builder->CreateCall(targetFn, argsV);
 
   // return point.x;
-  auto pointX = getStructElementAddr(0, pointAddr);
-  auto result = Builder->CreateLoad(fn->getReturnType(), pointX);
+  auto pointX = getStructElementAddr(session, 0, pointAddr);
+  auto result = session.Builder->CreateLoad(fn->getReturnType(), pointX);
   return result;
 }
 
-llvm::Value* emitSumStatementList(llvm::Function *fn) {
+llvm::Value* emitSumStatementList(EmitSession &session, llvm::Function *fn) {
   // alloca params
-  auto ty = Builder->getInt32Ty();
-  auto tmpX = Builder->CreateAlloca(ty);
-  auto tmpY = Builder->CreateAlloca(ty);
+  auto ty = session.Builder->getInt32Ty();
+  auto tmpX = session.Builder->CreateAlloca(ty);
+  auto tmpY = session.Builder->CreateAlloca(ty);
 
   // store params to stack
   auto AI = fn->arg_begin();
   auto argX = AI++;
   auto argY = AI;
-  Builder->CreateStore(argX, tmpX);
-  Builder->CreateStore(argY, tmpY);
+  session.Builder->CreateStore(argX, tmpX);
+  session.Builder->CreateStore(argY, tmpY);
 
   // printf("result:%d\n", result);
-  auto str = emitStringPtr("result:%d\n", "str");
-  auto result = emitLoadGlobalVar("result");
+  auto str = emitStringPtr(session, "result:%d\n", "str");
+  auto result = emitLoadGlobalVar(session, "result");
   
   std::vector<llvm::Value *> indexValues;
-  indexValues.push_back(Builder->getInt64(0));
-  indexValues.push_back(Builder->getInt64(0));
-  auto strAddr = Builder->CreateInBoundsGEP(str->getType()->getNonOpaquePointerElementType(),
+  indexValues.push_back(session.Builder->getInt64(0));
+  indexValues.push_back(session.Builder->getInt64(0));
+  auto strAddr = session.Builder->CreateInBoundsGEP(str->getType()->getNonOpaquePointerElementType(),
     str, 
     indexValues 
   );
   std::vector<llvm::Value *> argsV;
   argsV.push_back(strAddr),
   argsV.push_back(result);
-  auto printfFn = TheModule->getFunction("printf");
-  Builder->CreateCall(printfFn, argsV);
+  auto printfFn = session.TheModule->getFunction("printf");
+  session.Builder->CreateCall(printfFn, argsV);
   // x + y;
-  auto valueL = Builder->CreateLoad(ty, tmpX);
-  auto valueR = Builder->CreateLoad(ty, tmpY);
+  auto valueL = session.Builder->CreateLoad(ty, tmpX);
+  auto valueR = session.Builder->CreateLoad(ty, tmpY);
 
-  auto value = Builder->CreateNSWAdd(valueL, valueR);
+  auto value = session.Builder->CreateNSWAdd(valueL, valueR);
   // return result;
   return value;
 }
 
-llvm::Value *emitSwapPtrStatementList(llvm::Function *fn) {
+llvm::Value *emitSwapPtrStatementList(EmitSession &session, llvm::Function *fn) {
     // alloca params
-  auto baseType = Builder->getInt32Ty();
-  auto ty = getPointerType(baseType);
+  auto baseType = session.Builder->getInt32Ty();
+  auto ty = getPointerType(session, baseType);
   // int *alloca_x, *alloca_y;
-  auto *tmpX = Builder->CreateAlloca(ty, nullptr, "param_x");
-  auto *tmpY = Builder->CreateAlloca(ty, nullptr, "param_y");
+  auto *tmpX = session.Builder->CreateAlloca(ty, nullptr, "param_x");
+  auto *tmpY = session.Builder->CreateAlloca(ty, nullptr, "param_y");
   // int temp
-  auto temp = Builder->CreateAlloca(baseType, nullptr, "temp");
+  auto temp = session.Builder->CreateAlloca(baseType, nullptr, "temp");
 
   // store args on stack
   auto AI = fn->arg_begin();
   auto argX = AI++;
   auto argY = AI;
-  Builder->CreateStore(argX, tmpX);
-  Builder->CreateStore(argY, tmpY);
+  session.Builder->CreateStore(argX, tmpX);
+  session.Builder->CreateStore(argY, tmpY);
 
   // get r-value of *x;
-  auto xValue = getRValue(tmpX, ty);
+  auto xValue = getRValue(session, tmpX, ty);
   // temp = *x;
-  Builder->CreateStore(xValue, temp);
+  session.Builder->CreateStore(xValue, temp);
 
   // get r-value of *y
-  auto yValue = getRValue(tmpY, ty);
+  auto yValue = getRValue(session, tmpY, ty);
   // get l-value of *x
-  auto xAddress = Builder->CreateLoad(ty, tmpX);
+  auto xAddress = session.Builder->CreateLoad(ty, tmpX);
   // *x = *y
-  Builder->CreateStore(yValue, xAddress);
+  session.Builder->CreateStore(yValue, xAddress);
 
   // *y = temp
-  auto tempValue = Builder->CreateLoad(baseType, temp);
-  auto yAddress = Builder->CreateLoad(ty, tmpY);
-  Builder->CreateStore(tempValue, yAddress);
+  auto tempValue = session.Builder->CreateLoad(baseType, temp);
+  auto yAddress = session.Builder->CreateLoad(ty, tmpY);
+  session.Builder->CreateStore(tempValue, yAddress);
 
   return nullptr;
 }
-llvm::Value *emitSwapArrayStatementList(llvm::Function *fn) {
+llvm::Value *emitSwapArrayStatementList(EmitSession &session, llvm::Function *fn) {
     // alloca params
-  auto baseType = Builder->getInt32Ty();
-  auto ty = getPointerType(baseType);
+  auto baseType = session.Builder->getInt32Ty();
+  auto ty = getPointerType(session, baseType);
   // int *alloca_x, *alloca_y;
-  auto tmpArr = Builder->CreateAlloca(ty, nullptr, "param_arr");
-  auto tmpX = Builder->CreateAlloca(baseType, nullptr, "param_x");
-  auto tmpY = Builder->CreateAlloca(baseType, nullptr, "param_y");
+  auto tmpArr = session.Builder->CreateAlloca(ty, nullptr, "param_arr");
+  auto tmpX = session.Builder->CreateAlloca(baseType, nullptr, "param_x");
+  auto tmpY = session.Builder->CreateAlloca(baseType, nullptr, "param_y");
   // int temp
-  auto temp = Builder->CreateAlloca(baseType, nullptr, "temp");
+  auto temp = session.Builder->CreateAlloca(baseType, nullptr, "temp");
 
   // store args on stack
   auto AI = fn->arg_begin();
   auto argArr = AI++;
   auto argX = AI++;
   auto argY = AI;
-  Builder->CreateStore(argArr, tmpArr);
-  Builder->CreateStore(argY, tmpY);
-  Builder->CreateStore(argX, tmpX);
+  session.Builder->CreateStore(argArr, tmpArr);
+  session.Builder->CreateStore(argY, tmpY);
+  session.Builder->CreateStore(argX, tmpX);
   
   // get l-value of arr[x]
-  auto arr_x_addr = getElementAddr(tmpArr, tmpX);
+  auto arr_x_addr = getElementAddr(session, tmpArr, tmpX);
   // get r-value of arr[x]
-  auto arr_x_value = Builder->CreateLoad(baseType, arr_x_addr);
+  auto arr_x_value = session.Builder->CreateLoad(baseType, arr_x_addr);
   // temp = arr[x]
-  Builder->CreateStore(arr_x_value, temp);
+  session.Builder->CreateStore(arr_x_value, temp);
 
   // get r-value of arr[y]
-  auto arr_y_addr = getElementAddr(tmpArr, tmpY);
-  auto arr_y_value = Builder->CreateLoad(baseType, arr_y_addr);
+  auto arr_y_addr = getElementAddr(session, tmpArr, tmpY);
+  auto arr_y_value = session.Builder->CreateLoad(baseType, arr_y_addr);
   // get l-value of arr[x]
-  auto arr_x_addr_1 = getElementAddr(tmpArr, tmpX);
+  auto arr_x_addr_1 = getElementAddr(session, tmpArr, tmpX);
   // arr[x] = arr[y]
-  Builder->CreateStore(arr_y_value, arr_x_addr_1);
+  session.Builder->CreateStore(arr_y_value, arr_x_addr_1);
 
   // arr[y] = temp
-  auto temp_value = Builder->CreateLoad(baseType, temp);
+  auto temp_value = session.Builder->CreateLoad(baseType, temp);
   // get l-value of arr[y]
-  auto arr_y_addr_1 = getElementAddr(tmpArr, tmpY);
-  Builder->CreateStore(temp_value, arr_y_addr_1);
+  auto arr_y_addr_1 = getElementAddr(session, tmpArr, tmpY);
+  session.Builder->CreateStore(temp_value, arr_y_addr_1);
   return nullptr;
 }
 
-llvm::Value* emitSwapPointStatementList(llvm::Function *fn) {
+llvm::Value* emitSwapPointStatementList(EmitSession &session, llvm::Function *fn) {
   // alloca params
-  auto baseType = Builder->getInt32Ty();
-  auto ty = llvm::StructType::getTypeByName(*TheContext, "struct.point");
+  auto baseType = session.Builder->getInt32Ty();
+  auto ty = session.typeRegistry.get(PointType);
 
   // struct *alloca_p;
-  auto *tmpP = Builder->CreateAlloca(getPointerType(ty), nullptr, "param_p");
+  auto *tmpP = session.Builder->CreateAlloca(getPointerType(session, ty), nullptr, "param_p");
   // int temp;
-  auto temp = Builder->CreateAlloca(baseType, nullptr, "temp");
+  auto temp = session.Builder->CreateAlloca(baseType, nullptr, "temp");
 
   // store args on stack
   auto AI = fn->arg_begin();
   auto arg_1 = AI++;
-  Builder->CreateStore(arg_1, tmpP);
+  session.Builder->CreateStore(arg_1, tmpP);
 
   // get r-value of pointer->x
-  auto p_x_rvalue = getStructElementRValue(tmpP, 0);
+  auto p_x_rvalue = getStructElementRValue(session, tmpP, 0);
 
   // temp = p.x
-  Builder->CreateStore(p_x_rvalue, temp);
+  session.Builder->CreateStore(p_x_rvalue, temp);
 
   // get r-value of pointer->y
-  auto p_y_rvalue = getStructElementRValue(tmpP, 1);
+  auto p_y_rvalue = getStructElementRValue(session, tmpP, 1);
 
   // get l-value of pointer->x
-  auto p_x_lvalue = getStructElementLValue(tmpP, 0);
+  auto p_x_lvalue = getStructElementLValue(session, tmpP, 0);
 
   // p->x = p->y
-  Builder->CreateStore(p_y_rvalue, p_x_lvalue);
+  session.Builder->CreateStore(p_y_rvalue, p_x_lvalue);
 
   // get r-value of temp
-  auto temp_rvalue = Builder->CreateLoad(baseType, temp);
+  auto temp_rvalue = session.Builder->CreateLoad(baseType, temp);
 
   // get l-value of p->y
-  auto p_y_lvalue = getStructElementLValue(tmpP, 1);
+  auto p_y_lvalue = getStructElementLValue(session, tmpP, 1);
 
   // temp = p->y
-  Builder->CreateStore(temp_rvalue, p_y_lvalue);
+  session.Builder->CreateStore(temp_rvalue, p_y_lvalue);
 
   return nullptr;
 }
 
-void emitProgram() {
-  declareFunction("printf");
+void emitProgram(EmitSession &session) {
+  declareFunction(session, "printf");
 
-  declareFunction("swap_struct");
-  defineFunction("swap_struct");
+  declareFunction(session, "swap_struct");
+  defineFunction(session, "swap_struct");
 
-  declareFunction("main");
-  defineFunction("main");
+  declareFunction(session, "main");
+  defineFunction(session, "main");
 }
 
 int main(int argc, char *argv[]) {
-  initializeModule();
+  EmitSession session;
+  initializeModule(session);
 
   auto targetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(targetTriple);
+  session.TheModule->setTargetTriple(targetTriple);
 
-  registerFunctionProto();
-  registerFunctionImpl();
+  registerFunctionProto(session);
+  registerFunctionImpl(session);
 
-  emitProgram();
+  emitProgram(session);
 
-  TheModule->print(llvm::outs(), nullptr);
+  session.TheModule->print(llvm::outs(), nullptr);
 
-  saveModuleIRToFile("./out.ll");
+  saveModuleIRToFile(session, "./out.ll");
   return 0;
 }
@@ -0,0 +1,9 @@
+#!/usr/bin/bash
+
+# usage ./bench_array.sh [elements]
+# Defining a global array one Constant per element against one packed buffer.
+elements=${1:-1000000}
+
+clang++ -O2 emit_ir.cpp `llvm-config --cxxflags --ldflags --system-libs --libs core linker bitreader bitwriter orcjit native object passes` -o emit_ir.out
+
+./emit_ir.out --bench-array=${elements}
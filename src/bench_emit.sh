@@ -0,0 +1,18 @@
+#!/usr/bin/bash
+
+# usage ./bench_emit.sh [replicas]
+# Emission time for the serial emitter and for 1 to 64 worker threads.
+replicas=${1:-20000}
+
+clang++ -O2 emit_ir.cpp `llvm-config --cxxflags --ldflags --system-libs --libs core linker bitreader bitwriter orcjit native object passes` -o emit_ir.out
+
+./emit_ir.out --replicate=${replicas} > /dev/null
+mv out.ll serial.ll
+
+for threads in 0 1 2 4 8 16 32 64; do
+  printf "threads=%-3s" ${threads}
+  ./emit_ir.out --replicate=${replicas} --emit-threads=${threads} --time-stages 2>&1 > /dev/null | grep "Emit program"
+  cmp -s serial.ll out.ll || echo "  output differs from the serial run"
+done
+
+rm -f serial.ll
@@ -1,29 +1,153 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/PassTimingInfo.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/Host.h"
-
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/SwapByteOrder.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
 #include <map>
 #include <string>
+#include <vector>
 
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
+// Field order of the structs registerFunctionProto() and friends define.
+enum StructLayoutPolicy { LayoutDeclared, LayoutMinPadding, LayoutHotFirst };
 
-static void initializeModule() {
-  // Open a new context and moduel
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("ir_builder", *TheContext);
-  // Create a new builder for the module.
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
-}
+// How an array of structs is stored: one array of structs, or one array per field.
+enum ArrayLayout { ArrayOfStructs, StructOfArrays };
 
-static void saveModuleIRToFile(const std::string& filename) {
-  std::error_code errorCode;
-  llvm::raw_fd_ostream out(filename, errorCode);
-  TheModule->print(out, nullptr);
-}
+static llvm::cl::opt<unsigned> Threads("emit-threads",
+  llvm::cl::desc("Emit each function on a pool of N threads (0 = serial)"),
+  llvm::cl::init(0));
+
+static llvm::cl::opt<bool> CheckParallel("check-parallel",
+  llvm::cl::desc("Also emit the program serially and fail unless it matches the --emit-threads module"));
+
+static llvm::cl::opt<unsigned> Replicate("replicate",
+  llvm::cl::desc("Add N copies of swap_struct to the program, for benchmarking"),
+  llvm::cl::init(0));
+
+static llvm::cl::opt<bool> EmitBitcode("emit-bc",
+  llvm::cl::desc("Write bitcode to out.bc instead of textual IR to out.ll"));
+
+static llvm::cl::opt<bool> EmitObject("emit-obj",
+  llvm::cl::desc("Compile the module to a native object file, out.o"));
+
+static llvm::cl::opt<bool> EmitAssembly("emit-asm",
+  llvm::cl::desc("Compile the module to native assembly, out.s"));
+
+static llvm::cl::opt<char> OptLevel("O",
+  llvm::cl::desc("Optimize the module before writing it [-O0, -O1, -O2, or -O3] (default = '-O0')"),
+  llvm::cl::Prefix, llvm::cl::init('0'));
+
+static llvm::cl::opt<std::string> InputFilename("input",
+  llvm::cl::desc("Load a previously written bitcode file instead of emitting the program"),
+  llvm::cl::value_desc("filename"));
+
+static llvm::cl::opt<std::string> CacheDir("cache-dir",
+  llvm::cl::desc("Reuse bitcode and native outputs of identical modules from this directory"),
+  llvm::cl::value_desc("directory"));
+
+static llvm::cl::opt<unsigned> CacheSizeMB("cache-size-mb",
+  llvm::cl::desc("Evict the least recently used cache entries beyond this size"),
+  llvm::cl::init(256));
+
+static llvm::cl::opt<bool> CacheStats("cache-stats",
+  llvm::cl::desc("Print the cache's hit and miss counters"));
+
+static llvm::cl::opt<bool> Incremental("incremental",
+  llvm::cl::desc("With --emit-obj and --cache-dir, compile every function on its own into "
+                 "out.a and recompile only the ones that changed"));
+
+static llvm::cl::opt<bool> RunMain("run",
+  llvm::cl::desc("JIT the module in process and return the exit code of main"));
+
+static llvm::cl::opt<unsigned> BenchDeclare("bench-declare",
+  llvm::cl::desc("Time registering and declaring N functions, then exit"),
+  llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned> BenchArray("bench-array",
+  llvm::cl::desc("Time defining an N element global array per element and packed, then exit"),
+  llvm::cl::init(0));
+
+static llvm::cl::opt<bool> PackStrings("pack-strings",
+  llvm::cl::desc("Store the string constants of a module back to back in one global"));
+
+static llvm::cl::opt<StructLayoutPolicy> StructLayout("struct-layout",
+  llvm::cl::desc("How to order the fields of the program's structs"),
+  llvm::cl::values(
+    clEnumValN(LayoutDeclared, "declared", "in the order the source declares them"),
+    clEnumValN(LayoutMinPadding, "min-padding", "by decreasing alignment, which leaves the least padding"),
+    clEnumValN(LayoutHotFirst, "hot-first", "hot fields first, so they share the first cache line, then by alignment")),
+  llvm::cl::init(LayoutDeclared));
+
+static llvm::cl::opt<bool> StructLayoutReport("struct-layout-report",
+  llvm::cl::desc("Print the size, alignment and padding of every struct type"));
+
+static llvm::cl::opt<ArrayLayout> StructArrayLayout("array-layout",
+  llvm::cl::desc("How to store arrays of structs"),
+  llvm::cl::values(
+    clEnumValN(ArrayOfStructs, "aos", "one array of structs"),
+    clEnumValN(StructOfArrays, "soa", "one array per field, @<name>.<field>")),
+  llvm::cl::init(ArrayOfStructs));
+
+static llvm::cl::opt<unsigned> PointArray("point-array",
+  llvm::cl::desc("Add a global struct point points[N] with init_points() and sum_points_x() over it, and return the sum from main"),
+  llvm::cl::init(0));
+
+static llvm::cl::opt<bool> StructByValue("struct-by-value",
+  llvm::cl::desc("Have main call swap_point(), which takes and returns struct point by value"));
+
+static llvm::cl::opt<std::string> TargetTriple("target-triple",
+  llvm::cl::desc("Emit the module for <triple> instead of the host. Only the host can be compiled or run"),
+  llvm::cl::value_desc("triple"));
+
+static llvm::cl::opt<std::string> EmbedFile("embed",
+  llvm::cl::desc("Add the contents of <file> as the constant global array @embedded"),
+  llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<unsigned> EmbedElementBits("embed-element-bits",
+  llvm::cl::desc("Bits per element of @embedded: 8, 16, 32 or 64, stored in the target's byte order"),
+  llvm::cl::init(8));
+
+static llvm::cl::opt<bool> TimeStages("time-stages",
+  llvm::cl::desc("Print the time spent in each stage"));
+
+static llvm::ExitOnError ExitOnErr("emit_ir: ");
 
 typedef struct FunProto {
   llvm::Type *returnType;
@@ -31,572 +155,2421 @@ typedef struct FunProto {
   bool isVarArg;
 } FunProto;
 
-static std::map<std::string, FunProto> funProtoMap;
+// How one source-level parameter or result crosses a call.
+struct ABIArgInfo {
+  enum Kind {
+    // As its own type.
+    Direct,
+    // Loaded as `parts`, one per eightbyte, so it travels in registers.
+    Coerce,
+    // In memory: a byval pointer for a parameter, an sret pointer for the result.
+    Indirect,
+  };
+  Kind kind = Direct;
+  llvm::Type *type = nullptr;
+  std::vector<llvm::Type *> parts;
+  // Index of its first IR argument.
+  unsigned firstArg = 0;
+};
+
+// A FunProto lowered to the C calling convention of the module's target.
+struct FunctionABI {
+  llvm::FunctionType *type = nullptr;
+  ABIArgInfo result;
+  std::vector<ABIArgInfo> params;
+};
+
+// x86-64 SysV register classes of an eightbyte.
+enum ArgClass { ClassNone, ClassInteger, ClassSSE, ClassMemory };
+
+static ArgClass mergeArgClass(ArgClass a, ArgClass b) {
+  if (a == b || b == ClassNone) {
+    return a;
+  }
+  if (a == ClassNone) {
+    return b;
+  }
+  if (a == ClassMemory || b == ClassMemory) {
+    return ClassMemory;
+  }
+  return ClassInteger;
+}
+
+// Merge the class of every scalar in `type`, which starts `offset` bytes into
+// an aggregate of at most 16 bytes, into the class of its eightbyte.
+static void classifyEightbytes(const llvm::DataLayout &dataLayout, llvm::Type *type, uint64_t offset,
+                               ArgClass classes[2], bool hasDouble[2]) {
+  if (auto *structType = llvm::dyn_cast<llvm::StructType>(type)) {
+    auto *layout = dataLayout.getStructLayout(structType);
+    for (unsigned i = 0; i < structType->getNumElements(); ++i) {
+      classifyEightbytes(dataLayout, structType->getElementType(i), offset + layout->getElementOffset(i),
+                         classes, hasDouble);
+    }
+    return;
+  }
+  if (auto *arrayType = llvm::dyn_cast<llvm::ArrayType>(type)) {
+    auto elementSize = dataLayout.getTypeAllocSize(arrayType->getElementType());
+    for (uint64_t i = 0; i < arrayType->getNumElements(); ++i) {
+      classifyEightbytes(dataLayout, arrayType->getElementType(), offset + i * elementSize, classes, hasDouble);
+    }
+    return;
+  }
+
+  ArgClass argClass = ClassMemory;
+  if (type->isIntegerTy() || type->isPointerTy()) {
+    argClass = ClassInteger;
+  } else if (type->isFloatTy() || type->isDoubleTy()) {
+    argClass = ClassSSE;
+  }
+  // Scalars of packed structs may straddle two eightbytes.
+  if (offset % dataLayout.getABITypeAlign(type).value() != 0) {
+    argClass = ClassMemory;
+  }
+  classes[offset / 8] = mergeArgClass(classes[offset / 8], argClass);
+  hasDouble[offset / 8] |= type->isDoubleTy();
+}
+
+// Pass or return `type` the way the x86-64 SysV ABI does: aggregates of up to
+// 16 bytes as one or two register-sized parts, anything else in memory.
+// Other targets get every aggregate in memory, which works between generated
+// functions but is not their C ABI.
+static ABIArgInfo classifyArgument(const llvm::Module &module, llvm::Type *type) {
+  ABIArgInfo info;
+  info.type = type;
+  if (!type->isAggregateType()) {
+    return info;
+  }
+
+  info.kind = ABIArgInfo::Indirect;
+  auto &dataLayout = module.getDataLayout();
+  uint64_t size = dataLayout.getTypeAllocSize(type);
+  if (llvm::Triple(module.getTargetTriple()).getArch() != llvm::Triple::x86_64 || size == 0 || size > 16) {
+    return info;
+  }
+  ArgClass classes[2] = { ClassNone, ClassNone };
+  bool hasDouble[2] = { false, false };
+  classifyEightbytes(dataLayout, type, 0, classes, hasDouble);
+  if (classes[0] == ClassMemory || classes[1] == ClassMemory) {
+    return info;
+  }
+
+  auto &context = type->getContext();
+  info.kind = ABIArgInfo::Coerce;
+  for (unsigned i = 0; i * 8 < size; ++i) {
+    uint64_t bytes = std::min<uint64_t>(8, size - i * 8);
+    if (classes[i] != ClassSSE) {
+      info.parts.push_back(llvm::IntegerType::get(context, bytes * 8));
+    } else if (bytes <= 4) {
+      info.parts.push_back(llvm::Type::getFloatTy(context));
+    } else if (hasDouble[i]) {
+      info.parts.push_back(llvm::Type::getDoubleTy(context));
+    } else {
+      info.parts.push_back(llvm::FixedVectorType::get(llvm::Type::getFloatTy(context), 2));
+    }
+  }
+  return info;
+}
+
+// Lower `proto` for `module`'s target. A coerced aggregate that no longer
+// fits in the six integer and eight SSE argument registers goes in memory
+// instead, as the ABI requires.
+static FunctionABI lowerFunctionProto(const llvm::Module &module, const FunProto &proto) {
+  FunctionABI abi;
+  unsigned freeInteger = 6;
+  unsigned freeSSE = 8;
+  std::vector<llvm::Type *> params;
+
+  abi.result = classifyArgument(module, proto.returnType);
+  llvm::Type *returnType = proto.returnType;
+  if (abi.result.kind == ABIArgInfo::Indirect) {
+    params.push_back(proto.returnType->getPointerTo());
+    returnType = llvm::Type::getVoidTy(proto.returnType->getContext());
+    --freeInteger;
+  } else if (abi.result.kind == ABIArgInfo::Coerce) {
+    returnType = abi.result.parts.size() == 1
+      ? abi.result.parts[0] : llvm::StructType::get(proto.returnType->getContext(), abi.result.parts);
+  }
+
+  for (auto *type : proto.params) {
+    auto info = classifyArgument(module, type);
+    if (info.kind == ABIArgInfo::Coerce) {
+      unsigned needInteger = 0;
+      unsigned needSSE = 0;
+      for (auto *part : info.parts) {
+        part->isIntegerTy() ? ++needInteger : ++needSSE;
+      }
+      if (needInteger > freeInteger || needSSE > freeSSE) {
+        info.kind = ABIArgInfo::Indirect;
+        info.parts.clear();
+      } else {
+        freeInteger -= needInteger;
+        freeSSE -= needSSE;
+      }
+    } else if (info.kind == ABIArgInfo::Direct) {
+      unsigned &free = type->isFloatingPointTy() ? freeSSE : freeInteger;
+      free -= free > 0;
+    }
+
+    info.firstArg = params.size();
+    if (info.kind == ABIArgInfo::Coerce) {
+      params.insert(params.end(), info.parts.begin(), info.parts.end());
+    } else if (info.kind == ABIArgInfo::Indirect) {
+      params.push_back(type->getPointerTo());
+    } else {
+      params.push_back(type);
+    }
+    abi.params.push_back(info);
+  }
+
+  abi.type = llvm::FunctionType::get(returnType, params, proto.isVarArg);
+  return abi;
+}
+
+struct EmitSession;
 
 // emit function statement list
-typedef llvm::Value* (*EmitStatementList)(llvm::Function *);
-static std::map<std::string, EmitStatementList> funImplMap;
+typedef llvm::Value* (*EmitStatementList)(EmitSession &, llvm::Function *);
+
+// Every function the program knows about. A name is hashed once, when it is
+// interned, and from then on is a dense symbol ID indexing a flat table of
+// prototypes, emitters and the FunctionTypes built from the prototypes.
+class FunRegistry {
+public:
+  typedef unsigned SymbolID;
+
+  SymbolID intern(llvm::StringRef name) {
+    auto inserted = ids.try_emplace(name, static_cast<SymbolID>(entries.size()));
+    if (inserted.second) {
+      entries.emplace_back();
+      entries.back().name = inserted.first->getKey();
+    }
+    return inserted.first->second;
+  }
+
+  // Look up a name without interning it.
+  bool lookup(llvm::StringRef name, SymbolID &id) const {
+    auto found = ids.find(name);
+    if (found == ids.end()) {
+      return false;
+    }
+    id = found->second;
+    return true;
+  }
 
-llvm::Value *getStructElementAddr(int index, llvm::Value *ptrval);
+  SymbolID setProto(llvm::StringRef name, const FunProto &proto) {
+    auto id = intern(name);
+    entries[id].proto = proto;
+    entries[id].abi = FunctionABI();
+    return id;
+  }
+
+  SymbolID setImpl(llvm::StringRef name, EmitStatementList impl) {
+    auto id = intern(name);
+    entries[id].impl = impl;
+    return id;
+  }
+
+  void setFingerprint(SymbolID id, std::string fingerprint) {
+    entries[id].fingerprint = std::move(fingerprint);
+  }
+
+  llvm::StringRef getName(SymbolID id) const { return entries[id].name; }
+  const FunProto &getProto(SymbolID id) const { return entries[id].proto; }
+  EmitStatementList getImpl(SymbolID id) const { return entries[id].impl; }
+  // fingerprintFunction() of the body, if defineFunction() recorded one.
+  llvm::StringRef getFingerprint(SymbolID id) const { return entries[id].fingerprint; }
+
+  // Lowered from the prototype for `module`'s target on first use and reused
+  // after that.
+  const FunctionABI &getABI(SymbolID id, const llvm::Module &module) {
+    auto &entry = entries[id];
+    if (entry.abi.type == nullptr) {
+      entry.abi = lowerFunctionProto(module, entry.proto);
+    }
+    return entry.abi;
+  }
+
+private:
+  struct Entry {
+    llvm::StringRef name;
+    FunProto proto = {};
+    EmitStatementList impl = nullptr;
+    FunctionABI abi;
+    std::string fingerprint;
+  };
+
+  llvm::StringMap<SymbolID> ids;
+  std::vector<Entry> entries;
+};
+
+// Named aggregates the program uses. Each one's ID indexes TypeRegistry.
+enum NamedType {
+  PointType,
+  UnionABType,
+};
+
+// One field of a struct, as the source declares it.
+struct StructField {
+  llvm::Type *type;
+  std::string name;
+  // Read on the hot path. LayoutHotFirst keeps these in the first cache line.
+  bool hot = false;
+};
+
+static const unsigned CacheLineSize = 64;
+
+// The order to lay `fields` out in, as indices into `fields`. Sorting by
+// decreasing ABI alignment leaves no padding between fields whose sizes are
+// multiples of their alignment, only at the end. The sort is stable, so equal
+// fields keep their declared order.
+static std::vector<unsigned> planStructLayout(const llvm::DataLayout &dataLayout,
+                                              llvm::ArrayRef<StructField> fields, StructLayoutPolicy policy) {
+  std::vector<unsigned> order(fields.size());
+  for (unsigned i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  if (policy == LayoutDeclared) {
+    return order;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+    if (policy == LayoutHotFirst && fields[a].hot != fields[b].hot) {
+      return fields[a].hot;
+    }
+    return dataLayout.getABITypeAlign(fields[a].type) > dataLayout.getABITypeAlign(fields[b].type);
+  });
+  return order;
+}
 
-llvm::Type* emitPointType() {
-  auto element_ty = Builder->getInt32Ty();
-  auto point_ty = llvm::StructType::create(*TheContext, "struct.point");
-  point_ty->setBody({ element_ty, element_ty });
-  return point_ty;
+// The named struct types of one session. Each is created the first time it is
+// defined and handed out by ID after that, so lookups index a vector instead
+// of hashing the name, and no struct.point.0 duplicates appear.
+//
+// Types defined from StructFields may have their fields reordered. Callers
+// keep using declared field indices; getFieldIndex() and getConstant()
+// translate them to the type's own.
+class TypeRegistry {
+public:
+  llvm::StructType *define(NamedType id, llvm::LLVMContext &context, llvm::StringRef name,
+                           llvm::ArrayRef<llvm::Type *> body) {
+    if (types.size() <= id) {
+      types.resize(id + 1, nullptr);
+    }
+    if (types[id] == nullptr) {
+      types[id] = llvm::StructType::create(context, body, name);
+    }
+    return types[id];
+  }
+
+  llvm::StructType *define(NamedType id, llvm::LLVMContext &context, const llvm::DataLayout &dataLayout,
+                           llvm::StringRef name, llvm::ArrayRef<StructField> fields, StructLayoutPolicy policy) {
+    if (get(id) != nullptr) {
+      return get(id);
+    }
+    auto order = planStructLayout(dataLayout, fields, policy);
+    std::vector<llvm::Type *> body;
+    for (auto field : order) {
+      body.push_back(fields[field].type);
+    }
+    auto type = define(id, context, name, body);
+
+    auto &layout = layouts[type];
+    layout.fields = fields;
+    layout.policy = policy;
+    layout.index.resize(order.size());
+    for (unsigned i = 0; i < order.size(); ++i) {
+      layout.index[order[i]] = i;
+    }
+    return type;
+  }
+
+  // nullptr until the type has been defined.
+  llvm::StructType *get(NamedType id) const {
+    return id < types.size() ? types[id] : nullptr;
+  }
+
+  // Where declared field `index` of `type` ended up.
+  unsigned getFieldIndex(llvm::StructType *type, unsigned index) const {
+    auto found = layouts.find(type);
+    return found == layouts.end() ? index : found->second.index[index];
+  }
+
+  // A constant of type `id` from its field values in declared order.
+  llvm::Constant *getConstant(NamedType id, llvm::ArrayRef<llvm::Constant *> values) const {
+    auto type = get(id);
+    std::vector<llvm::Constant *> body(values.size());
+    for (unsigned i = 0; i < values.size(); ++i) {
+      body[getFieldIndex(type, i)] = values[i];
+    }
+    return llvm::ConstantStruct::get(type, body);
+  }
+
+  // The declared fields of `type`, or none if it was defined from a body.
+  llvm::ArrayRef<StructField> getFields(llvm::StructType *type) const {
+    auto found = layouts.find(type);
+    return found == layouts.end() ? llvm::ArrayRef<StructField>() : llvm::makeArrayRef(found->second.fields);
+  }
+
+  StructLayoutPolicy getPolicy(llvm::StructType *type) const {
+    auto found = layouts.find(type);
+    return found == layouts.end() ? LayoutDeclared : found->second.policy;
+  }
+
+private:
+  struct Layout {
+    std::vector<StructField> fields;
+    StructLayoutPolicy policy;
+    // Declared field index to the type's own.
+    std::vector<unsigned> index;
+  };
+
+  std::vector<llvm::StructType *> types;
+  llvm::DenseMap<llvm::StructType *, Layout> layouts;
+};
+
+// The string constants of one session, keyed by their contents, so a string
+// emitted twice is one unnamed_addr global. With --pack-strings they point
+// into a stand-in global until finalizeStringPool() lays them out in a blob.
+struct StringPool {
+  llvm::StringMap<llvm::Constant *> strings;
+  std::string packed;
+  llvm::GlobalVariable *placeholder = nullptr;
+};
+
+// Everything one emission writes into. Sessions share no state, so each
+// thread can build its own module alongside the others.
+struct EmitSession {
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  // Calls onInsert() for every instruction it emits.
+  std::unique_ptr<llvm::IRBuilder<llvm::ConstantFolder, llvm::IRBuilderCallbackInserter>> Builder;
+  TypeRegistry typeRegistry;
+  FunRegistry funRegistry;
+  StringPool stringPool;
+  // Values emitLoadValue() already loaded from an address in the current
+  // block, so reading it again before a store or call reuses the first load.
+  llvm::DenseMap<llvm::Value *, llvm::Value *> availableLoads;
+  llvm::BasicBlock *availableLoadsBlock = nullptr;
+};
+
+// Whatever may write memory, a store emitted directly through the builder
+// as much as one from emitAssign(), or a call, makes every cached load stale.
+static void onInsert(EmitSession &session, llvm::Instruction *inst) {
+  if (inst->mayWriteToMemory()) {
+    session.availableLoads.clear();
+  }
+}
+
+static void initializeModule(EmitSession &session) {
+  // Open a new context and moduel
+  session.TheContext = std::make_unique<llvm::LLVMContext>();
+  session.TheModule = std::make_unique<llvm::Module>("ir_builder", *session.TheContext);
+  // Create a new builder for the module.
+  // The session must stay put from here on, the builder's inserter refers to it.
+  session.Builder = std::make_unique<llvm::IRBuilder<llvm::ConstantFolder, llvm::IRBuilderCallbackInserter>>(
+    *session.TheContext, llvm::ConstantFolder(),
+    llvm::IRBuilderCallbackInserter([&session](llvm::Instruction *inst) { onInsert(session, inst); }));
+}
+
+static void saveModuleIRToFile(EmitSession &session, const std::string& filename) {
+  std::error_code errorCode;
+  llvm::raw_fd_ostream out(filename, errorCode);
+  session.TheModule->print(out, nullptr);
 }
 
-void registerFunctionProto() {
+static void saveModuleBitcodeToFile(EmitSession &session, const std::string& filename) {
+  std::error_code errorCode;
+  llvm::raw_fd_ostream out(filename, errorCode);
+  llvm::WriteBitcodeToFile(*session.TheModule, out);
+}
+
+// Compile the module for its target triple and write an object file or
+// assembly, the same way llc would but without leaving the process.
+static std::unique_ptr<llvm::TargetMachine> createTargetMachine(const std::string& targetTriple) {
+  std::string error;
+  auto *target = llvm::TargetRegistry::lookupTarget(targetTriple, error);
+  if (target == nullptr) {
+    ExitOnErr(llvm::createStringError(llvm::inconvertibleErrorCode(), error));
+  }
+
+  llvm::TargetOptions options;
+  return std::unique_ptr<llvm::TargetMachine>(
+    target->createTargetMachine(targetTriple, "generic", "", options, llvm::Reloc::PIC_));
+}
+
+// Give the module the target's data layout instead of LLVM's generic one,
+// under which i64 is only 4 byte aligned.
+static void setTargetDataLayout(EmitSession &session) {
+  auto machine = createTargetMachine(session.TheModule->getTargetTriple());
+  session.TheModule->setDataLayout(machine->createDataLayout());
+}
+
+// Field order, the layout report and passing structs by value all depend on
+// the target's sizes and alignments.
+static bool needsTargetDataLayout() {
+  return StructLayout != LayoutDeclared || StructLayoutReport || StructByValue;
+}
+
+static void compileModule(llvm::TargetMachine &machine, llvm::Module &module,
+                          llvm::raw_pwrite_stream &out, llvm::CodeGenFileType fileType) {
+  module.setDataLayout(machine.createDataLayout());
+  llvm::legacy::PassManager pass;
+  if (machine.addPassesToEmitFile(pass, out, nullptr, fileType)) {
+    ExitOnErr(llvm::createStringError(llvm::inconvertibleErrorCode(), "target can't emit this file type"));
+  }
+  pass.run(module);
+}
+
+// Compile the module for its target triple and write an object file or
+// assembly, the same way llc would but without leaving the process.
+static void saveModuleNativeToFile(EmitSession &session, const std::string& filename, llvm::CodeGenFileType fileType) {
+  auto machine = createTargetMachine(session.TheModule->getTargetTriple());
+  std::error_code errorCode;
+  llvm::raw_fd_ostream out(filename, errorCode);
+  compileModule(*machine, *session.TheModule, out, fileType);
+}
+
+// Run the default new pass manager pipeline for -O<level> over the module.
+// With --time-stages every pass is timed as well.
+static void optimizeModule(EmitSession &session) {
+  llvm::OptimizationLevel level;
+  switch (OptLevel) {
+  case '1': level = llvm::OptimizationLevel::O1; break;
+  case '2': level = llvm::OptimizationLevel::O2; break;
+  case '3': level = llvm::OptimizationLevel::O3; break;
+  default:
+    ExitOnErr(llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                      "invalid optimization level -O" + std::string(1, OptLevel)));
+  }
+
+  auto &module = *session.TheModule;
+  ExitOnErr(module.materializeAll());
+  // Cost models come from the target, so optimize for the one we compile for.
+  auto machine = createTargetMachine(module.getTargetTriple());
+  module.setDataLayout(machine->createDataLayout());
+
+  if (TimeStages) {
+    llvm::TimePassesIsEnabled = true;
+  }
+  llvm::PassInstrumentationCallbacks instrumentation;
+  llvm::StandardInstrumentations standard(false);
+  standard.registerCallbacks(instrumentation);
+
+  llvm::LoopAnalysisManager loopAnalysis;
+  llvm::FunctionAnalysisManager functionAnalysis;
+  llvm::CGSCCAnalysisManager cgsccAnalysis;
+  llvm::ModuleAnalysisManager moduleAnalysis;
+  llvm::PassBuilder builder(machine.get(), llvm::PipelineTuningOptions(), llvm::None, &instrumentation);
+  builder.registerModuleAnalyses(moduleAnalysis);
+  builder.registerCGSCCAnalyses(cgsccAnalysis);
+  builder.registerFunctionAnalyses(functionAnalysis);
+  builder.registerLoopAnalyses(loopAnalysis);
+  builder.crossRegisterProxies(loopAnalysis, functionAnalysis, cgsccAnalysis, moduleAnalysis);
+
+  auto passes = builder.buildPerModuleDefaultPipeline(level);
+  passes.run(module, moduleAnalysis);
+}
+
+// Every global a function body or variable initializer refers to, in order of
+// first use, including the ones buried inside constant expressions.
+static llvm::SetVector<llvm::GlobalValue *> collectReferencedGlobals(llvm::GlobalValue &global) {
+  std::vector<const llvm::User *> users;
+  if (auto *fn = llvm::dyn_cast<llvm::Function>(&global)) {
+    for (auto &inst : llvm::instructions(*fn)) {
+      users.push_back(&inst);
+    }
+  } else if (auto *var = llvm::dyn_cast<llvm::GlobalVariable>(&global)) {
+    if (var->hasInitializer()) {
+      users.push_back(var->getInitializer());
+    }
+  }
+
+  llvm::SetVector<llvm::GlobalValue *> referenced;
+  llvm::SmallPtrSet<const llvm::Constant *, 32> visited;
+  while (!users.empty()) {
+    auto *user = users.back();
+    users.pop_back();
+    for (auto &operand : user->operands()) {
+      if (auto *target = llvm::dyn_cast<llvm::GlobalValue>(operand)) {
+        referenced.insert(const_cast<llvm::GlobalValue *>(target));
+      } else if (auto *expr = llvm::dyn_cast<llvm::Constant>(operand)) {
+        if (visited.insert(expr).second) {
+          users.push_back(expr);
+        }
+      }
+    }
+  }
+  return referenced;
+}
+
+// Metadata spelled out in full rather than as the module-wide !N a printed
+// body refers to it by. Nodes are numbered in order of first use within the
+// function, which also ends self references such as a loop ID's.
+static void printMetadataTree(const llvm::Metadata *md, llvm::DenseMap<const llvm::Metadata *, unsigned> &seen,
+                              llvm::raw_ostream &out) {
+  if (md == nullptr) {
+    out << "null";
+  } else if (auto *str = llvm::dyn_cast<llvm::MDString>(md)) {
+    out << "!\"" << str->getString() << "\"";
+  } else if (auto *value = llvm::dyn_cast<llvm::ValueAsMetadata>(md)) {
+    value->getValue()->printAsOperand(out);
+  } else if (auto *node = llvm::dyn_cast<llvm::MDNode>(md)) {
+    auto inserted = seen.try_emplace(node, seen.size());
+    out << "!" << inserted.first->second;
+    if (!inserted.second) {
+      return;
+    }
+    out << " = " << node->getMetadataID();
+    if (auto *loc = llvm::dyn_cast<llvm::DILocation>(node)) {
+      out << " line " << loc->getLine() << " column " << loc->getColumn();
+    }
+    out << " {";
+    for (auto &operand : node->operands()) {
+      printMetadataTree(operand, seen, out);
+      out << ", ";
+    }
+    out << "}";
+  }
+}
+
+// SHA1 of a function's printed IR, plus what the printed text only refers to:
+// attribute groups, attached metadata and the globals the body uses. Unnamed
+// values are numbered per function, so the fingerprint only changes when the
+// function or something it refers to does.
+static std::string fingerprintFunction(llvm::Function &fn) {
+  std::string text;
+  llvm::raw_string_ostream out(text);
+  fn.print(out);
+
+  llvm::DenseMap<const llvm::Metadata *, unsigned> seen;
+  auto printAttached = [&](llvm::AttributeList attrs,
+                           llvm::ArrayRef<std::pair<unsigned, llvm::MDNode *>> attached) {
+    for (unsigned index : attrs.indexes()) {
+      out << index << ": " << attrs.getAsString(index, /*InAttrGrp=*/true) << "\n";
+    }
+    for (auto &entry : attached) {
+      out << entry.first << ": ";
+      printMetadataTree(entry.second, seen, out);
+      out << "\n";
+    }
+  };
+  llvm::SmallVector<std::pair<unsigned, llvm::MDNode *>, 4> attached;
+  fn.getAllMetadata(attached);
+  printAttached(fn.getAttributes(), attached);
+  for (auto &inst : llvm::instructions(fn)) {
+    attached.clear();
+    inst.getAllMetadata(attached);
+    auto *call = llvm::dyn_cast<llvm::CallBase>(&inst);
+    printAttached(call != nullptr ? call->getAttributes() : llvm::AttributeList(), attached);
+  }
+
+  for (auto *global : collectReferencedGlobals(fn)) {
+    if (auto *var = llvm::dyn_cast<llvm::GlobalVariable>(global)) {
+      var->print(out);
+      out << "\n";
+    }
+  }
+  return llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(out.str())));
+}
+
+// Cache key for writing the module to `filename`: the LLVM version, output
+// kind, optimization level, target, every named type, global and function
+// prototype, and the fingerprint of every function body. It is taken before
+// optimization, so a hit needs neither the pipeline nor code generation.
+static std::string fingerprintModule(llvm::Module &module, const std::string& filename) {
+  llvm::SHA1 hasher;
+  hasher.update(LLVM_VERSION_STRING);
+  hasher.update(llvm::sys::path::extension(filename));
+  hasher.update(std::string("-O") + OptLevel.getValue());
+  hasher.update(module.getTargetTriple());
+  hasher.update(module.getDataLayoutStr());
+
+  std::string text;
+  llvm::raw_string_ostream out(text);
+  for (auto *type : module.getIdentifiedStructTypes()) {
+    type->print(out);
+    out << "\n";
+  }
+  for (auto &global : module.globals()) {
+    global.print(out);
+    out << "\n";
+  }
+  hasher.update(out.str());
+
+  for (auto &fn : module) {
+    hasher.update(fn.getName());
+    hasher.update(fingerprintFunction(fn));
+  }
+  return llvm::toHex(hasher.final());
+}
+
+// Entries are named llvmcache-<key>, the prefix pruneCache() looks for.
+static llvm::SmallString<128> getCacheEntryPath(llvm::StringRef key) {
+  llvm::SmallString<128> entryPath(CacheDir.getValue());
+  llvm::sys::path::append(entryPath, "llvmcache-" + key);
+  return entryPath;
+}
+
+// Entries are evicted least recently used first, so refresh one on a hit.
+static void touchCacheEntry(llvm::StringRef entryPath) {
+  int fd;
+  if (!llvm::sys::fs::openFileForWrite(entryPath, fd, llvm::sys::fs::CD_OpenExisting)) {
+    llvm::sys::fs::setLastAccessAndModificationTime(fd, llvm::sys::TimePoint<>(std::chrono::system_clock::now()));
+    llvm::sys::Process::SafelyCloseFileDescriptor(fd);
+  }
+}
+
+// Store `contents` under a unique temporary name and rename it into place, so
+// a concurrent build never sees half an entry, and two builds that miss on the
+// same key never write to the same file. The temporary name lacks the
+// llvmcache- prefix, so pruneCache() leaves it alone.
+static void insertCacheEntry(llvm::StringRef entryPath, llvm::StringRef contents) {
+  ExitOnErr(llvm::errorCodeToError(llvm::sys::fs::create_directories(CacheDir)));
+  llvm::SmallString<128> tempModel(CacheDir.getValue());
+  llvm::sys::path::append(tempModel, "tmp-%%%%%%%%");
+  auto temp = ExitOnErr(llvm::sys::fs::TempFile::create(tempModel));
+  {
+    llvm::raw_fd_ostream out(temp.FD, /*shouldClose=*/false);
+    out << contents;
+  }
+  ExitOnErr(temp.keep(entryPath));
+}
+
+static void pruneCacheDir() {
+  llvm::CachePruningPolicy policy;
+  policy.Interval = std::chrono::seconds(0);
+  policy.MaxSizeBytes = uint64_t(CacheSizeMB) * 1024 * 1024;
+  llvm::pruneCache(CacheDir, policy);
+}
+
+// Add this build's hits and misses to the counters kept next to the entries.
+// The file is locked for the whole read-modify-write, so concurrent builds
+// queue up instead of losing each other's updates.
+static void recordCacheAccess(uint64_t newHits, uint64_t newMisses) {
+  llvm::SmallString<128> statsPath(CacheDir.getValue());
+  llvm::sys::path::append(statsPath, "stats");
+
+  int fd;
+  ExitOnErr(llvm::errorCodeToError(llvm::sys::fs::create_directories(CacheDir)));
+  ExitOnErr(llvm::errorCodeToError(
+    llvm::sys::fs::openFileForReadWrite(statsPath, fd, llvm::sys::fs::CD_OpenAlways, llvm::sys::fs::OF_None)));
+  llvm::raw_fd_ostream out(fd, /*shouldClose=*/true);
+  auto lock = ExitOnErr(out.lock());
+
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  if (auto buffer = llvm::MemoryBuffer::getOpenFile(fd, statsPath, -1, /*RequiresNullTerminator=*/false)) {
+    llvm::StringRef line1, line2;
+    std::tie(line1, line2) = (*buffer)->getBuffer().split('\n');
+    line1.trim().getAsInteger(10, hits);
+    line2.trim().getAsInteger(10, misses);
+  }
+  hits += newHits;
+  misses += newMisses;
+
+  out.seek(0);
+  out << hits << "\n" << misses << "\n";
+  out.flush();
+  ExitOnErr(llvm::errorCodeToError(llvm::sys::fs::resize_file(fd, out.tell())));
+  lock.unlock();
+  if (CacheStats) {
+    llvm::errs() << "emit_ir: cache " << newHits << " hits, " << newMisses << " misses ("
+                 << hits << " hits, " << misses << " misses in total)\n";
+  }
+}
+
+// Write `filename` through `save`, which optimizes and writes the module, or
+// copy it from the cache when an identical unoptimized module was written to
+// the same kind of file at the same level before.
+static void saveModuleCached(EmitSession &session, const std::string& filename,
+                             llvm::function_ref<void()> save) {
+  if (CacheDir.empty()) {
+    save();
+    return;
+  }
+
+  auto entryPath = getCacheEntryPath(fingerprintModule(*session.TheModule, filename));
+  if (llvm::sys::fs::exists(entryPath)) {
+    ExitOnErr(llvm::errorCodeToError(llvm::sys::fs::copy_file(entryPath, filename)));
+    touchCacheEntry(entryPath);
+    recordCacheAccess(1, 0);
+    return;
+  }
+
+  save();
+
+  auto contents = ExitOnErr(llvm::errorOrToExpected(llvm::MemoryBuffer::getFile(filename)));
+  insertCacheEntry(entryPath, contents->getBuffer());
+  recordCacheAccess(0, 1);
+  pruneCacheDir();
+}
+
+// Copy `fn` into a module of its own. Everything it refers to is declared
+// there under the same name, so the units link back together.
+static std::unique_ptr<llvm::Module> extractFunction(llvm::Function &fn) {
+  auto &source = *fn.getParent();
+  auto unit = std::make_unique<llvm::Module>(fn.getName(), fn.getContext());
+  unit->setTargetTriple(source.getTargetTriple());
+  unit->setDataLayout(source.getDataLayout());
+
+  auto *copy = llvm::Function::Create(fn.getFunctionType(), fn.getLinkage(), fn.getName(), unit.get());
+  copy->copyAttributesFrom(&fn);
+
+  llvm::ValueToValueMapTy vmap;
+  vmap[&fn] = copy;
+  auto destArg = copy->arg_begin();
+  for (auto &arg : fn.args()) {
+    destArg->setName(arg.getName());
+    vmap[&arg] = &*destArg++;
+  }
+
+  for (auto *global : collectReferencedGlobals(fn)) {
+    if (global == &fn) {
+      continue;
+    }
+    if (auto *callee = llvm::dyn_cast<llvm::Function>(global)) {
+      auto *decl = llvm::Function::Create(callee->getFunctionType(), llvm::GlobalValue::ExternalLinkage,
+                                          callee->getName(), unit.get());
+      decl->copyAttributesFrom(callee);
+      vmap[callee] = decl;
+    } else {
+      auto *var = llvm::cast<llvm::GlobalVariable>(global);
+      auto *decl = new llvm::GlobalVariable(*unit, var->getValueType(), var->isConstant(),
+                                            llvm::GlobalValue::ExternalLinkage, nullptr, var->getName());
+      decl->copyAttributesFrom(var);
+      vmap[var] = decl;
+    }
+  }
+
+  llvm::SmallVector<llvm::ReturnInst *, 4> returns;
+  llvm::CloneFunctionInto(copy, &fn, vmap, llvm::CloneFunctionChangeType::DifferentModule, returns);
+  return unit;
+}
+
+// Write `filename` as an archive with one object per function and one for all
+// global variables. A function's object is keyed on its recorded fingerprint
+// and on the names and types of everything it calls or uses, so a rebuild
+// only compiles the functions whose body or callee set changed.
+static void saveModuleIncrementally(EmitSession &session, const std::string& filename) {
+  auto &module = *session.TheModule;
+  auto machine = createTargetMachine(module.getTargetTriple());
+  module.setDataLayout(machine->createDataLayout());
+
+  // The units refer to each other's symbols, so nothing may stay local.
+  for (auto &global : module.global_values()) {
+    if (global.hasLocalLinkage()) {
+      global.setLinkage(llvm::GlobalValue::ExternalLinkage);
+      global.setVisibility(llvm::GlobalValue::HiddenVisibility);
+    }
+  }
+
+  // Shared by every unit: toolchain, target and named struct bodies.
+  std::string common;
+  {
+    llvm::raw_string_ostream out(common);
+    out << LLVM_VERSION_STRING << "\n" << module.getTargetTriple() << "\n" << module.getDataLayoutStr() << "\n"
+        << "-O" << OptLevel << "\n";
+    for (auto *type : module.getIdentifiedStructTypes()) {
+      type->print(out);
+      out << "\n";
+    }
+  }
+
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> objects;
+  std::vector<std::string> memberNames;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  auto addUnit = [&](const std::string &memberName, llvm::StringRef key,
+                     llvm::function_ref<std::unique_ptr<llvm::Module>()> extract) {
+    auto entryPath = getCacheEntryPath(key);
+    if (auto cached = llvm::MemoryBuffer::getFile(entryPath)) {
+      touchCacheEntry(entryPath);
+      objects.push_back(std::move(*cached));
+      hits++;
+    } else {
+      llvm::SmallVector<char, 0> object;
+      llvm::raw_svector_ostream out(object);
+      auto unit = extract();
+      compileModule(*machine, *unit, out, llvm::CGFT_ObjectFile);
+      insertCacheEntry(entryPath, out.str());
+      objects.push_back(llvm::MemoryBuffer::getMemBufferCopy(out.str()));
+      misses++;
+    }
+    memberNames.push_back(memberName);
+  };
+
+  for (auto &fn : module) {
+    if (fn.isDeclaration()) {
+      continue;
+    }
+    // Optimization rewrites bodies, inlining callees among other things, so
+    // the fingerprint recorded at emission only describes unoptimized code.
+    FunRegistry::SymbolID id;
+    std::string fingerprint;
+    if (OptLevel == '0' && session.funRegistry.lookup(fn.getName(), id)) {
+      fingerprint = session.funRegistry.getFingerprint(id).str();
+    }
+    if (fingerprint.empty()) {
+      fingerprint = fingerprintFunction(fn);
+    }
+    llvm::SHA1 hasher;
+    hasher.update(common);
+    hasher.update(fn.getName());
+    hasher.update(fingerprint);
+    for (auto *global : collectReferencedGlobals(fn)) {
+      std::string text;
+      llvm::raw_string_ostream out(text);
+      out << global->getName() << " " << *global->getValueType() << " " << global->getVisibility();
+      hasher.update(out.str());
+    }
+    addUnit(fn.getName().str() + ".o", llvm::toHex(hasher.final()), [&] { return extractFunction(fn); });
+  }
+
+  // The global variables go in one unit of their own, keyed on their text.
+  {
+    std::string text = common;
+    llvm::raw_string_ostream out(text);
+    for (auto &global : module.globals()) {
+      global.print(out);
+      out << "\n";
+    }
+    auto key = llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(out.str())));
+    addUnit("__globals.o", key, [&] {
+      llvm::ValueToValueMapTy vmap;
+      return llvm::CloneModule(module, vmap, [](const llvm::GlobalValue *global) {
+        return llvm::isa<llvm::GlobalVariable>(global);
+      });
+    });
+  }
+
+  std::vector<llvm::NewArchiveMember> members;
+  for (size_t i = 0; i < objects.size(); ++i) {
+    members.emplace_back(llvm::MemoryBufferRef(objects[i]->getBuffer(), memberNames[i]));
+  }
+  ExitOnErr(llvm::writeArchive(filename, members, true, llvm::object::Archive::K_GNU, true, false));
+
+  recordCacheAccess(hits, misses);
+  pruneCacheDir();
+}
+
+// Replace the session's module with one read from bitcode. Only globals and
+// prototypes are parsed here. The writer records where every function body
+// starts, so each body is read the first time something materializes it.
+static void loadModuleBitcodeFromFile(EmitSession &session, const std::string& filename) {
+  auto buffer = ExitOnErr(llvm::errorOrToExpected(llvm::MemoryBuffer::getFile(filename)));
+  session.TheModule = ExitOnErr(llvm::getOwningLazyBitcodeModule(std::move(buffer), *session.TheContext));
+}
+
+llvm::Value *getStructElementAddr(EmitSession &session, int index, llvm::Value *ptrval);
+llvm::Value *getAggregateElementAddr(EmitSession &session, int index, llvm::Value *ptrval);
+
+llvm::StructType* emitPointType(EmitSession &session) {
+  auto element_ty = session.Builder->getInt32Ty();
+  return session.typeRegistry.define(PointType, *session.TheContext, session.TheModule->getDataLayout(),
+                                     "struct.point", { { element_ty, "x" }, { element_ty, "y" } }, StructLayout);
+}
+
+void registerFunctionProto(EmitSession &session) {
   // int main(int)
-  funProtoMap["main"] = {
-    Builder->getInt32Ty(),
+  session.funRegistry.setProto("main", {
+    session.Builder->getInt32Ty(),
     {},
     false,
-  };
+  });
 
   // int sum(int, int)
-  funProtoMap["sum"] = {
-    Builder->getInt32Ty(),
-    { Builder->getInt32Ty(), Builder->getInt32Ty() },
+  session.funRegistry.setProto("sum", {
+    session.Builder->getInt32Ty(),
+    { session.Builder->getInt32Ty(), session.Builder->getInt32Ty() },
     false,
-  };
+  });
 
   // int printf(const char *format, ...)
-  funProtoMap["printf"] = {
-    Builder->getInt32Ty(),
-    { Builder->getInt8Ty()->getPointerTo() },
+  session.funRegistry.setProto("printf", {
+    session.Builder->getInt32Ty(),
+    { session.Builder->getInt8Ty()->getPointerTo() },
     true,
-  };
+  });
 
-  auto i32PtrTy = Builder->getInt32Ty()->getPointerTo();
+  auto i32PtrTy = session.Builder->getInt32Ty()->getPointerTo();
   // void swap_ptr(int *, int *)
-  funProtoMap["swap_ptr"] = {
-    Builder->getVoidTy(),
+  session.funRegistry.setProto("swap_ptr", {
+    session.Builder->getVoidTy(),
     { i32PtrTy, i32PtrTy },
     false,
-  };
+  });
 
-  auto i32Ty = Builder->getInt32Ty();
+  auto i32Ty = session.Builder->getInt32Ty();
   // void swap_arr(int[], int, int)
-  funProtoMap["swap_array"] = {
-    Builder->getVoidTy(),
+  session.funRegistry.setProto("swap_array", {
+    session.Builder->getVoidTy(),
     { i32PtrTy, i32Ty, i32Ty },
     false,
-  };
+  });
 
-  auto pointTy = emitPointType();
+  auto pointTy = emitPointType(session);
   // void swap_struct(struct point *)
-  funProtoMap["swap_struct"] = {
-    Builder->getVoidTy(),
+  FunProto swapStructProto = {
+    session.Builder->getVoidTy(),
     { pointTy->getPointerTo() },
     false,
-  };   
+  };
+  session.funRegistry.setProto("swap_struct", swapStructProto);
+
+  // void swap_struct.N(struct point *)
+  for (unsigned i = 1; i <= Replicate; ++i) {
+    session.funRegistry.setProto("swap_struct." + std::to_string(i), swapStructProto);
+  }
+
+  // struct point swap_point(struct point)
+  session.funRegistry.setProto("swap_point", { pointTy, { pointTy }, false });
+
+  // void init_points(), int sum_points_x()
+  session.funRegistry.setProto("init_points", { session.Builder->getVoidTy(), {}, false });
+  session.funRegistry.setProto("sum_points_x", { session.Builder->getInt32Ty(), {}, false });
 }
 
-llvm::Value* emitMainStatementList(llvm::Function *);
-llvm::Value* emitSumStatementList(llvm::Function *);
-llvm::Value* emitSwapPtrStatementList(llvm::Function *);
-llvm::Value* emitSwapArrayStatementList(llvm::Function *);
-llvm::Value* emitSwapPointStatementList(llvm::Function *);
+llvm::Value* emitMainStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitSumStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitSwapPtrStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitSwapArrayStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitSwapPointStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitSwapPointByValueStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitInitPointsStatementList(EmitSession &, llvm::Function *);
+llvm::Value* emitSumPointsXStatementList(EmitSession &, llvm::Function *);
+
+void registerFunctionImpl(EmitSession &session) {
+  session.funRegistry.setImpl("main", emitMainStatementList);
+  session.funRegistry.setImpl("sum", emitSumStatementList);
+  session.funRegistry.setImpl("swap_ptr", emitSwapPtrStatementList);
+  session.funRegistry.setImpl("swap_array", emitSwapArrayStatementList);
+  session.funRegistry.setImpl("swap_struct", emitSwapPointStatementList);
+
+  for (unsigned i = 1; i <= Replicate; ++i) {
+    session.funRegistry.setImpl("swap_struct." + std::to_string(i), emitSwapPointStatementList);
+  }
+
+  session.funRegistry.setImpl("swap_point", emitSwapPointByValueStatementList);
+  session.funRegistry.setImpl("init_points", emitInitPointsStatementList);
+  session.funRegistry.setImpl("sum_points_x", emitSumPointsXStatementList);
+}
 
-void registerFunctionImpl() {
-  funImplMap["main"] = emitMainStatementList;
-  funImplMap["sum"] = emitSumStatementList;
-  funImplMap["swap_ptr"] = emitSwapPtrStatementList;
-  funImplMap["swap_array"] = emitSwapArrayStatementList;
-  funImplMap["swap_struct"] = emitSwapPointStatementList;
+// Where the type's alignment would be assumed for memory the ABI passes.
+static llvm::Align getIndirectAlign(EmitSession &session, const ABIArgInfo &info, bool isResult) {
+  auto align = session.TheModule->getDataLayout().getABITypeAlign(info.type);
+  // byval copies are made in 8 byte stack slots.
+  return isResult ? align : std::max(align, llvm::Align(8));
+}
+
+static void addABIAttributes(EmitSession &session, llvm::Function *fn, const FunctionABI &abi) {
+  auto &context = *session.TheContext;
+  if (abi.result.kind == ABIArgInfo::Indirect) {
+    fn->addParamAttr(0, llvm::Attribute::getWithStructRetType(context, abi.result.type));
+    fn->addParamAttr(0, llvm::Attribute::NoAlias);
+    fn->addParamAttr(0, llvm::Attribute::getWithAlignment(context, getIndirectAlign(session, abi.result, true)));
+  }
+  for (auto &info : abi.params) {
+    if (info.kind == ABIArgInfo::Indirect) {
+      fn->addParamAttr(info.firstArg, llvm::Attribute::getWithByValType(context, info.type));
+      fn->addParamAttr(info.firstArg, llvm::Attribute::getWithAlignment(context, getIndirectAlign(session, info, false)));
+    }
+  }
 }
 
-llvm::Function *declareFunction(std::string name) {
-  auto* func = TheModule->getFunction(name);
+llvm::Function *declareFunction(EmitSession &session, FunRegistry::SymbolID id) {
+  auto name = session.funRegistry.getName(id);
+  auto* func = session.TheModule->getFunction(name);
   if (func == nullptr) {
-    FunProto funProto = funProtoMap[name];
-    auto* funcType = llvm::FunctionType::get(funProto.returnType, funProto.params, funProto.isVarArg);
-    func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, TheModule.get());
+    auto &abi = session.funRegistry.getABI(id, *session.TheModule);
+    func = llvm::Function::Create(abi.type, llvm::Function::ExternalLinkage, name, session.TheModule.get());
     func->setDSOLocal(true);
+    addABIAttributes(session, func, abi);
   }
   return func;
 }
 
-void emitReturn(llvm::Type *ty, llvm::Value *value) {
+llvm::Function *declareFunction(EmitSession &session, llvm::StringRef name) {
+  return declareFunction(session, session.funRegistry.intern(name));
+}
+
+void emitReturn(EmitSession &session, llvm::Type *ty, llvm::Value *value) {
   if (ty->isVoidTy()) {
-    Builder->CreateRetVoid();
+    session.Builder->CreateRetVoid();
   } else {
-    Builder->CreateRet(value);
+    session.Builder->CreateRet(value);
+  }
+}
+
+llvm::BasicBlock* createBB(EmitSession &session, llvm::Function *fn, std::string name) {
+  return llvm::BasicBlock::Create(*session.TheContext, name, fn);
+}
+
+// The ABI of a function declareFunction() created.
+static const FunctionABI &getFunctionABI(EmitSession &session, llvm::Function *fn) {
+  return session.funRegistry.getABI(session.funRegistry.intern(fn->getName()), *session.TheModule);
+}
+
+static llvm::Value *getEightbyteAddr(EmitSession &session, llvm::Value *bytes, unsigned index) {
+  if (index == 0) {
+    return bytes;
   }
+  return session.Builder->CreateConstInBoundsGEP1_64(session.Builder->getInt8Ty(), bytes, index * 8);
 }
 
-llvm::BasicBlock* createBB(llvm::Function *fn, std::string name) {
-  return llvm::BasicBlock::Create(*TheContext, name, fn);
+// A stack slot for an aggregate the ABI moves, at the alignment it assumes.
+static llvm::AllocaInst *emitABIAlloca(EmitSession &session, const ABIArgInfo &info, std::string name) {
+  auto addr = session.Builder->CreateAlloca(info.type, nullptr, name);
+  addr->setAlignment(session.TheModule->getDataLayout().getABITypeAlign(info.type));
+  return addr;
 }
 
-void emitFunctionBody(llvm::Function *fn, std::string name) {
+// Load the aggregate at `addr` as its coerced parts, eightbyte by eightbyte.
+static std::vector<llvm::Value *> emitLoadCoerced(EmitSession &session, llvm::Value *addr, const ABIArgInfo &info) {
+  auto align = session.TheModule->getDataLayout().getABITypeAlign(info.type);
+  auto bytes = session.Builder->CreateBitCast(addr, session.Builder->getInt8PtrTy());
+  std::vector<llvm::Value *> values;
+  for (unsigned i = 0; i < info.parts.size(); ++i) {
+    auto *part = info.parts[i];
+    auto partAddr = getEightbyteAddr(session, bytes, i);
+    partAddr = session.Builder->CreateBitCast(partAddr, part->getPointerTo());
+    values.push_back(session.Builder->CreateAlignedLoad(part, partAddr, llvm::commonAlignment(align, i * 8)));
+  }
+  return values;
+}
+
+// The inverse of emitLoadCoerced().
+static void emitStoreCoerced(EmitSession &session, llvm::Value *addr, const ABIArgInfo &info,
+                             llvm::ArrayRef<llvm::Value *> values) {
+  auto align = session.TheModule->getDataLayout().getABITypeAlign(info.type);
+  auto bytes = session.Builder->CreateBitCast(addr, session.Builder->getInt8PtrTy());
+  for (unsigned i = 0; i < values.size(); ++i) {
+    auto partAddr = getEightbyteAddr(session, bytes, i);
+    partAddr = session.Builder->CreateBitCast(partAddr, values[i]->getType()->getPointerTo());
+    session.Builder->CreateAlignedStore(values[i], partAddr, llvm::commonAlignment(align, i * 8));
+  }
+}
+
+// Parameter `index` of `fn`, as its source type, in a stack slot. Parameters
+// passed byval are already a private copy and are used in place.
+llvm::Value *emitParamAlloca(EmitSession &session, llvm::Function *fn, unsigned index, std::string name) {
+  auto &info = getFunctionABI(session, fn).params[index];
+  if (info.kind == ABIArgInfo::Indirect) {
+    auto arg = fn->getArg(info.firstArg);
+    arg->setName(name);
+    return arg;
+  }
+  auto addr = emitABIAlloca(session, info, name);
+  if (info.kind == ABIArgInfo::Coerce) {
+    std::vector<llvm::Value *> values;
+    for (unsigned i = 0; i < info.parts.size(); ++i) {
+      values.push_back(fn->getArg(info.firstArg + i));
+    }
+    emitStoreCoerced(session, addr, info, values);
+  } else {
+    session.Builder->CreateStore(fn->getArg(info.firstArg), addr);
+  }
+  return addr;
+}
+
+// Where a function returning an aggregate should build its result: the
+// caller's sret memory if there is one, a stack slot otherwise.
+llvm::Value *emitResultAlloca(EmitSession &session, llvm::Function *fn, std::string name) {
+  auto &info = getFunctionABI(session, fn).result;
+  if (info.kind == ABIArgInfo::Indirect) {
+    return fn->getArg(0);
+  }
+  return emitABIAlloca(session, info, name);
+}
+
+// Return `value`, or for an aggregate result the value at address `value`.
+void emitABIReturn(EmitSession &session, llvm::Function *fn, llvm::Value *value) {
+  auto &info = getFunctionABI(session, fn).result;
+  if (info.kind == ABIArgInfo::Direct) {
+    emitReturn(session, fn->getReturnType(), value);
+    return;
+  }
+  if (info.kind == ABIArgInfo::Indirect) {
+    auto result = fn->getArg(0);
+    if (value != result) {
+      auto &dataLayout = session.TheModule->getDataLayout();
+      auto align = dataLayout.getABITypeAlign(info.type);
+      session.Builder->CreateMemCpy(result, align, value, align, dataLayout.getTypeAllocSize(info.type));
+    }
+    session.Builder->CreateRetVoid();
+    return;
+  }
+  auto values = emitLoadCoerced(session, value, info);
+  if (values.size() == 1) {
+    session.Builder->CreateRet(values[0]);
+    return;
+  }
+  llvm::Value *result = llvm::UndefValue::get(fn->getReturnType());
+  for (unsigned i = 0; i < values.size(); ++i) {
+    result = session.Builder->CreateInsertValue(result, values[i], i);
+  }
+  session.Builder->CreateRet(result);
+}
+
+// Call `name` with source-level arguments, aggregates given by address, and
+// lower them as its ABI says. An aggregate result is returned by address.
+llvm::Value *emitCall(EmitSession &session, llvm::StringRef name, llvm::ArrayRef<llvm::Value *> args) {
+  auto fn = declareFunction(session, name);
+  auto &abi = getFunctionABI(session, fn);
+
+  std::vector<llvm::Value *> irArgs;
+  llvm::Value *resultAddr = nullptr;
+  if (abi.result.kind != ABIArgInfo::Direct) {
+    resultAddr = emitABIAlloca(session, abi.result, "tmp");
+  }
+  if (abi.result.kind == ABIArgInfo::Indirect) {
+    irArgs.push_back(resultAddr);
+  }
+  for (unsigned i = 0; i < args.size(); ++i) {
+    if (i >= abi.params.size() || abi.params[i].kind != ABIArgInfo::Coerce) {
+      // Direct values, byval addresses and variadic arguments as they are.
+      irArgs.push_back(args[i]);
+      continue;
+    }
+    auto values = emitLoadCoerced(session, args[i], abi.params[i]);
+    irArgs.insert(irArgs.end(), values.begin(), values.end());
+  }
+
+  auto call = session.Builder->CreateCall(fn, irArgs);
+  call->setAttributes(fn->getAttributes());
+  if (abi.result.kind == ABIArgInfo::Direct) {
+    return call;
+  }
+  if (abi.result.kind == ABIArgInfo::Coerce) {
+    std::vector<llvm::Value *> values;
+    if (abi.result.parts.size() == 1) {
+      values.push_back(call);
+    } else {
+      for (unsigned i = 0; i < abi.result.parts.size(); ++i) {
+        values.push_back(session.Builder->CreateExtractValue(call, i));
+      }
+    }
+    emitStoreCoerced(session, resultAddr, abi.result, values);
+  }
+  return resultAddr;
+}
+
+void emitFunctionBody(EmitSession &session, llvm::Function *fn, FunRegistry::SymbolID id) {
   // Create entry basic block
-  auto *entry = createBB(fn, "entry");
-  Builder->SetInsertPoint(entry);
+  auto *entry = createBB(session, fn, "entry");
+  session.Builder->SetInsertPoint(entry);
 
-  auto emitter = funImplMap[name];
-  auto value = emitter(fn);
+  auto emitter = session.funRegistry.getImpl(id);
+  auto value = emitter(session, fn);
 
   // emit return
-  emitReturn(fn->getReturnType(), value);
+  emitABIReturn(session, fn, value);
 }
 
-void defineFunction(std::string name) {
+void defineFunction(EmitSession &session, llvm::StringRef name) {
   // Function must be declated before define
-  auto* fn = TheModule->getFunction(name);
-  emitFunctionBody(fn, name);
+  auto id = session.funRegistry.intern(name);
+  auto* fn = session.TheModule->getFunction(name);
+  emitFunctionBody(session, fn, id);
   verifyFunction(*fn);
+
+  if (Incremental) {
+    session.funRegistry.setFingerprint(id, fingerprintFunction(*fn));
+  }
 }
 
-llvm::GlobalVariable* defineGlobalVariable(llvm::Type *type, std::string name, llvm::Constant *init) {
-  TheModule->getOrInsertGlobal(name, type);
-  auto *globalVar = TheModule->getNamedGlobal(name);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, llvm::Type *type, std::string name, llvm::Constant *init) {
+  session.TheModule->getOrInsertGlobal(name, type);
+  auto *globalVar = session.TheModule->getNamedGlobal(name);
   globalVar->setInitializer(init);
   globalVar->setDSOLocal(true);
   return globalVar;
 }
 
-llvm::GlobalVariable* defineGlobalVariable(std::string name, llvm::Constant *init) {
-  return defineGlobalVariable(init->getType(), name, init);
+llvm::GlobalVariable* defineGlobalVariable(EmitSession &session, std::string name, llvm::Constant *init) {
+  return defineGlobalVariable(session, init->getType(), name, init);
 }
 
-llvm::Value* emitLoadValue(llvm::GlobalVariable *value) {
-  return Builder->CreateLoad(value->getInitializer()->getType(), value);
+// A global array holding `elements` as one ConstantDataArray, a single packed
+// copy of the data rather than a Constant per element. ElementTy is an 8 to 64
+// bit integer, float or double.
+template <typename ElementTy>
+llvm::GlobalVariable* defineGlobalArray(EmitSession &session, std::string name, llvm::ArrayRef<ElementTy> elements) {
+  auto init = llvm::ConstantDataArray::get(*session.TheContext, elements);
+  return defineGlobalVariable(session, init->getType(), name, init);
 }
 
-llvm::Value* emitLoadValue(llvm::Value *value) {
+// A constant global array of `elemType` holding the contents of the file at
+// `path`, in the target's byte order. The file is mapped rather than read,
+// and the ConstantDataArray is built from the mapped bytes in one copy;
+// getRaw wants host-order bytes, so a cross-endian target swaps them first.
+llvm::GlobalVariable* defineGlobalFromFile(EmitSession &session, std::string name, llvm::Type *elemType,
+                                           const std::string &path) {
+  if (!llvm::ConstantDataSequential::isElementTypeCompatible(elemType)) {
+    ExitOnErr(llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                      "cannot embed " + path + ": unsupported element type"));
+  }
+  auto buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    ExitOnErr(llvm::createFileError(path, buffer.getError()));
+  }
+
+  auto data = (*buffer)->getBuffer();
+  uint64_t elemSize = elemType->getPrimitiveSizeInBits() / 8;
+  if (data.size() % elemSize != 0) {
+    ExitOnErr(llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                      "cannot embed " + path + ": size is not a multiple of the element size"));
+  }
+
+  std::string swapped;
+  if (elemSize > 1 && llvm::Triple(session.TheModule->getTargetTriple()).isLittleEndian() != llvm::sys::IsLittleEndianHost) {
+    swapped = data.str();
+    for (size_t i = 0; i < swapped.size(); i += elemSize) {
+      std::reverse(swapped.begin() + i, swapped.begin() + i + elemSize);
+    }
+    data = swapped;
+  }
+
+  auto init = llvm::ConstantDataArray::getRaw(data, data.size() / elemSize, elemType);
+  auto globalVar = defineGlobalVariable(session, init->getType(), name, init);
+  globalVar->setConstant(true);
+  return globalVar;
+}
+
+// A load is only available in the block it was emitted in, so start over
+// whenever the builder has moved on to another block.
+static void syncAvailableLoadsBlock(EmitSession &session) {
+  auto block = session.Builder->GetInsertBlock();
+  if (block != session.availableLoadsBlock) {
+    session.availableLoads.clear();
+    session.availableLoadsBlock = block;
+  }
+}
+
+// The cached value of `address`, or null.
+static llvm::Value* findAvailableLoad(EmitSession &session, llvm::Value *address) {
+  syncAvailableLoadsBlock(session);
+  return session.availableLoads.lookup(address);
+}
+
+llvm::Value* emitLoadValue(EmitSession &session, llvm::GlobalVariable *value) {
+  if (auto available = findAvailableLoad(session, value)) {
+    return available;
+  }
+  auto load = session.Builder->CreateLoad(value->getInitializer()->getType(), value);
+  session.availableLoads[value] = load;
+  return load;
+}
+
+llvm::Value* emitLoadValue(EmitSession &session, llvm::Value *value) {
+  if (auto available = findAvailableLoad(session, value)) {
+    return available;
+  }
   auto baseType = value->getType()->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, value);
+  auto load = session.Builder->CreateLoad(baseType, value);
+  session.availableLoads[value] = load;
+  return load;
 }
 
-llvm::Value* emitLoadGlobalVar(std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  auto rValue = emitLoadValue(globalVar);
+llvm::Value* emitLoadGlobalVar(EmitSession &session, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  auto rValue = emitLoadValue(session, globalVar);
   return rValue;
 }
 
-void emitAssign(llvm::Value *left, llvm::Value *right) {
-  Builder->CreateStore(right, left);
+void emitAssign(EmitSession &session, llvm::Value *left, llvm::Value *right) {
+  // The store drops every cached load, since `left` may alias any of them,
+  // but reading `left` back gives `right`.
+  syncAvailableLoadsBlock(session);
+  session.Builder->CreateStore(right, left);
+  session.availableLoads[left] = right;
 }
 
-void emitStoreGlobalVar(llvm::Value *value, std::string name) {
-  auto globalVar = TheModule->getGlobalVariable(name);
-  emitAssign(globalVar, value);
+void emitStoreGlobalVar(EmitSession &session, llvm::Value *value, std::string name) {
+  auto globalVar = session.TheModule->getGlobalVariable(name);
+  emitAssign(session, globalVar, value);
 }
 
-llvm::Value* emitStackLocalVariable(llvm::Type *type, std::string name) {
-  return Builder->CreateAlloca(type, nullptr, name);
+llvm::Value* emitStackLocalVariable(EmitSession &session, llvm::Type *type, std::string name) {
+  return session.Builder->CreateAlloca(type, nullptr, name);
 }
 
-void emitConstant(llvm::Type *ty, std::string name, llvm::Constant *init) {
+llvm::GlobalVariable* emitConstant(EmitSession &session, llvm::Type *ty, std::string name, llvm::Constant *init) {
   // private constant format: @__constant.function_name.variable_name
-  auto currentFunction = Builder->GetInsertBlock()->getParent();
+  auto currentFunction = session.Builder->GetInsertBlock()->getParent();
   std::string funcName = currentFunction->getName().data();
   std::string constVarName = "__constant." + funcName + "."+ name;
 
-  auto constantVar = defineGlobalVariable(ty, constVarName, init);
+  auto constantVar = defineGlobalVariable(session, ty, constVarName, init);
 
   constantVar->setConstant(true);
   constantVar->setLinkage(llvm::GlobalValue::LinkageTypes::PrivateLinkage);
+  return constantVar;
+}
+
+// A global of `type` with every byte zero. The zeroinitializer is one
+// constant whatever the size, where a ConstantArray would hold one per element.
+llvm::GlobalVariable* defineZeroGlobalVariable(EmitSession &session, llvm::Type *type, std::string name) {
+  return defineGlobalVariable(session, type, name, llvm::ConstantAggregateZero::get(type));
+}
+
+// Aggregates with at most this many scalar elements are initialized with one
+// store per element, larger ones with a single memset or memcpy.
+static const unsigned MaxInitStores = 4;
+
+static bool isInitializedByStores(llvm::Constant *init) {
+  auto type = init->getType();
+  if (!type->isAggregateType()) {
+    return true;
+  }
+  unsigned count = type->isStructTy() ? type->getStructNumElements() : type->getArrayNumElements();
+  if (count > MaxInitStores) {
+    return false;
+  }
+  for (unsigned i = 0; i < count; ++i) {
+    if (init->getAggregateElement(i)->getType()->isAggregateType()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// type name = init; on the stack. All-zero data is a memset, other large
+// data a memcpy from a private constant template, @__constant.<fn>.<name>.
+//
+// Until the module is compiled its DataLayout may still be LLVM's generic
+// one, so nothing here bakes in a size from it: the length is a sizeof
+// constant expression, folded once the target's layout is known, and the
+// alignment is whatever the alloca itself was given.
+llvm::Value* emitInitializedLocalVariable(EmitSession &session, llvm::Type *type, std::string name,
+                                          llvm::Constant *init) {
+  auto addr = session.Builder->CreateAlloca(type, nullptr, name);
+  auto size = llvm::ConstantExpr::getSizeOf(type);
+  auto align = addr->getAlign();
+
+  if (!type->isAggregateType()) {
+    session.Builder->CreateStore(init, addr);
+  } else if (isInitializedByStores(init)) {
+    unsigned count = type->isStructTy() ? type->getStructNumElements() : type->getArrayNumElements();
+    for (unsigned i = 0; i < count; ++i) {
+      auto elementAddr = getAggregateElementAddr(session, i, addr);
+      session.Builder->CreateStore(init->getAggregateElement(i), elementAddr);
+    }
+  } else if (init->isNullValue()) {
+    session.Builder->CreateMemSet(addr, session.Builder->getInt8(0), size, align);
+  } else {
+    auto source = emitConstant(session, type, name, init);
+    source->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+    source->setAlignment(align);
+    session.Builder->CreateMemCpy(addr, align, source, align, size);
+  }
+  return addr;
 }
 
-llvm::Constant* emitStringPtr(std::string content, std::string name) {
-  auto strPtr = Builder->CreateGlobalString(content, "." + name);
+llvm::Constant* emitStringPtr(EmitSession &session, std::string content, std::string name) {
+  auto &pool = session.stringPool;
+  auto found = pool.strings.find(content);
+  if (found != pool.strings.end()) {
+    return found->second;
+  }
+
+  llvm::Constant *strPtr;
+  if (!PackStrings) {
+    strPtr = session.Builder->CreateGlobalString(content, "." + name);
+  } else {
+    // Point at the string's offset in the blob, typed as its own array so
+    // callers see the same [N x i8]* either way.
+    auto i8Type = session.Builder->getInt8Ty();
+    if (pool.placeholder == nullptr) {
+      pool.placeholder = new llvm::GlobalVariable(*session.TheModule, i8Type, true,
+                                                  llvm::GlobalValue::ExternalLinkage, nullptr,
+                                                  ".strings.placeholder");
+    }
+    auto arrayType = llvm::ArrayType::get(i8Type, content.size() + 1);
+    auto offset = session.Builder->getInt64(pool.packed.size());
+    auto element = llvm::ConstantExpr::getGetElementPtr(i8Type, pool.placeholder, offset);
+    strPtr = llvm::ConstantExpr::getBitCast(element, arrayType->getPointerTo());
+    pool.packed += content;
+    pool.packed.push_back('\0');
+  }
+
+  pool.strings[content] = strPtr;
   return strPtr;
 }
 
-void emitIntegers() {
+// Create the blob holding every packed string and point the strings at it.
+void finalizeStringPool(EmitSession &session) {
+  auto &pool = session.stringPool;
+  if (pool.placeholder == nullptr) {
+    return;
+  }
+
+  auto init = llvm::ConstantDataArray::getString(*session.TheContext, pool.packed, false);
+  auto blob = new llvm::GlobalVariable(*session.TheModule, init->getType(), true,
+                                       llvm::GlobalValue::PrivateLinkage, init, ".strings");
+  blob->setUnnamedAddr(llvm::GlobalValue::UnnamedAddr::Global);
+  blob->setAlignment(llvm::Align(1));
+
+  pool.placeholder->replaceAllUsesWith(
+    llvm::ConstantExpr::getBitCast(blob, session.Builder->getInt8PtrTy()));
+  pool.placeholder->eraseFromParent();
+  pool.placeholder = nullptr;
+  // The pooled pointers were expressions on the placeholder, destroyed along
+  // with it. Strings emitted after this start a pool of their own.
+  pool.strings.clear();
+  pool.packed.clear();
+}
+
+void emitIntegers(EmitSession &session) {
   // int start = 1;
-  defineGlobalVariable("start", Builder->getInt32(1));
+  defineGlobalVariable(session, "start", session.Builder->getInt32(1));
   // int end = 10;
-  defineGlobalVariable("end", Builder->getInt32(10));
+  defineGlobalVariable(session, "end", session.Builder->getInt32(10));
   // int result = 0;
-  defineGlobalVariable("result", Builder->getInt32(0));
+  defineGlobalVariable(session, "result", session.Builder->getInt32(0));
 }
 
-void emitFloats() {
+void emitFloats(EmitSession &session) {
   // float f = 1.0;
-  defineGlobalVariable(Builder->getFloatTy(), "f", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, session.Builder->getFloatTy(), "f", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // double d = 2.0
-  defineGlobalVariable(Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(Builder->getDoubleTy(), 2.0));
+  defineGlobalVariable(session, session.Builder->getDoubleTy(), "df",llvm:: ConstantFP::get(session.Builder->getDoubleTy(), 2.0));
   
   //long double ld = 3.0;
-  auto ldType = llvm::Type::getX86_FP80Ty(*TheContext);
-  defineGlobalVariable(ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
+  auto ldType = llvm::Type::getX86_FP80Ty(*session.TheContext);
+  defineGlobalVariable(session, ldType, "ld", llvm::ConstantFP::get(ldType, 3.0));
 
   // float f_1 = 1.0;
-  defineGlobalVariable("f_1", llvm::ConstantFP::get(Builder->getFloatTy(), 1.0));
+  defineGlobalVariable(session, "f_1", llvm::ConstantFP::get(session.Builder->getFloatTy(), 1.0));
   
   // float f_2 = 2.0
-  defineGlobalVariable("f_2", llvm::ConstantFP::get(Builder->getFloatTy(), 2.0));
+  defineGlobalVariable(session, "f_2", llvm::ConstantFP::get(session.Builder->getFloatTy(), 2.0));
 }
 
 // int arr[] = { 1, 2, 3, 4 };
-void emitArray() {
+void emitArray(EmitSession &session) {
   // int arr[4];
-  int num = 4;
-  llvm::Type *ty = Builder->getInt32Ty();
-  llvm::ArrayType *arrType = llvm::ArrayType::get(ty, num);
-
-  llvm::SmallVector<llvm::Constant *, 16> list;
-  list.reserve(num);
-  list.push_back(Builder->getInt32(1));
-  list.push_back(Builder->getInt32(2));
-  list.push_back(Builder->getInt32(3));
-  list.push_back(Builder->getInt32(4));
-
-  llvm::Constant *c = llvm::ConstantArray::get(arrType, list);
-
-  defineGlobalVariable(arrType, "arr", c);
+  defineGlobalArray<int32_t>(session, "arr", { 1, 2, 3, 4 });
 }
 
 /**
  * struct point { int x; int y; };
  * struct point point = { 1, 2 };
  */
-void emitStruct() {
+void emitStruct(EmitSession &session) {
   // struct point { int x; int y; }
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "struct.point");
-  structTy->setBody({Builder->getInt32Ty(), Builder->getInt32Ty()});
+  llvm::StructType *structTy = emitPointType(session);
 
   // struct point  = { 11, 12 }
   int num = 2;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(11));
-  list.push_back(Builder->getInt32(12));
+  list.push_back(session.Builder->getInt32(11));
+  list.push_back(session.Builder->getInt32(12));
   
-  llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
+  llvm::Constant *c = session.typeRegistry.getConstant(PointType, list);
 
-  defineGlobalVariable(structTy, "pointer", c);
+  defineGlobalVariable(session, structTy, "pointer", c);
 }
 
-llvm::Value* emitPoint() {
-  auto *point_ty = llvm::StructType::getTypeByName(*TheContext, "struct.point");  
-  // struct point p;
-  auto tmp_p = Builder->CreateAlloca(point_ty, nullptr, "param_p");
-  // p.x = 10;
-  auto p_x = getStructElementAddr(0, tmp_p);
-  Builder->CreateStore(Builder->getInt32(10), p_x);
-  // p.y = 20;
-  auto p_y = getStructElementAddr(1, tmp_p);
-  Builder->CreateStore(Builder->getInt32(20), p_y);
-  return tmp_p;
+llvm::Value* emitPoint(EmitSession &session) {
+  auto *point_ty = session.typeRegistry.get(PointType);
+  // struct point p = { 10, 20 };
+  auto init = session.typeRegistry.getConstant(PointType, { session.Builder->getInt32(10), session.Builder->getInt32(20) });
+  return emitInitializedLocalVariable(session, point_ty, "param_p", init);
 }
 
 /**
  * union ab  {  int a;  float b; };
  * union ab u = { 1 };
  */
-void emitUnion() {
+void emitUnion(EmitSession &session) {
   // union ab  {  int a;  float b; };
-  llvm::StructType *structTy = llvm::StructType::create(*TheContext, "union.ab");
-  structTy->setBody(Builder->getInt32Ty());
+  llvm::StructType *structTy = session.typeRegistry.define(UnionABType, *session.TheContext, "union.ab",
+                                                           { session.Builder->getInt32Ty() });
 
   // union ab u = { 1 };
   int num = 1;
   llvm::SmallVector<llvm::Constant *, 16> list;
   list.reserve(num);
-  list.push_back(Builder->getInt32(1));
+  list.push_back(session.Builder->getInt32(1));
 
   llvm::Constant *c = llvm::ConstantStruct::get(structTy, list);
-  defineGlobalVariable(structTy, "u", c);
+  defineGlobalVariable(session, structTy, "u", c);
 }
 
-void emitPointer() {
+void emitPointer(EmitSession &session) {
   // int *i_p;
-  auto pointerTy = llvm::PointerType::get(Builder->getInt32Ty(), 0);
+  auto pointerTy = llvm::PointerType::get(session.Builder->getInt32Ty(), 0);
   auto c = llvm::Constant::getNullValue(pointerTy);
-  defineGlobalVariable(pointerTy, "i_p", c);
+  defineGlobalVariable(session, pointerTy, "i_p", c);
 
   // char *c_p;
-  auto charPtrTy = llvm::PointerType::get(Builder->getInt8Ty(), 0);
+  auto charPtrTy = llvm::PointerType::get(session.Builder->getInt8Ty(), 0);
   auto cCharPtr = llvm::Constant::getNullValue(charPtrTy);
-  defineGlobalVariable(charPtrTy, "c_p", cCharPtr);
+  defineGlobalVariable(session, charPtrTy, "c_p", cCharPtr);
 }
 
 // char *str = "hello\n";
-void emitConstString() {
-  emitStringPtr("hello", "str");
+void emitConstString(EmitSession &session) {
+  emitStringPtr(session, "hello", "str");
 }
 
-llvm::Value* genIncrement(llvm::Value *left, int step) {
+llvm::Value* genIncrement(EmitSession &session, llvm::Value *left, int step) {
   // Temporary variables/Registers
   auto type = left->getType()->getNonOpaquePointerElementType();
-  auto valueL = Builder->CreateLoad(type, left);
-  auto valueR = Builder->getInt32(step);
-  auto value = Builder->CreateNSWAdd(valueL, valueR);
+  auto valueL = session.Builder->CreateLoad(type, left);
+  auto valueR = session.Builder->getInt32(step);
+  auto value = session.Builder->CreateNSWAdd(valueL, valueR);
   return value;
 }
 
-llvm::Value *getRValue(llvm::Value *value, llvm::Type *type) {
-  auto address = Builder->CreateLoad(type, value);
+llvm::Value *getRValue(EmitSession &session, llvm::Value *value, llvm::Type *type) {
+  auto address = session.Builder->CreateLoad(type, value);
   auto baseType = type->getNonOpaquePointerElementType();
-  return Builder->CreateLoad(baseType, address);
+  return session.Builder->CreateLoad(baseType, address);
 }
 
-llvm::Value *getElementAddr(llvm::Value *arrAddr, llvm::Value *indexAddr) {
+llvm::Value *getElementAddr(EmitSession &session, llvm::Value *arrAddr, llvm::Value *indexAddr) {
   auto ty = arrAddr->getType()->getNonOpaquePointerElementType();
   auto *baseType = ty->getNonOpaquePointerElementType();
-  auto arr = Builder->CreateLoad(ty, arrAddr);
+  auto arr = session.Builder->CreateLoad(ty, arrAddr);
 
   auto indexType = indexAddr->getType()->getNonOpaquePointerElementType();
-  auto indexValue = Builder->CreateLoad(indexType, indexAddr);
-  auto indexTy64Value = Builder->CreateSExt(indexValue, Builder->getInt64Ty());
+  auto indexValue = session.Builder->CreateLoad(indexType, indexAddr);
+  auto indexTy64Value = session.Builder->CreateSExt(indexValue, session.Builder->getInt64Ty());
 
   std::vector<llvm::Value *> IndexValues;
   IndexValues.push_back(indexTy64Value);
-  llvm::Value *target = Builder->CreateInBoundsGEP(arr->getType()->getNonOpaquePointerElementType(), arr, IndexValues);
+  llvm::Value *target = session.Builder->CreateInBoundsGEP(arr->getType()->getNonOpaquePointerElementType(), arr, IndexValues);
 
   return target;
 }
 
 /// Return the value offset.
-static llvm::Constant *getStructOffset(long offset) {
-  return llvm::ConstantInt::get(Builder->getInt32Ty(), offset);
+static llvm::Constant *getStructOffset(EmitSession &session, long offset) {
+  return llvm::ConstantInt::get(session.Builder->getInt32Ty(), offset);
 }
 
-llvm::Value *getStructElementAddr(int index, llvm::Value *ptrval) { 
+// Element `index` of the aggregate as laid out, with no field remapping.
+llvm::Value *getAggregateElementAddr(EmitSession &session, int index, llvm::Value *ptrval) {
   std::vector<llvm::Value *> IndexValues;
-  IndexValues.push_back(getStructOffset(0));
-  IndexValues.push_back(getStructOffset(index));
-  llvm::Value *target = Builder->CreateInBoundsGEP(ptrval->getType()->getNonOpaquePointerElementType(), ptrval, IndexValues);
+  IndexValues.push_back(getStructOffset(session, 0));
+  IndexValues.push_back(getStructOffset(session, index));
+  llvm::Value *target = session.Builder->CreateInBoundsGEP(ptrval->getType()->getNonOpaquePointerElementType(), ptrval, IndexValues);
   return target;
 }
 
-llvm::Value *getStructElementRValue(llvm::Value *structAlloca, int index) {
+// Field `index` in declared order, wherever --struct-layout put it.
+llvm::Value *getStructElementAddr(EmitSession &session, int index, llvm::Value *ptrval) { 
+  auto structType = llvm::dyn_cast<llvm::StructType>(ptrval->getType()->getNonOpaquePointerElementType());
+  if (structType != nullptr) {
+    index = session.typeRegistry.getFieldIndex(structType, index);
+  }
+  return getAggregateElementAddr(session, index, ptrval);
+}
+
+llvm::Value *getStructElementRValue(EmitSession &session, llvm::Value *structAlloca, int index) {
   auto ty = structAlloca->getType()->getNonOpaquePointerElementType();
-  auto structAddr = Builder->CreateLoad(ty, structAlloca);
-  auto elementAddr = getStructElementAddr(index, structAddr);
+  auto structAddr = session.Builder->CreateLoad(ty, structAlloca);
+  auto elementAddr = getStructElementAddr(session, index, structAddr);
   auto structType = llvm::dyn_cast<llvm::StructType>(structAddr->getType()->getNonOpaquePointerElementType());
-  auto elementType = structType->getTypeAtIndex(index);
-  return Builder->CreateLoad(elementType, elementAddr);
+  auto elementType = structType->getTypeAtIndex(session.typeRegistry.getFieldIndex(structType, index));
+  return session.Builder->CreateLoad(elementType, elementAddr);
 }
 
-llvm::Value *getStructElementLValue(llvm::Value *structAlloca, int index) {
+llvm::Value *getStructElementLValue(EmitSession &session, llvm::Value *structAlloca, int index) {
   auto ty = structAlloca->getType()->getNonOpaquePointerElementType();
-  auto structAddr = Builder->CreateLoad(ty, structAlloca);
-  auto elementAddr = getStructElementAddr(index, structAddr);
+  auto structAddr = session.Builder->CreateLoad(ty, structAlloca);
+  auto elementAddr = getStructElementAddr(session, index, structAddr);
   return elementAddr;
 }
 
-llvm::Type* getPointerType(llvm::Type *baseType) {
+// A global array of a named struct. Stored as one [N x %struct] global, or as
+// one [N x field] global per declared field, in which case walking a single
+// field is unit stride and touches no other field's memory.
+struct StructArray {
+  NamedType type;
+  ArrayLayout layout;
+  // The array of structs, or one array per declared field.
+  std::vector<llvm::GlobalVariable *> storage;
+};
+
+// extern type name[count]; stored as --array-layout says. Arrays of structs
+// defined from a plain body have no field list to split by, so they stay
+// arrays of structs.
+StructArray declareStructArray(EmitSession &session, NamedType id, std::string name, uint64_t count) {
+  auto type = session.typeRegistry.get(id);
+  auto fields = session.typeRegistry.getFields(type);
+  StructArray array = { id, StructArrayLayout, {} };
+  if (array.layout == StructOfArrays && fields.empty()) {
+    array.layout = ArrayOfStructs;
+  }
+
+  auto declare = [&](llvm::Type *arrType, std::string arrName) {
+    session.TheModule->getOrInsertGlobal(arrName, arrType);
+    array.storage.push_back(session.TheModule->getNamedGlobal(arrName));
+  };
+  if (array.layout == ArrayOfStructs) {
+    declare(llvm::ArrayType::get(type, count), name);
+  } else {
+    for (auto &field : fields) {
+      declare(llvm::ArrayType::get(field.type, count), name + "." + field.name);
+    }
+  }
+  return array;
+}
+
+// type name[count]; zero initialized. Only one function may define the
+// array, the ones that merely use it declare it, or sharded emission would
+// link several definitions of the same symbol.
+StructArray defineStructArray(EmitSession &session, NamedType id, std::string name, uint64_t count) {
+  auto array = declareStructArray(session, id, name, count);
+  for (auto *storage : array.storage) {
+    defineZeroGlobalVariable(session, storage->getValueType(), storage->getName().str());
+  }
+  return array;
+}
+
+// &array[index].field, with `field` in declared order.
+llvm::Value *getStructArrayElementAddr(EmitSession &session, const StructArray &array, llvm::Value *index,
+                                       unsigned field) {
+  auto zero = session.Builder->getInt64(0);
+  if (array.layout == StructOfArrays) {
+    auto storage = array.storage[field];
+    return session.Builder->CreateInBoundsGEP(storage->getValueType(), storage, { zero, index });
+  }
+  auto storage = array.storage[0];
+  auto type = session.typeRegistry.get(array.type);
+  auto fieldIndex = getStructOffset(session, session.typeRegistry.getFieldIndex(type, field));
+  return session.Builder->CreateInBoundsGEP(storage->getValueType(), storage, { zero, index, fieldIndex });
+}
+
+// for (long i = 0; i < count; ++i) body(i); count must not be 0.
+void emitCountedLoop(EmitSession &session, llvm::Function *fn, uint64_t count,
+                     llvm::function_ref<void(llvm::Value *)> body) {
+  auto preheader = session.Builder->GetInsertBlock();
+  auto bodyBB = createBB(session, fn, "for.body");
+  auto endBB = createBB(session, fn, "for.end");
+  session.Builder->CreateBr(bodyBB);
+
+  session.Builder->SetInsertPoint(bodyBB);
+  auto i = session.Builder->CreatePHI(session.Builder->getInt64Ty(), 2, "i");
+  i->addIncoming(session.Builder->getInt64(0), preheader);
+  body(i);
+  auto next = session.Builder->CreateNUWAdd(i, session.Builder->getInt64(1), "i.next");
+  i->addIncoming(next, session.Builder->GetInsertBlock());
+  auto cond = session.Builder->CreateICmpULT(next, session.Builder->getInt64(count));
+  session.Builder->CreateCondBr(cond, bodyBB, endBB);
+
+  session.Builder->SetInsertPoint(endBB);
+}
+
+llvm::Type* getPointerType(EmitSession &session, llvm::Type *baseType) {
   return llvm::PointerType::get(baseType, 0);
 }
 
 /// Return the value offset.
-llvm::Constant *getOffset(long offset) {
-  return llvm::ConstantInt::get(Builder->getInt64Ty(), offset);
+llvm::Constant *getOffset(EmitSession &session, long offset) {
+  return llvm::ConstantInt::get(session.Builder->getInt64Ty(), offset);
 }
 
-llvm::Value *gen_get_member_ptr(int index, llvm::Value *ptrval) { 
+llvm::Value *gen_get_member_ptr(EmitSession &session, int index, llvm::Value *ptrval) { 
   std::vector<llvm::Value *> IndexValues;
-  IndexValues.push_back(getOffset(0));
-  IndexValues.push_back(getOffset(index));
-  llvm::Value *target = Builder->CreateInBoundsGEP(ptrval->getType()->getNonOpaquePointerElementType(), ptrval, IndexValues);
+  IndexValues.push_back(getOffset(session, 0));
+  IndexValues.push_back(getOffset(session, index));
+  llvm::Value *target = session.Builder->CreateInBoundsGEP(ptrval->getType()->getNonOpaquePointerElementType(), ptrval, IndexValues);
   return target;
 }
 
-llvm::Value* emitMainStatementList(llvm::Function *fn) {
+llvm::Value* emitMainStatementList(EmitSession &session, llvm::Function *fn) {
+  if (PointArray > 0) {
+    // struct point points[N]; init_points(); return sum_points_x();
+    defineStructArray(session, PointType, "points", PointArray);
+    emitCall(session, "init_points", {});
+    return emitCall(session, "sum_points_x", {});
+  }
+
   // &point
-  auto pointAddr = emitPoint();
+  auto pointAddr = emitPoint(session);
+
+  if (StructByValue) {
+    // return swap_point(point).x;
+    auto swapped = emitCall(session, "swap_point", { pointAddr });
+    auto swappedX = getStructElementAddr(session, 0, swapped);
+    return session.Builder->CreateLoad(fn->getReturnType(), swappedX);
+  }
   std::vector<llvm::Value*> argsV;
   argsV.push_back(pointAddr);
 
   // swap_struct(&point);
-  auto targetFn = TheModule->getFunction("swap_struct");
-  Builder->CreateCall(targetFn, argsV);
+  auto targetFn = declareFunction(session, "swap_struct");
+  session.Builder->CreateCall(targetFn, argsV);
 
   // return point.x;
-  auto pointX = getStructElementAddr(0, pointAddr);
-  auto result = Builder->CreateLoad(fn->getReturnType(), pointX);
+  auto pointX = getStructElementAddr(session, 0, pointAddr);
+  auto result = session.Builder->CreateLoad(fn->getReturnType(), pointX);
   return result;
 }
 
-llvm::Value* emitSumStatementList(llvm::Function *fn) {
+llvm::Value* emitSumStatementList(EmitSession &session, llvm::Function *fn) {
   // alloca params
-  auto ty = Builder->getInt32Ty();
-  auto tmpX = Builder->CreateAlloca(ty);
-  auto tmpY = Builder->CreateAlloca(ty);
+  auto ty = session.Builder->getInt32Ty();
+  auto tmpX = session.Builder->CreateAlloca(ty);
+  auto tmpY = session.Builder->CreateAlloca(ty);
 
   // store params to stack
   auto AI = fn->arg_begin();
   auto argX = AI++;
   auto argY = AI;
-  Builder->CreateStore(argX, tmpX);
-  Builder->CreateStore(argY, tmpY);
+  session.Builder->CreateStore(argX, tmpX);
+  session.Builder->CreateStore(argY, tmpY);
 
   // printf("result:%d\n", result);
-  auto str = emitStringPtr("result:%d\n", "str");
-  auto result = emitLoadGlobalVar("result");
+  auto str = emitStringPtr(session, "result:%d\n", "str");
+  auto result = emitLoadGlobalVar(session, "result");
   
   std::vector<llvm::Value *> indexValues;
-  indexValues.push_back(Builder->getInt64(0));
-  indexValues.push_back(Builder->getInt64(0));
-  auto strAddr = Builder->CreateInBoundsGEP(str->getType()->getNonOpaquePointerElementType(),
+  indexValues.push_back(session.Builder->getInt64(0));
+  indexValues.push_back(session.Builder->getInt64(0));
+  auto strAddr = session.Builder->CreateInBoundsGEP(str->getType()->getNonOpaquePointerElementType(),
     str, 
     indexValues 
   );
   std::vector<llvm::Value *> argsV;
   argsV.push_back(strAddr),
   argsV.push_back(result);
-  auto printfFn = TheModule->getFunction("printf");
-  Builder->CreateCall(printfFn, argsV);
+  auto printfFn = declareFunction(session, "printf");
+  session.Builder->CreateCall(printfFn, argsV);
   // x + y;
-  auto valueL = Builder->CreateLoad(ty, tmpX);
-  auto valueR = Builder->CreateLoad(ty, tmpY);
+  auto valueL = session.Builder->CreateLoad(ty, tmpX);
+  auto valueR = session.Builder->CreateLoad(ty, tmpY);
 
-  auto value = Builder->CreateNSWAdd(valueL, valueR);
+  auto value = session.Builder->CreateNSWAdd(valueL, valueR);
   // return result;
   return value;
 }
 
-llvm::Value *emitSwapPtrStatementList(llvm::Function *fn) {
+llvm::Value *emitSwapPtrStatementList(EmitSession &session, llvm::Function *fn) {
     // alloca params
-  auto baseType = Builder->getInt32Ty();
-  auto ty = getPointerType(baseType);
+  auto baseType = session.Builder->getInt32Ty();
+  auto ty = getPointerType(session, baseType);
   // int *alloca_x, *alloca_y;
-  auto *tmpX = Builder->CreateAlloca(ty, nullptr, "param_x");
-  auto *tmpY = Builder->CreateAlloca(ty, nullptr, "param_y");
+  auto *tmpX = session.Builder->CreateAlloca(ty, nullptr, "param_x");
+  auto *tmpY = session.Builder->CreateAlloca(ty, nullptr, "param_y");
   // int temp
-  auto temp = Builder->CreateAlloca(baseType, nullptr, "temp");
+  auto temp = session.Builder->CreateAlloca(baseType, nullptr, "temp");
 
   // store args on stack
   auto AI = fn->arg_begin();
   auto argX = AI++;
   auto argY = AI;
-  Builder->CreateStore(argX, tmpX);
-  Builder->CreateStore(argY, tmpY);
+  session.Builder->CreateStore(argX, tmpX);
+  session.Builder->CreateStore(argY, tmpY);
 
   // get r-value of *x;
-  auto xValue = getRValue(tmpX, ty);
+  auto xValue = getRValue(session, tmpX, ty);
   // temp = *x;
-  Builder->CreateStore(xValue, temp);
+  session.Builder->CreateStore(xValue, temp);
 
   // get r-value of *y
-  auto yValue = getRValue(tmpY, ty);
+  auto yValue = getRValue(session, tmpY, ty);
   // get l-value of *x
-  auto xAddress = Builder->CreateLoad(ty, tmpX);
+  auto xAddress = session.Builder->CreateLoad(ty, tmpX);
   // *x = *y
-  Builder->CreateStore(yValue, xAddress);
+  session.Builder->CreateStore(yValue, xAddress);
 
   // *y = temp
-  auto tempValue = Builder->CreateLoad(baseType, temp);
-  auto yAddress = Builder->CreateLoad(ty, tmpY);
-  Builder->CreateStore(tempValue, yAddress);
+  auto tempValue = session.Builder->CreateLoad(baseType, temp);
+  auto yAddress = session.Builder->CreateLoad(ty, tmpY);
+  session.Builder->CreateStore(tempValue, yAddress);
 
   return nullptr;
 }
-llvm::Value *emitSwapArrayStatementList(llvm::Function *fn) {
+llvm::Value *emitSwapArrayStatementList(EmitSession &session, llvm::Function *fn) {
     // alloca params
-  auto baseType = Builder->getInt32Ty();
-  auto ty = getPointerType(baseType);
+  auto baseType = session.Builder->getInt32Ty();
+  auto ty = getPointerType(session, baseType);
   // int *alloca_x, *alloca_y;
-  auto tmpArr = Builder->CreateAlloca(ty, nullptr, "param_arr");
-  auto tmpX = Builder->CreateAlloca(baseType, nullptr, "param_x");
-  auto tmpY = Builder->CreateAlloca(baseType, nullptr, "param_y");
+  auto tmpArr = session.Builder->CreateAlloca(ty, nullptr, "param_arr");
+  auto tmpX = session.Builder->CreateAlloca(baseType, nullptr, "param_x");
+  auto tmpY = session.Builder->CreateAlloca(baseType, nullptr, "param_y");
   // int temp
-  auto temp = Builder->CreateAlloca(baseType, nullptr, "temp");
+  auto temp = session.Builder->CreateAlloca(baseType, nullptr, "temp");
 
   // store args on stack
   auto AI = fn->arg_begin();
   auto argArr = AI++;
   auto argX = AI++;
   auto argY = AI;
-  Builder->CreateStore(argArr, tmpArr);
-  Builder->CreateStore(argY, tmpY);
-  Builder->CreateStore(argX, tmpX);
+  session.Builder->CreateStore(argArr, tmpArr);
+  session.Builder->CreateStore(argY, tmpY);
+  session.Builder->CreateStore(argX, tmpX);
   
   // get l-value of arr[x]
-  auto arr_x_addr = getElementAddr(tmpArr, tmpX);
+  auto arr_x_addr = getElementAddr(session, tmpArr, tmpX);
   // get r-value of arr[x]
-  auto arr_x_value = Builder->CreateLoad(baseType, arr_x_addr);
+  auto arr_x_value = session.Builder->CreateLoad(baseType, arr_x_addr);
   // temp = arr[x]
-  Builder->CreateStore(arr_x_value, temp);
+  session.Builder->CreateStore(arr_x_value, temp);
 
   // get r-value of arr[y]
-  auto arr_y_addr = getElementAddr(tmpArr, tmpY);
-  auto arr_y_value = Builder->CreateLoad(baseType, arr_y_addr);
+  auto arr_y_addr = getElementAddr(session, tmpArr, tmpY);
+  auto arr_y_value = session.Builder->CreateLoad(baseType, arr_y_addr);
   // get l-value of arr[x]
-  auto arr_x_addr_1 = getElementAddr(tmpArr, tmpX);
+  auto arr_x_addr_1 = getElementAddr(session, tmpArr, tmpX);
   // arr[x] = arr[y]
-  Builder->CreateStore(arr_y_value, arr_x_addr_1);
+  session.Builder->CreateStore(arr_y_value, arr_x_addr_1);
 
   // arr[y] = temp
-  auto temp_value = Builder->CreateLoad(baseType, temp);
+  auto temp_value = session.Builder->CreateLoad(baseType, temp);
   // get l-value of arr[y]
-  auto arr_y_addr_1 = getElementAddr(tmpArr, tmpY);
-  Builder->CreateStore(temp_value, arr_y_addr_1);
+  auto arr_y_addr_1 = getElementAddr(session, tmpArr, tmpY);
+  session.Builder->CreateStore(temp_value, arr_y_addr_1);
   return nullptr;
 }
 
-llvm::Value* emitSwapPointStatementList(llvm::Function *fn) {
+llvm::Value* emitSwapPointStatementList(EmitSession &session, llvm::Function *fn) {
   // alloca params
-  auto baseType = Builder->getInt32Ty();
-  auto ty = llvm::StructType::getTypeByName(*TheContext, "struct.point");
+  auto baseType = session.Builder->getInt32Ty();
+  auto ty = session.typeRegistry.get(PointType);
 
   // struct *alloca_p;
-  auto *tmpP = Builder->CreateAlloca(getPointerType(ty), nullptr, "param_p");
+  auto *tmpP = session.Builder->CreateAlloca(getPointerType(session, ty), nullptr, "param_p");
   // int temp;
-  auto temp = Builder->CreateAlloca(baseType, nullptr, "temp");
+  auto temp = session.Builder->CreateAlloca(baseType, nullptr, "temp");
 
   // store args on stack
   auto AI = fn->arg_begin();
   auto arg_1 = AI++;
-  Builder->CreateStore(arg_1, tmpP);
+  session.Builder->CreateStore(arg_1, tmpP);
 
   // get r-value of pointer->x
-  auto p_x_rvalue = getStructElementRValue(tmpP, 0);
+  auto p_x_rvalue = getStructElementRValue(session, tmpP, 0);
 
   // temp = p.x
-  Builder->CreateStore(p_x_rvalue, temp);
+  session.Builder->CreateStore(p_x_rvalue, temp);
 
   // get r-value of pointer->y
-  auto p_y_rvalue = getStructElementRValue(tmpP, 1);
+  auto p_y_rvalue = getStructElementRValue(session, tmpP, 1);
 
   // get l-value of pointer->x
-  auto p_x_lvalue = getStructElementLValue(tmpP, 0);
+  auto p_x_lvalue = getStructElementLValue(session, tmpP, 0);
 
   // p->x = p->y
-  Builder->CreateStore(p_y_rvalue, p_x_lvalue);
+  session.Builder->CreateStore(p_y_rvalue, p_x_lvalue);
 
   // get r-value of temp
-  auto temp_rvalue = Builder->CreateLoad(baseType, temp);
+  auto temp_rvalue = session.Builder->CreateLoad(baseType, temp);
 
   // get l-value of p->y
-  auto p_y_lvalue = getStructElementLValue(tmpP, 1);
+  auto p_y_lvalue = getStructElementLValue(session, tmpP, 1);
 
   // temp = p->y
-  Builder->CreateStore(temp_rvalue, p_y_lvalue);
+  session.Builder->CreateStore(temp_rvalue, p_y_lvalue);
 
   return nullptr;
 }
 
-void emitProgram() {
-  declareFunction("printf");
+// struct point swap_point(struct point p) { struct point r = { p.y, p.x }; return r; }
+llvm::Value* emitSwapPointByValueStatementList(EmitSession &session, llvm::Function *fn) {
+  auto baseType = session.Builder->getInt32Ty();
+  auto p = emitParamAlloca(session, fn, 0, "param_p");
+  auto r = emitResultAlloca(session, fn, "r");
+
+  auto p_y = session.Builder->CreateLoad(baseType, getStructElementAddr(session, 1, p));
+  session.Builder->CreateStore(p_y, getStructElementAddr(session, 0, r));
+  auto p_x = session.Builder->CreateLoad(baseType, getStructElementAddr(session, 0, p));
+  session.Builder->CreateStore(p_x, getStructElementAddr(session, 1, r));
+  return r;
+}
 
-  declareFunction("swap_struct");
-  defineFunction("swap_struct");
+// extern struct point points[N];
+// void init_points() { for (long i = 0; i < N; ++i) { points[i].x = i; points[i].y = 2 * i; } }
+llvm::Value* emitInitPointsStatementList(EmitSession &session, llvm::Function *fn) {
+  auto points = declareStructArray(session, PointType, "points", PointArray);
+  emitCountedLoop(session, fn, PointArray, [&](llvm::Value *i) {
+    auto value = session.Builder->CreateTrunc(i, session.Builder->getInt32Ty());
+    session.Builder->CreateStore(value, getStructArrayElementAddr(session, points, i, 0));
+    auto doubled = session.Builder->CreateShl(value, 1);
+    session.Builder->CreateStore(doubled, getStructArrayElementAddr(session, points, i, 1));
+  });
+  return nullptr;
+}
 
-  declareFunction("main");
-  defineFunction("main");
+// int sum_points_x() { int sum = 0; for (long i = 0; i < N; ++i) sum += points[i].x; return sum; }
+llvm::Value* emitSumPointsXStatementList(EmitSession &session, llvm::Function *fn) {
+  auto baseType = session.Builder->getInt32Ty();
+  auto points = declareStructArray(session, PointType, "points", PointArray);
+  auto sum = session.Builder->CreateAlloca(baseType, nullptr, "sum");
+  session.Builder->CreateStore(session.Builder->getInt32(0), sum);
+  emitCountedLoop(session, fn, PointArray, [&](llvm::Value *i) {
+    auto x = session.Builder->CreateLoad(baseType, getStructArrayElementAddr(session, points, i, 0));
+    auto partial = session.Builder->CreateLoad(baseType, sum);
+    session.Builder->CreateStore(session.Builder->CreateAdd(partial, x), sum);
+  });
+  return session.Builder->CreateLoad(baseType, sum);
+}
+
+static const char *getStructLayoutName(StructLayoutPolicy policy) {
+  switch (policy) {
+  case LayoutDeclared: return "declared";
+  case LayoutMinPadding: return "min-padding";
+  case LayoutHotFirst: return "hot-first";
+  }
+  llvm_unreachable("unknown struct layout");
+}
+
+// Size, alignment and padding of every struct.* type under the module's data
+// layout, one line per field and hole in memory order:
+//
+//   struct.point: 8 bytes, align 4, 0 bytes padding (declared)
+//     offset  size  field
+//          0     4  x i32
+//          4     4  y i32
+static void reportStructLayouts(EmitSession &session, llvm::raw_ostream &out) {
+  auto &dataLayout = session.TheModule->getDataLayout();
+  for (auto *type : session.TheModule->getIdentifiedStructTypes()) {
+    if (!type->getName().startswith("struct.") || type->isOpaque()) {
+      continue;
+    }
+    auto *layout = dataLayout.getStructLayout(type);
+    auto fields = session.typeRegistry.getFields(type);
+
+    // Declared field names in the type's own order.
+    std::vector<std::string> names(type->getNumElements());
+    for (unsigned i = 0; i < names.size(); ++i) {
+      names[i] = "#" + std::to_string(i);
+    }
+    for (unsigned i = 0; i < fields.size(); ++i) {
+      names[session.typeRegistry.getFieldIndex(type, i)] = fields[i].name;
+    }
+    std::vector<bool> hot(type->getNumElements(), false);
+    for (unsigned i = 0; i < fields.size(); ++i) {
+      hot[session.typeRegistry.getFieldIndex(type, i)] = fields[i].hot;
+    }
+
+    uint64_t used = 0;
+    for (auto *element : type->elements()) {
+      used += dataLayout.getTypeAllocSize(element);
+    }
+    uint64_t size = layout->getSizeInBytes();
+    out << type->getName() << ": " << size << " bytes, align " << layout->getAlignment().value()
+        << ", " << size - used << " bytes padding (" << getStructLayoutName(session.typeRegistry.getPolicy(type)) << ")\n";
+    out << "    offset  size  field\n";
+
+    uint64_t end = 0;
+    auto printHole = [&](uint64_t offset) {
+      if (offset > end) {
+        out << llvm::format("  %8llu  %4llu  <padding>\n", end, offset - end);
+      }
+    };
+    for (unsigned i = 0; i < type->getNumElements(); ++i) {
+      auto *element = type->getElementType(i);
+      uint64_t offset = layout->getElementOffset(i);
+      uint64_t elementSize = dataLayout.getTypeAllocSize(element);
+      printHole(offset);
+      out << llvm::format("  %8llu  %4llu  ", offset, elementSize) << names[i] << " " << *element;
+      if (hot[i] && offset + elementSize > CacheLineSize) {
+        out << "  (hot, past the first cache line)";
+      }
+      out << "\n";
+      end = offset + elementSize;
+    }
+    printHole(size);
+  }
+}
+
+// Functions the program defines, in module order. A function main calls
+// comes right after main, where emitting main's call declares it, so the
+// parallel emitter's up-front declarations keep the serial order.
+std::vector<std::string> programFunctions() {
+  std::vector<std::string> names = { "swap_struct", "main" };
+  if (StructByValue) {
+    names.insert(names.begin() + 1, "swap_point");
+  }
+  if (PointArray > 0) {
+    names.push_back("init_points");
+    names.push_back("sum_points_x");
+  }
+  for (unsigned i = 1; i <= Replicate; ++i) {
+    names.push_back("swap_struct." + std::to_string(i));
+  }
+  return names;
+}
+
+void emitProgram(EmitSession &session) {
+  declareFunction(session, "printf");
+
+  for (auto &name : programFunctions()) {
+    declareFunction(session, name);
+    defineFunction(session, name);
+  }
+  finalizeStringPool(session);
+}
+
+// Emit a slice of the program into a session of its own and return it as
+// bitcode. Callees are declared on demand by the emitters themselves.
+static void emitShard(llvm::ArrayRef<std::string> names, const std::string &targetTriple,
+                      llvm::SmallVectorImpl<char> &bitcode) {
+  EmitSession shard;
+  initializeModule(shard);
+  shard.TheModule->setTargetTriple(targetTriple);
+  if (needsTargetDataLayout()) {
+    setTargetDataLayout(shard);
+  }
+
+  registerFunctionProto(shard);
+  registerFunctionImpl(shard);
+
+  for (auto &name : names) {
+    declareFunction(shard, name);
+    defineFunction(shard, name);
+  }
+  finalizeStringPool(shard);
+
+  llvm::raw_svector_ostream out(bitcode);
+  llvm::WriteBitcodeToFile(*shard.TheModule, out);
+}
+
+void emitProgramParallel(EmitSession &session, unsigned threads) {
+  auto names = programFunctions();
+  auto targetTriple = session.TheModule->getTargetTriple();
+
+  // One contiguous slice of functions per worker. Every shard owns its
+  // context, so the workers never touch shared state.
+  size_t shardCount = std::min<size_t>(threads, names.size());
+  std::vector<llvm::SmallVector<char, 0>> shards(shardCount);
+  llvm::ThreadPool pool(llvm::hardware_concurrency(threads));
+  for (size_t i = 0; i < shardCount; ++i) {
+    size_t begin = i * names.size() / shardCount;
+    size_t end = (i + 1) * names.size() / shardCount;
+    llvm::ArrayRef<std::string> slice(names.data() + begin, end - begin);
+    pool.async([&, slice, i] { emitShard(slice, targetTriple, shards[i]); });
+  }
+  pool.wait();
+
+  // Declare everything up front, as emitProgram() would, so the linker keeps
+  // the serial symbol order and maps the shards' types onto ours.
+  declareFunction(session, "printf");
+  for (auto &name : names) {
+    declareFunction(session, name);
+  }
+
+  // Bring the shards into our context and link them in program order.
+  llvm::Linker linker(*session.TheModule);
+  for (auto &bitcode : shards) {
+    llvm::StringRef bytes(bitcode.data(), bitcode.size());
+    auto shard = ExitOnErr(llvm::parseBitcodeFile(llvm::MemoryBufferRef(bytes, "shard"), *session.TheContext));
+    if (linker.linkInModule(std::move(shard))) {
+      ExitOnErr(llvm::createStringError(llvm::inconvertibleErrorCode(), "failed to link shard"));
+    }
+  }
+}
+
+// Emit the program again, serially, and fail unless the module prints the
+// same as `session`'s, which emitProgramParallel() built.
+static void checkParallelEmission(EmitSession &session) {
+  EmitSession serial;
+  initializeModule(serial);
+  serial.TheModule->setTargetTriple(session.TheModule->getTargetTriple());
+  if (needsTargetDataLayout()) {
+    setTargetDataLayout(serial);
+  }
+  registerFunctionProto(serial);
+  registerFunctionImpl(serial);
+  emitProgram(serial);
+
+  std::string serialIR, parallelIR;
+  llvm::raw_string_ostream serialOut(serialIR), parallelOut(parallelIR);
+  serial.TheModule->print(serialOut, nullptr);
+  session.TheModule->print(parallelOut, nullptr);
+  if (serialOut.str() != parallelOut.str()) {
+    ExitOnErr(llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                      "the parallel module differs from the serial one"));
+  }
+}
+
+// Read the bodies of `root` and of everything it can reach. Functions that
+// were never reached stay unread and become declarations.
+static void materializeReachable(llvm::Module &module, llvm::StringRef root) {
+  std::vector<llvm::GlobalValue *> worklist = { module.getNamedValue(root) };
+  llvm::SmallPtrSet<llvm::GlobalValue *, 32> visited;
+  while (!worklist.empty()) {
+    auto *global = worklist.back();
+    worklist.pop_back();
+    if (global == nullptr || !visited.insert(global).second) {
+      continue;
+    }
+    ExitOnErr(global->materialize());
+    for (auto *referenced : collectReferencedGlobals(*global)) {
+      worklist.push_back(referenced);
+    }
+  }
+
+  for (auto &fn : module) {
+    if (fn.isMaterializable()) {
+      fn.deleteBody();
+    }
+  }
+}
+
+// Hand the finished module to an in-process JIT and call main. The module and
+// its context move into the JIT, so the session is empty afterwards.
+static int runModule(EmitSession &session) {
+  materializeReachable(*session.TheModule, "main");
+
+  auto jit = ExitOnErr(llvm::orc::LLJITBuilder().create());
+  // Resolve printf and friends against the host process.
+  jit->getMainJITDylib().addGenerator(ExitOnErr(
+    llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(jit->getDataLayout().getGlobalPrefix())));
+
+  int (*mainFn)() = nullptr;
+  {
+    llvm::NamedRegionTimer timer("jit", "JIT compile", "emit_ir", "emit_ir stages", TimeStages);
+    session.Builder.reset();
+    llvm::orc::ThreadSafeModule module(std::move(session.TheModule), std::move(session.TheContext));
+    ExitOnErr(jit->addIRModule(std::move(module)));
+    // The lookup is what actually compiles main and its callees.
+    mainFn = llvm::jitTargetAddressToFunction<int (*)()>(ExitOnErr(jit->lookup("main")).getAddress());
+  }
+
+  llvm::NamedRegionTimer timer("execute", "Execute main", "emit_ir", "emit_ir stages", TimeStages);
+  return mainFn();
+}
+
+// Register and declare `count` functions through the registry, then do the
+// same the way declareFunction() used to: copy the name, look the prototype up
+// in a std::map and build a fresh FunctionType for every new declaration.
+static void benchmarkDeclare(EmitSession &session, unsigned count) {
+  std::vector<std::string> names;
+  names.reserve(count);
+  for (unsigned i = 0; i < count; ++i) {
+    names.push_back("fn." + std::to_string(i));
+  }
+  auto i32Ty = session.Builder->getInt32Ty();
+  FunProto proto = { i32Ty, { i32Ty, i32Ty }, false };
+  std::vector<FunRegistry::SymbolID> ids(count);
+
+  llvm::TimerGroup group("bench-declare", "Declaring " + std::to_string(count) + " functions");
+  llvm::Timer registerTimer("register", "registry: register prototypes", group);
+  llvm::Timer declareTimer("declare", "registry: declare by name", group);
+  llvm::Timer redeclareTimer("redeclare", "registry: redeclare by ID", group);
+  llvm::Timer mapRegisterTimer("map-register", "std::map: register prototypes", group);
+  llvm::Timer mapDeclareTimer("map-declare", "std::map: declare by name", group);
+  llvm::Timer mapRedeclareTimer("map-redeclare", "std::map: redeclare by name", group);
+
+  {
+    llvm::TimeRegion region(registerTimer);
+    for (unsigned i = 0; i < count; ++i) {
+      ids[i] = session.funRegistry.setProto(names[i], proto);
+    }
+  }
+  {
+    llvm::TimeRegion region(declareTimer);
+    for (auto &name : names) {
+      declareFunction(session, name);
+    }
+  }
+  {
+    llvm::TimeRegion region(redeclareTimer);
+    for (auto id : ids) {
+      declareFunction(session, id);
+    }
+  }
+
+  llvm::Module baseline("baseline", *session.TheContext);
+  std::map<std::string, FunProto> protoMap;
+  auto declareFromMap = [&](std::string name) {
+    auto* func = baseline.getFunction(name);
+    if (func == nullptr) {
+      FunProto funProto = protoMap[name];
+      auto* funcType = llvm::FunctionType::get(funProto.returnType, funProto.params, funProto.isVarArg);
+      func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, &baseline);
+      func->setDSOLocal(true);
+    }
+    return func;
+  };
+  {
+    llvm::TimeRegion region(mapRegisterTimer);
+    for (auto &name : names) {
+      protoMap[name] = proto;
+    }
+  }
+  {
+    llvm::TimeRegion region(mapDeclareTimer);
+    for (auto &name : names) {
+      declareFromMap(name);
+    }
+  }
+  {
+    llvm::TimeRegion region(mapRedeclareTimer);
+    for (auto &name : names) {
+      declareFromMap(name);
+    }
+  }
+}
+
+// Define a `count` element i32 array the way emitArray() used to, one
+// ConstantInt per element gathered into a ConstantArray, and through
+// defineGlobalArray(). Each runs in a context of its own, and the memory is
+// what the context still holds once the global is defined.
+static void benchmarkArray(unsigned count) {
+  std::vector<int32_t> values(count);
+  for (unsigned i = 0; i < count; ++i) {
+    // Distinct values, so the per-element path cannot share its constants.
+    values[i] = int32_t(i * 2654435761u);
+  }
+
+  llvm::TimerGroup group("bench-array", "Defining a " + std::to_string(count) + " element global array");
+  llvm::Timer perElementTimer("per-element", "ConstantArray: one Constant per element", group);
+  llvm::Timer packedTimer("packed", "ConstantDataArray: one packed buffer", group);
+
+  size_t perElementBytes = 0;
+  {
+    EmitSession session;
+    initializeModule(session);
+    auto before = llvm::sys::Process::GetMallocUsage();
+    {
+      llvm::TimeRegion region(perElementTimer);
+      auto arrType = llvm::ArrayType::get(session.Builder->getInt32Ty(), count);
+      std::vector<llvm::Constant *> list;
+      list.reserve(count);
+      for (auto value : values) {
+        list.push_back(session.Builder->getInt32(value));
+      }
+      defineGlobalVariable(session, arrType, "arr", llvm::ConstantArray::get(arrType, list));
+    }
+    perElementBytes = llvm::sys::Process::GetMallocUsage() - before;
+  }
+
+  size_t packedBytes = 0;
+  {
+    EmitSession session;
+    initializeModule(session);
+    auto before = llvm::sys::Process::GetMallocUsage();
+    {
+      llvm::TimeRegion region(packedTimer);
+      defineGlobalArray<int32_t>(session, "arr", values);
+    }
+    packedBytes = llvm::sys::Process::GetMallocUsage() - before;
+  }
+
+  llvm::outs() << "per-element: " << perElementBytes / 1024 << " KiB\n"
+               << "packed:      " << packedBytes / 1024 << " KiB\n";
 }
 
 int main(int argc, char *argv[]) {
-  initializeModule();
+  llvm::InitLLVM X(argc, argv);
+  llvm::cl::ParseCommandLineOptions(argc, argv, "emit LLVM IR for the example program\n");
 
-  auto targetTriple = llvm::sys::getDefaultTargetTriple();
-  TheModule->setTargetTriple(targetTriple);
+  // The JIT and the native writers both need the host target.
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
 
-  registerFunctionProto();
-  registerFunctionImpl();
+  EmitSession session;
+  initializeModule(session);
+
+  auto targetTriple = TargetTriple.empty() ? llvm::sys::getDefaultTargetTriple() : TargetTriple.getValue();
+  session.TheModule->setTargetTriple(targetTriple);
+  if (needsTargetDataLayout()) {
+    setTargetDataLayout(session);
+  }
 
-  emitProgram();
+  if (BenchArray > 0) {
+    benchmarkArray(BenchArray);
+    return 0;
+  }
+
+  if (BenchDeclare > 0) {
+    benchmarkDeclare(session, BenchDeclare);
+    return 0;
+  }
+
+  if (CheckParallel && Threads == 0) {
+    ExitOnErr(llvm::createStringError(llvm::inconvertibleErrorCode(), "--check-parallel needs --emit-threads"));
+  }
+
+  if (Incremental && (!EmitObject || CacheDir.empty())) {
+    ExitOnErr(llvm::createStringError(llvm::inconvertibleErrorCode(), "--incremental needs --emit-obj and --cache-dir"));
+  }
+
+  if (!InputFilename.empty()) {
+    llvm::NamedRegionTimer timer("load", "Load bitcode", "emit_ir", "emit_ir stages", TimeStages);
+    loadModuleBitcodeFromFile(session, InputFilename);
+  } else {
+    registerFunctionProto(session);
+    registerFunctionImpl(session);
+
+    llvm::NamedRegionTimer timer("emit", "Emit program", "emit_ir", "emit_ir stages", TimeStages);
+    if (Threads > 0) {
+      emitProgramParallel(session, Threads);
+    } else {
+      emitProgram(session);
+    }
+    if (CheckParallel) {
+      checkParallelEmission(session);
+    }
+    if (!EmbedFile.empty()) {
+      auto elemType = llvm::Type::getIntNTy(*session.TheContext, EmbedElementBits);
+      defineGlobalFromFile(session, "embedded", elemType, EmbedFile);
+    }
+  }
+
+  if (StructLayoutReport) {
+    reportStructLayouts(session, llvm::errs());
+  }
+
+  auto optimize = [&] {
+    if (OptLevel != '0') {
+      llvm::NamedRegionTimer timer("optimize", "Optimize", "emit_ir", "emit_ir stages", TimeStages);
+      optimizeModule(session);
+    }
+  };
+
+  if (RunMain) {
+    optimize();
+    return runModule(session);
+  }
+
+  // Both writers need every function body, and so does the cache key.
+  ExitOnErr(session.TheModule->materializeAll());
+  // The cached writers optimize only on a miss, so a hit skips the pipeline
+  // as well as code generation.
+  if (EmitBitcode) {
+    saveModuleCached(session, "./out.bc", [&] {
+      optimize();
+      llvm::NamedRegionTimer timer("output", "Write output", "emit_ir", "emit_ir stages", TimeStages);
+      saveModuleBitcodeToFile(session, "./out.bc");
+    });
+    return 0;
+  }
+  if (EmitObject && Incremental) {
+    optimize();
+    llvm::NamedRegionTimer timer("output", "Write output", "emit_ir", "emit_ir stages", TimeStages);
+    saveModuleIncrementally(session, "./out.a");
+    return 0;
+  }
+  if (EmitObject) {
+    saveModuleCached(session, "./out.o", [&] {
+      optimize();
+      llvm::NamedRegionTimer timer("output", "Write output", "emit_ir", "emit_ir stages", TimeStages);
+      saveModuleNativeToFile(session, "./out.o", llvm::CGFT_ObjectFile);
+    });
+    return 0;
+  }
+  if (EmitAssembly) {
+    saveModuleCached(session, "./out.s", [&] {
+      optimize();
+      llvm::NamedRegionTimer timer("output", "Write output", "emit_ir", "emit_ir stages", TimeStages);
+      saveModuleNativeToFile(session, "./out.s", llvm::CGFT_AssemblyFile);
+    });
+    return 0;
+  }
 
-  TheModule->print(llvm::outs(), nullptr);
+  optimize();
+  llvm::NamedRegionTimer timer("output", "Write output", "emit_ir", "emit_ir stages", TimeStages);
+  session.TheModule->print(llvm::outs(), nullptr);
 
-  saveModuleIRToFile("./out.ll");
+  saveModuleIRToFile(session, "./out.ll");
   return 0;
 }
@@ -1,10 +1,6 @@
 #!/usr/bin/bash
 
-clang++ emit_ir.cpp `llvm-config --cxxflags --ldflags --system-libs --libs core` -o emit_ir.out
-./emit_ir.out
-
-printf "\n"
-
-lli out.ll
+clang++ emit_ir.cpp `llvm-config --cxxflags --ldflags --system-libs --libs core linker bitreader bitwriter orcjit native object passes` -o emit_ir.out
+./emit_ir.out --run
 
 echo $?